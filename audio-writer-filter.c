@@ -1,6 +1,11 @@
 #include <obs-module.h>
 
 #include "audio-writer-filter.h"
+#include "flac-lpc.h"
+#include "io-service.h"
+#include "resample.h"
+#include "writer-memory.h"
+#include "writer-trace.h"
 #include "media-io/audio-math.h"
 #include "../UI/obs-frontend-api/obs-frontend-api.h"
 
@@ -12,98 +17,183 @@ OBS_MODULE_USE_DEFAULT_LOCALE("audio-writer-filter", "en-US")
 #define DEFAULT_FILENAME_FORMAT "audio-writer-filter [%SRC] %CCYY-%MM-%DD %hh-%mm-%ss"
 #define S_FOLDER_PATH "folder_path"
 #define TEXT_FOLDER_PATH obs_module_text("AudioWriterFilter.FolderPath")
+#define S_SESSION "session"
+#define TEXT_SESSION obs_module_text("AudioWriterFilter.Session")
 #define S_OUTPUT_ENCODER "output_encoder"
 #define TEXT_OUTPUT_ENCODER obs_module_text("AudioWriterFilter.OutputEncoder")
-
-extern void write_wav_packet(writer_data_t *, struct obs_audio_data *);
-extern void write_wav_placeholders(writer_data_t *);
-extern void write_coreaudio_aac_packet(writer_data_t *, struct obs_audio_data *);
-//extern void write_ffaac_packet(writer_data_t *, struct obs_audio_data *);
-extern void write_raw_packet(writer_data_t *, struct obs_audio_data *);
-
-/* Audio writer filter output formats */
-encoder_t encoders[] = {
-	{ "internal-wav",  "wav", write_wav_packet,           write_wav_placeholders },
-	{ "coreaudio-aac", "aac", write_coreaudio_aac_packet, NULL },
-//	{ "ffmpeg-aac",    "aac", write_ffaac_packet,         NULL },
-	{ "internal-raw",  "raw", write_raw_packet,           NULL },
-};
-
-static encoder_t *get_encoder_by_name(const char *encoder_name) {
-	for (int i = 0; i < sizeof(encoders) / sizeof(encoder_t); i++) {
-		if (0 == strcmp(encoder_name, encoders[i].name)) return &encoders[i];
-	}
-	return &encoders[0];
-}
-
-static const char *new_output_filename(writer_data_t *data)
+#define S_OUTPUT_BACKEND "output_backend"
+#define TEXT_OUTPUT_BACKEND obs_module_text("AudioWriterFilter.OutputBackend")
+#define S_SAMPLE_FORMAT "sample_format"
+#define TEXT_SAMPLE_FORMAT obs_module_text("AudioWriterFilter.SampleFormat")
+#define TEXT_SAMPLE_FORMAT_FLOAT32 obs_module_text("AudioWriterFilter.SampleFormat.Float32")
+#define TEXT_SAMPLE_FORMAT_INT16 obs_module_text("AudioWriterFilter.SampleFormat.Int16")
+#define TEXT_SAMPLE_FORMAT_INT24 obs_module_text("AudioWriterFilter.SampleFormat.Int24")
+#define TEXT_SAMPLE_FORMAT_INT32 obs_module_text("AudioWriterFilter.SampleFormat.Int32")
+#define S_FLAC_LEVEL "flac_level"
+#define TEXT_FLAC_LEVEL obs_module_text("AudioWriterFilter.FlacLevel")
+#define S_DITHER "dither"
+#define TEXT_DITHER obs_module_text("AudioWriterFilter.Dither")
+#define S_CHUNK_SHUFFLE "chunk_shuffle"
+#define TEXT_CHUNK_SHUFFLE obs_module_text("AudioWriterFilter.ChunkShuffle")
+#define S_WAV_RF64 "wav_rf64"
+#define TEXT_WAV_RF64 obs_module_text("AudioWriterFilter.WavRf64")
+#define S_CHECKPOINT_INTERVAL "checkpoint_interval"
+#define TEXT_CHECKPOINT_INTERVAL obs_module_text("AudioWriterFilter.CheckpointInterval")
+#define S_SILENCE_GATE "silence_gate"
+#define TEXT_SILENCE_GATE obs_module_text("AudioWriterFilter.SilenceGate")
+#define S_SILENCE_GATE_THRESHOLD "silence_gate_threshold"
+#define TEXT_SILENCE_GATE_THRESHOLD obs_module_text("AudioWriterFilter.SilenceGateThreshold")
+#define S_SILENCE_GATE_HOLD "silence_gate_hold"
+#define TEXT_SILENCE_GATE_HOLD obs_module_text("AudioWriterFilter.SilenceGateHold")
+#define S_PREROLL "preroll"
+#define TEXT_PREROLL obs_module_text("AudioWriterFilter.Preroll")
+#define S_SEGMENT_LENGTH "segment_length"
+#define TEXT_SEGMENT_LENGTH obs_module_text("AudioWriterFilter.SegmentLength")
+#define S_SEGMENT_SIZE "segment_size"
+#define TEXT_SEGMENT_SIZE obs_module_text("AudioWriterFilter.SegmentSize")
+#define S_ALSO_ENCODER "also_" // followed by the encoder name
+#define TEXT_ALSO_ENCODER obs_module_text("AudioWriterFilter.AlsoEncoder")
+#define S_PREALLOCATE_SIZE "preallocate_size"
+#define TEXT_PREALLOCATE_SIZE obs_module_text("AudioWriterFilter.PreallocateSize")
+#define S_STATS_INTERVAL "stats_interval"
+#define TEXT_STATS_INTERVAL obs_module_text("AudioWriterFilter.StatsInterval")
+#define S_STATS_FILE "stats_file"
+#define TEXT_STATS_FILE obs_module_text("AudioWriterFilter.StatsFile")
+#define S_STATS "stats"
+#define TEXT_STATS obs_module_text("AudioWriterFilter.Stats")
+#define S_OUTPUT_RATE "output_rate"
+#define TEXT_OUTPUT_RATE obs_module_text("AudioWriterFilter.OutputRate")
+#define TEXT_OUTPUT_SOURCE obs_module_text("AudioWriterFilter.OutputSource")
+#define S_OUTPUT_CHANNELS "output_channels"
+#define TEXT_OUTPUT_CHANNELS obs_module_text("AudioWriterFilter.OutputChannels")
+#define TEXT_OUTPUT_CHANNELS_MONO obs_module_text("AudioWriterFilter.OutputChannels.Mono")
+#define TEXT_OUTPUT_CHANNELS_STEREO obs_module_text("AudioWriterFilter.OutputChannels.Stereo")
+#define S_TRACE "trace"
+#define TEXT_TRACE obs_module_text("AudioWriterFilter.Trace")
+#define S_MEMORY_LIMIT "memory_limit"
+#define TEXT_MEMORY_LIMIT obs_module_text("AudioWriterFilter.MemoryLimit")
+#define S_MEMORY_BUDGET "memory_budget"
+#define TEXT_MEMORY_BUDGET obs_module_text("AudioWriterFilter.MemoryBudget")
+#define S_OVERFLOW "overflow"
+#define TEXT_OVERFLOW obs_module_text("AudioWriterFilter.Overflow")
+#define TEXT_OVERFLOW_DROP_NEWEST obs_module_text("AudioWriterFilter.Overflow.DropNewest")
+#define TEXT_OVERFLOW_DROP_OLDEST obs_module_text("AudioWriterFilter.Overflow.DropOldest")
+#define TEXT_OVERFLOW_DEGRADE obs_module_text("AudioWriterFilter.Overflow.Degrade")
+
+/* closes the file of the filter and the files of its extra encoders */
+static void close_files(writer_data_t *data)
 {
-	if (data->output_filename != NULL) bfree(data->output_filename);
-
-	struct dstr temp = { 0 };
-	dstr_init_copy(&temp, data->output_folder);
-	dstr_cat_ch(&temp, '/');
-	dstr_cat(&temp, data->output_filename_format);
-	dstr_replace(&temp, "%SRC", data->parent ? data->parent->context.name : "unknown");
-	data->output_filename = os_generate_formatted_filename(data->encoder->ext, true, temp.array);
-	dstr_free(&temp);
-
-	char *p = data->output_filename + strlen(data->output_folder) + 1;
-	while (*p) {
-		if (strchr("\\/:*?!&\"'<>|", *p)) *p = '_';
-		p++;
-	}
-
-	return data->output_filename;
+	close_output(data);
+	writer_fanout_close(data);
 }
 
-bool open_output(writer_data_t *data)
+static bool get_also_encoder(obs_data_t *settings, encoder_t *encoder)
 {
-	pthread_mutex_lock(&data->output_lock);
-	if (data->file == NULL) {
-		const char *new_filename = new_output_filename(data);
-		data->file = new_filename ? fopen(new_filename, "wb") : NULL;
-		data->data_length = 0;
-		data->file_has_header = false;
-	}
-	pthread_mutex_unlock(&data->output_lock);
-
-	return !!data->file;
+	struct dstr name = { 0 };
+	dstr_printf(&name, "%s%s", S_ALSO_ENCODER, encoder->name);
+	const bool selected = obs_data_get_bool(settings, name.array);
+	dstr_free(&name);
+	return selected;
 }
 
-void close_output(writer_data_t *data)
+static void replace_string(char **string, const char *value)
 {
-	pthread_mutex_lock(&data->output_lock);
-	if (data->file != NULL) {
-		if (data->encoder->write_finish) data->encoder->write_finish(data);
-		fclose(data->file);
-		data->file = NULL;
-	}
-	pthread_mutex_unlock(&data->output_lock);
+	bfree(*string);
+	*string = bstrdup(value);
 }
 
-static void writer_update(writer_data_t *data, obs_data_t *settings)
+/*
+* The settings that name and shape the file change with the writers locked,
+* which the writer thread holds for every block, and with output_lock, which
+* the start holds to open the file. A file that does not fit them any more is
+* closed in the same step, no packet of the old settings can reopen it. The
+* extra files follow in writer_fanout_set.
+*/
+static void update_file(writer_data_t *data, obs_data_t *settings)
 {
-	data->output_folder = obs_data_get_string(settings, S_FOLDER_PATH);
+	const char *folder = obs_data_get_string(settings, S_FOLDER_PATH);
+	encoder_t *new_encoder = writer_get_encoder(obs_data_get_string(settings, S_OUTPUT_ENCODER));
+	output_t *new_output = writer_get_output(obs_data_get_string(settings, S_OUTPUT_BACKEND));
+	enum sample_format new_format = (enum sample_format)obs_data_get_int(settings, S_SAMPLE_FORMAT);
+	bool new_gate = obs_data_get_bool(settings, S_SILENCE_GATE);
+
+	writer_fanout_lock(data);
+	pthread_mutex_lock(&data->output_lock);
+	bool folder_changed = false;
 	if (data->output_filename) {
-		bool folder_changed = false;
 		char *last_slash = strrchr(data->output_filename, '/');
 		if (last_slash) {
 			*last_slash = 0;
-			folder_changed = strcmp(data->output_folder, data->output_filename);
+			folder_changed = strcmp(folder, data->output_filename);
 			*last_slash = '/';
 		}
-		if (folder_changed)
-			close_output(data);
 	}
-	data->output_filename_format = obs_data_get_string(settings, S_FILENAME_FORMAT);
+	// the index describes a whole file, switching the gate starts a new one
+	if (folder_changed || new_encoder != data->encoder || new_output != data->output || new_format != data->sample_format || new_gate != data->gate.enabled)
+		output_close(data);
+
+	replace_string(&data->output_folder, folder);
+	replace_string(&data->output_filename_format, obs_data_get_string(settings, S_FILENAME_FORMAT));
+	replace_string(&data->stats_file, obs_data_get_string(settings, S_STATS_FILE));
+	data->encoder = new_encoder;
+	data->output = new_output;
+	data->sample_format = new_format;
+	data->gate.enabled = new_gate;
+	pthread_mutex_unlock(&data->output_lock);
+	writer_fanout_unlock(data);
+}
 
-	const char *encoder_name = obs_data_get_string(settings, S_OUTPUT_ENCODER);
-	encoder_t *new_encoder = get_encoder_by_name(encoder_name);
-	if (new_encoder != data->encoder) {
-		close_output(data);
-		data->encoder = new_encoder;
+static void writer_update(writer_data_t *data, obs_data_t *settings)
+{
+	update_file(data, settings);
+	// the writer thread converts to the new format between two blocks, gate and segments count converted frames
+	data->convert_rate = (uint32_t)obs_data_get_int(settings, S_OUTPUT_RATE);
+	data->convert_channels = (uint32_t)obs_data_get_int(settings, S_OUTPUT_CHANNELS);
+	const uint32_t rate = data->convert_rate ? data->convert_rate : data->source_info.samples_per_sec;
+
+	data->gate.open_level = db_to_mul((float)obs_data_get_int(settings, S_SILENCE_GATE_THRESHOLD));
+	data->gate.hold_frames = (uint32_t)((uint64_t)rate * obs_data_get_int(settings, S_SILENCE_GATE_HOLD) / 1000);
+	data->flac_level = (uint32_t)obs_data_get_int(settings, S_FLAC_LEVEL);
+	data->dither = obs_data_get_bool(settings, S_DITHER);
+	data->chunk_shuffle = obs_data_get_bool(settings, S_CHUNK_SHUFFLE);
+	data->wav_rf64 = obs_data_get_bool(settings, S_WAV_RF64);
+	data->checkpoint_interval = (uint32_t)obs_data_get_int(settings, S_CHECKPOINT_INTERVAL);
+	data->preroll_ms = (uint32_t)obs_data_get_int(settings, S_PREROLL) * 1000;
+	data->segment.max_frames = (uint64_t)rate * 60 * obs_data_get_int(settings, S_SEGMENT_LENGTH);
+	data->segment.max_bytes = (uint64_t)obs_data_get_int(settings, S_SEGMENT_SIZE) * 1024 * 1024;
+	data->preallocate_size = (uint64_t)obs_data_get_int(settings, S_PREALLOCATE_SIZE) * 1024 * 1024;
+	data->stats_interval = (uint32_t)obs_data_get_int(settings, S_STATS_INTERVAL);
+	// a new limit resizes the ring between recordings, the policy applies to the next push
+	data->memory_limit = (uint64_t)obs_data_get_int(settings, S_MEMORY_LIMIT) * 1024 * 1024;
+	// shared by all filters, the one saved last sets it
+	writer_memory_set_budget((size_t)obs_data_get_int(settings, S_MEMORY_BUDGET) * 1024 * 1024);
+	data->overflow = (enum writer_overflow)obs_data_get_int(settings, S_OVERFLOW);
+	os_atomic_set_bool(&data->ring.overwrite, data->overflow == WRITER_OVERFLOW_DROP_OLDEST);
+
+	bool new_trace = obs_data_get_bool(settings, S_TRACE);
+	if (new_trace != data->trace) {
+		writer_trace_use(new_trace);
+		data->trace = new_trace;
 	}
+
+	const char *session_name = obs_data_get_string(settings, S_SESSION);
+	if (0 != strcmp(session_name, data->session ? writer_session_name(data->session) : "")) {
+		if (data->session) writer_session_leave(data->session, data);
+		close_files(data);
+		data->session = *session_name ? writer_session_join(session_name, data) : NULL;
+		if (data->session && writer_recording(data)) writer_session_start(data->session, data);
+	}
+
+	// sessions write the main encoder only
+	encoder_t *also[WRITER_FANOUT_MAX];
+	size_t also_count = 0;
+	for (size_t i = 0; i < encoders_count && also_count < WRITER_FANOUT_MAX; i++) {
+		if (&encoders[i] != data->encoder && !data->session && get_also_encoder(settings, &encoders[i])) also[also_count++] = &encoders[i];
+	}
+	writer_fanout_set(data, also, also_count);
+
+	// a file closed by the new settings is reopened right away, not by the next packet
+	if (writer_recording(data)) writer_engine_prepare(data);
 }
 
 static const char *writer_get_name(writer_data_t *data)
@@ -113,16 +203,51 @@ static const char *writer_get_name(writer_data_t *data)
 	return obs_module_text("Audio Writer");
 }
 
+/* the name is copied because the writer thread may need it after a rename */
+static void writer_refresh_source_name(writer_data_t *data)
+{
+	if (data->parent == NULL) return;
+
+	const char *name = obs_source_get_name(data->parent);
+	if (data->source_name && name && 0 == strcmp(data->source_name, name)) return;
+
+	pthread_mutex_lock(&data->output_lock);
+	if (data->source_name) bfree(data->source_name);
+	data->source_name = name ? bstrdup(name) : NULL;
+	pthread_mutex_unlock(&data->output_lock);
+
+	writer_fanout_rename(data);
+}
+
+/*
+* Recordings and streams are counted on the frontend thread, the first start
+* and the last stop move the recording state. A stop without a start, of a
+* recording that was running when the filter was added, is ignored.
+*/
 static void frontend_event_callback(enum obs_frontend_event event, writer_data_t *data)
 {
 	switch (event) {
+	case OBS_FRONTEND_EVENT_STREAMING_STARTING:
+	case OBS_FRONTEND_EVENT_RECORDING_STARTING:
+		if (data->triggers == 0) {
+			writer_refresh_source_name(data);
+			writer_engine_prepare(data);
+		}
+		break;
 	case OBS_FRONTEND_EVENT_STREAMING_STARTED:
 	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
-		if (++data->writing_triggers_count > 0) open_output(data);
+		if (data->triggers++ == 0) {
+			writer_refresh_source_name(data);
+			writer_engine_start(data);
+		}
 		break;
 	case OBS_FRONTEND_EVENT_RECORDING_STOPPING:
 	case OBS_FRONTEND_EVENT_STREAMING_STOPPING:
-		if (--data->writing_triggers_count <= 0) close_output(data);
+		if (data->triggers > 0 && --data->triggers == 0) writer_engine_stop(data);
+		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPED:
+	case OBS_FRONTEND_EVENT_STREAMING_STOPPED:
+		if (data->triggers == 0) writer_engine_disarm(data);
 		break;
 	}
 }
@@ -131,8 +256,23 @@ static void *writer_create(obs_data_t *settings, obs_source_t *filter)
 {
 	writer_data_t *data = (writer_data_t *)bzalloc(sizeof(writer_data_t));
 	data->filter = filter;
-	pthread_mutex_init(&data->output_lock, NULL);
+
+	struct obs_audio_info audio_info;
+	obs_get_audio_info(&audio_info);
+
+	struct resample_info sample_info = {
+		audio_info.samples_per_sec,
+		AUDIO_FORMAT_FLOAT_PLANAR,
+		audio_info.speakers
+	};
+	// the ring is sized for the pre-roll and the limit once here instead of being resized by the first update
+	data->preroll_ms = (uint32_t)obs_data_get_int(settings, S_PREROLL) * 1000;
+	data->memory_limit = (uint64_t)obs_data_get_int(settings, S_MEMORY_LIMIT) * 1024 * 1024;
+	writer_memory_set_budget((size_t)obs_data_get_int(settings, S_MEMORY_BUDGET) * 1024 * 1024);
+	if (!writer_engine_init(data, &sample_info)) WRITER_LOG(LOG_ERROR, "failed to start writer thread");
+
 	writer_update(data, settings);
+
 	obs_frontend_add_event_callback(frontend_event_callback, data);
 	return data;
 }
@@ -141,16 +281,14 @@ static void writer_destroy(writer_data_t *data)
 {
 	obs_frontend_remove_event_callback(frontend_event_callback, data);
 
-	close_output(data);
-
-	if (data->output_filename != NULL) bfree(data->output_filename);
+	if (data->session) writer_session_leave(data->session, data);
+	writer_engine_free(data);
+	if (data->trace) writer_trace_use(false);
 
-	circlebuf_free(&data->input_buffer);
-	circlebuf_free(&data->encode_buffer);
-	circlebuf_free(&data->output_buffer);
-	circlebuf_free(&data->interleaved_buffer);
-
-	pthread_mutex_destroy(&data->output_lock);
+	if (data->source_name != NULL) bfree(data->source_name);
+	bfree(data->output_folder);
+	bfree(data->output_filename_format);
+	bfree(data->stats_file);
 	bfree(data);
 }
 
@@ -159,12 +297,9 @@ static struct obs_audio_data *writer_filter_audio(writer_data_t *data, struct ob
 	if (data->parent == NULL) {
 		if (data->filter->filter_parent == NULL) return audio;
 		data->parent = data->filter->filter_parent;
-		data->sample_info = data->parent->sample_info;
 	}
 
-	if (data->writing_triggers_count > 0) {
-		data->encoder->write_packet(data, audio);
-	}
+	writer_engine_push(data, audio);
 
 	return audio;
 }
@@ -182,6 +317,29 @@ static void writer_get_defaults(obs_data_t *settings)
 	obs_data_set_default_string(settings, S_FOLDER_PATH, get_homedir());
 	obs_data_set_default_string(settings, S_OUTPUT_ENCODER, encoders[0].name);
 	obs_data_set_default_string(settings, S_FILENAME_FORMAT, DEFAULT_FILENAME_FORMAT);
+	obs_data_set_default_string(settings, S_SESSION, "");
+	obs_data_set_default_string(settings, S_OUTPUT_BACKEND, outputs[0]->name);
+	obs_data_set_default_int(settings, S_SAMPLE_FORMAT, SAMPLE_FORMAT_FLOAT32);
+	obs_data_set_default_int(settings, S_FLAC_LEVEL, 5);
+	obs_data_set_default_bool(settings, S_DITHER, true);
+	obs_data_set_default_bool(settings, S_CHUNK_SHUFFLE, true);
+	obs_data_set_default_bool(settings, S_WAV_RF64, true);
+	obs_data_set_default_int(settings, S_CHECKPOINT_INTERVAL, 10);
+	obs_data_set_default_int(settings, S_PREROLL, 0);
+	obs_data_set_default_bool(settings, S_SILENCE_GATE, false);
+	obs_data_set_default_int(settings, S_SILENCE_GATE_THRESHOLD, -50);
+	obs_data_set_default_int(settings, S_SILENCE_GATE_HOLD, 1000);
+	obs_data_set_default_int(settings, S_SEGMENT_LENGTH, 0);
+	obs_data_set_default_int(settings, S_SEGMENT_SIZE, 0);
+	obs_data_set_default_int(settings, S_PREALLOCATE_SIZE, 64);
+	obs_data_set_default_int(settings, S_STATS_INTERVAL, 0);
+	obs_data_set_default_string(settings, S_STATS_FILE, "");
+	obs_data_set_default_bool(settings, S_TRACE, false);
+	obs_data_set_default_int(settings, S_OUTPUT_RATE, 0);
+	obs_data_set_default_int(settings, S_OUTPUT_CHANNELS, 0);
+	obs_data_set_default_int(settings, S_MEMORY_LIMIT, 0);
+	obs_data_set_default_int(settings, S_MEMORY_BUDGET, WRITER_MEMORY_DEFAULT_BUDGET / (1024 * 1024));
+	obs_data_set_default_int(settings, S_OVERFLOW, WRITER_OVERFLOW_DROP_NEWEST);
 }
 
 static obs_properties_t *writer_get_properties(writer_data_t *data)
@@ -190,17 +348,93 @@ static obs_properties_t *writer_get_properties(writer_data_t *data)
 
 	obs_properties_add_path(properties, S_FOLDER_PATH, TEXT_FOLDER_PATH, OBS_PATH_DIRECTORY, NULL, data->output_folder);
 	obs_properties_add_text(properties, S_FILENAME_FORMAT, TEXT_FILENAME_FORMAT, OBS_TEXT_DEFAULT);
+	obs_properties_add_text(properties, S_SESSION, TEXT_SESSION, OBS_TEXT_DEFAULT);
 
 	obs_property_t *property = obs_properties_add_list(properties, S_OUTPUT_ENCODER, TEXT_OUTPUT_ENCODER, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
-	for (int i = 0; i < sizeof(encoders) / sizeof(encoder_t); i++) {
+	for (size_t i = 0; i < encoders_count; i++) {
 		obs_property_list_add_string(property, encoders[i].name, encoders[i].name);
 	}
 
+	struct dstr name = { 0 }, text = { 0 };
+	for (size_t i = 0; i < encoders_count; i++) {
+		dstr_printf(&name, "%s%s", S_ALSO_ENCODER, encoders[i].name);
+		dstr_printf(&text, "%s %s", TEXT_ALSO_ENCODER, encoders[i].name);
+		obs_properties_add_bool(properties, name.array, text.array);
+	}
+	dstr_free(&name);
+	dstr_free(&text);
+
+	property = obs_properties_add_list(properties, S_OUTPUT_BACKEND, TEXT_OUTPUT_BACKEND, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	for (size_t i = 0; i < outputs_count; i++) {
+		obs_property_list_add_string(property, outputs[i]->name, outputs[i]->name);
+	}
+
+	property = obs_properties_add_list(properties, S_SAMPLE_FORMAT, TEXT_SAMPLE_FORMAT, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(property, TEXT_SAMPLE_FORMAT_FLOAT32, SAMPLE_FORMAT_FLOAT32);
+	obs_property_list_add_int(property, TEXT_SAMPLE_FORMAT_INT16, SAMPLE_FORMAT_INT16);
+	obs_property_list_add_int(property, TEXT_SAMPLE_FORMAT_INT24, SAMPLE_FORMAT_INT24);
+	obs_property_list_add_int(property, TEXT_SAMPLE_FORMAT_INT32, SAMPLE_FORMAT_INT32);
+
+	property = obs_properties_add_list(properties, S_OUTPUT_RATE, TEXT_OUTPUT_RATE, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(property, TEXT_OUTPUT_SOURCE, 0);
+	static const uint32_t rates[] = { 8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000 };
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		dstr_printf(&text, "%u Hz", rates[i]);
+		obs_property_list_add_int(property, text.array, rates[i]);
+	}
+	dstr_free(&text);
+
+	property = obs_properties_add_list(properties, S_OUTPUT_CHANNELS, TEXT_OUTPUT_CHANNELS, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(property, TEXT_OUTPUT_SOURCE, 0);
+	obs_property_list_add_int(property, TEXT_OUTPUT_CHANNELS_MONO, 1);
+	obs_property_list_add_int(property, TEXT_OUTPUT_CHANNELS_STEREO, 2);
+
+	obs_properties_add_int_slider(properties, S_FLAC_LEVEL, TEXT_FLAC_LEVEL, 0, 8, 1);
+	obs_properties_add_bool(properties, S_DITHER, TEXT_DITHER);
+	obs_properties_add_bool(properties, S_CHUNK_SHUFFLE, TEXT_CHUNK_SHUFFLE);
+	obs_properties_add_bool(properties, S_WAV_RF64, TEXT_WAV_RF64);
+	obs_properties_add_int(properties, S_CHECKPOINT_INTERVAL, TEXT_CHECKPOINT_INTERVAL, 0, 3600, 1);
+	obs_properties_add_int(properties, S_PREROLL, TEXT_PREROLL, 0, 60, 1);
+	obs_properties_add_int(properties, S_MEMORY_LIMIT, TEXT_MEMORY_LIMIT, 0, 4096, 1);
+	obs_properties_add_int(properties, S_MEMORY_BUDGET, TEXT_MEMORY_BUDGET, 16, 16384, 16);
+
+	property = obs_properties_add_list(properties, S_OVERFLOW, TEXT_OVERFLOW, OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(property, TEXT_OVERFLOW_DROP_NEWEST, WRITER_OVERFLOW_DROP_NEWEST);
+	obs_property_list_add_int(property, TEXT_OVERFLOW_DROP_OLDEST, WRITER_OVERFLOW_DROP_OLDEST);
+	obs_property_list_add_int(property, TEXT_OVERFLOW_DEGRADE, WRITER_OVERFLOW_DEGRADE);
+
+	obs_properties_add_bool(properties, S_SILENCE_GATE, TEXT_SILENCE_GATE);
+	obs_properties_add_int(properties, S_SILENCE_GATE_THRESHOLD, TEXT_SILENCE_GATE_THRESHOLD, -96, 0, 1);
+	obs_properties_add_int(properties, S_SILENCE_GATE_HOLD, TEXT_SILENCE_GATE_HOLD, 0, 10000, 100);
+	obs_properties_add_int(properties, S_SEGMENT_LENGTH, TEXT_SEGMENT_LENGTH, 0, 1440, 1);
+	obs_properties_add_int(properties, S_SEGMENT_SIZE, TEXT_SEGMENT_SIZE, 0, 1048576, 64);
+	obs_properties_add_int(properties, S_PREALLOCATE_SIZE, TEXT_PREALLOCATE_SIZE, 0, 1024, 16);
+	obs_properties_add_int(properties, S_STATS_INTERVAL, TEXT_STATS_INTERVAL, 0, 3600, 1);
+	obs_properties_add_path(properties, S_STATS_FILE, TEXT_STATS_FILE, OBS_PATH_FILE_SAVE, "*.json *.csv", NULL);
+	obs_properties_add_bool(properties, S_TRACE, TEXT_TRACE);
+
+	// the counters as they were when the dialog was opened
+	struct dstr stats = { 0 };
+	writer_stats_format(data, &stats);
+	property = obs_properties_add_text(properties, S_STATS, TEXT_STATS, OBS_TEXT_INFO);
+	obs_property_set_long_description(property, stats.array);
+	dstr_free(&stats);
+
 	return properties;
 }
 
 bool obs_module_load(void)
 {
+	interleave_init();
+	flac_lpc_init();
+	resample_init();
+	io_service_init(IO_SERVICE_DEFAULT_BUDGET);
+#ifdef __linux__
+	uring_output_init();
+#endif
+	writer_memory_init(WRITER_MEMORY_DEFAULT_BUDGET);
+	WRITER_LOG(LOG_INFO, "using %s interleave kernels, %s FLAC kernels, %s resampler kernels", interleave_kernel_name(), flac_lpc_kernel_name(), resample_kernel_name());
+
 	struct obs_source_info audio_writer_filter = {
 		.id = "audio_writer_filter",
 		.type = OBS_SOURCE_TYPE_FILTER,
@@ -216,3 +450,11 @@ bool obs_module_load(void)
 	obs_register_source(&audio_writer_filter);
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	writer_sessions_free();
+	writer_memory_free();
+	io_service_free();
+	writer_trace_free();
+}
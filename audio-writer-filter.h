@@ -1,21 +1,109 @@
 #include "obs-internal.h"
 #include "util/circlebuf.h"
+#include "writer-ring.h"
+#include "writer-stats.h"
+#include "writer-trace.h"
+#include "interleave.h"
 
 #define BYTES_PER_SAMPLE 4 // always 4 as OBS uses AUDIO_FORMAT_FLOAT
+#define WRITER_RING_MS 2000 // how much audio the writer thread may lag behind
+#define WRITER_FANOUT_MAX 8 // extra encoders of one filter
+#define WRITER_BLOCK_FRAMES 4096 // most frames passed to the encoders at once
+
+#define WRITER_LOG(level, format, ...) blog(level, "[audio writer filter] " format, ##__VA_ARGS__)
+
+/* Output sink: where the encoded bytes go */
+typedef const struct {
+	const char *name;
+	void *(*open)(const char *path);
+	size_t (*write)(void *sink, const void *buffer, size_t size);
+	bool (*write_at)(void *sink, uint64_t offset, const void *buffer, size_t size);
+	void (*sync)(void *sink);
+	void (*close)(void *sink);
+	bool (*preallocate)(void *sink, uint64_t offset, uint64_t length); // without changing the file size
+	void (*trim)(void *sink, uint64_t size, uint64_t allocated); // releases the unused preallocation
+	void *(*map)(void *sink, size_t size); // appends size bytes the caller fills in place, NULL if it cannot
+} output_t;
 
 typedef const struct {
 	const char *name;
 	const char *ext;
 	void (*write_packet)(void*,void*);
 	void (*write_finish)(void*);
+	void (*write_checkpoint)(void*);
+	bool (*prepare)(void*); // allocates the encoder state ahead of the first packet
+	void (*release)(void*); // frees it, does nothing when there is none
 } encoder_t;
 
+/*
+* Recording state of a filter. The frontend thread moves it from idle or
+* closed to arming when a start is announced, to recording when it happens
+* and to draining on the stop, the writer thread moves it to closed once the
+* file is finished. The audio thread only loads it.
+*/
+enum writer_state {
+	WRITER_IDLE,
+	WRITER_ARMING,          // the file is being prepared, nothing is written yet
+	WRITER_RECORDING,
+	WRITER_DRAINING,        // stopped, the frames up to the stop position are still written
+	WRITER_CLOSED,
+};
+
+typedef struct writer_session writer_session_t;
+typedef struct writer_session_input writer_session_input_t;
+typedef struct writer_fanout writer_fanout_t;
+typedef struct writer_convert writer_convert_t;
+
+/* what a full writer queue gives up, see writer-memory.c */
+enum writer_overflow {
+	WRITER_OVERFLOW_DROP_NEWEST,  // the pushed packet, the queued audio stays intact
+	WRITER_OVERFLOW_DROP_OLDEST,  // the oldest queued frames, the newest audio is kept
+	WRITER_OVERFLOW_DEGRADE,      // drops the newest, but encodes faster while the queue is filling
+};
+
+/* voice activated writing, see silence-gate.c */
+typedef struct {
+	bool enabled;
+	float open_level;       // peak that opens the gate, linear
+	uint32_t hold_frames;   // quiet frames before it closes
+	bool open;
+	uint64_t position;      // frames since the file was opened, written or not
+	uint64_t segment_start;
+	uint64_t loud_end;      // end of the last block that kept the gate open
+	uint32_t serial;        // bumped when the file is closed
+	FILE *index;
+} silence_gate_t;
+
+/* time and size based file segments, see writer-segment.c */
+typedef struct {
+	uint64_t max_frames;    // 0 when the length is not limited
+	uint64_t max_bytes;     // 0 when the size is not limited
+	uint64_t frames;        // passed to the current file, written or not
+
+	char *next_filename;    // set once the next file is prepared
+	output_t *next_output;
+	void *next_sink;        // NULL until the opener is joined, or when it failed
+	pthread_t opener;
+	bool opening;
+
+	output_t *closing_output; // the finished file, trimmed and closed by the closer
+	void *closing_sink;
+	uint64_t closing_position;
+	uint64_t closing_allocated;
+	pthread_t closer;
+	bool closing;
+} writer_segment_t;
+
 typedef struct {
 	obs_source_t *filter;
 	obs_source_t *parent;
-	int writing_triggers_count;
-	struct resample_info sample_info;
+	char *source_name;
+	volatile long state;        // enum writer_state
+	int triggers;               // started recordings and streams, frontend thread only
+	struct resample_info source_info;   // of the pushed packets
+	struct resample_info sample_info;   // of the written audio, differs when it is converted
 	uint32_t bytes_per_input_packet;
+	uint32_t max_output_packet_size;
 	uint32_t bit_rate;
 	
 	void *converter;
@@ -25,42 +113,269 @@ typedef struct {
 	struct circlebuf output_buffer;
 	struct circlebuf interleaved_buffer;
 
-	const char *output_folder;
+	char *output_folder;        // the strings are copies, changed under output_lock
 	const char *output_ext;
-	const char *output_filename_format;
+	char *output_filename_format;
 	char *output_filename;
 	encoder_t *encoder;
+	encoder_t *prepared_encoder; // whose state the writer thread holds
+	output_t *output;
+	writer_session_t *session;
+	writer_session_input_t *session_input; // where the audio thread pushes while it is a member
+	writer_session_t *merging;  // on a session engine, the writer thread merges its members
+	writer_fanout_t *fanout;    // extra encoders of the filter, shared with their writers
 
-	FILE *file;
+	void *sink;
+	enum sample_format sample_format;
+	bool dither;
+	uint32_t dither_state[INTERLEAVE_MAX_CHANNELS];
+	bool wav_rf64;
+	bool wav_ds64; // the header of the open file reserves the ds64 chunk
 	bool file_has_header;
-	uint32_t data_length;
+	uint32_t header_length;
+	uint64_t data_length;
+	uint32_t flac_level;
+	void *flac;
+	bool chunk_shuffle;
+	void *chunks;
+	void *planar;
+	uint32_t checkpoint_interval;
+	uint64_t last_checkpoint_time;
+	uint64_t preallocate_size;
+	uint64_t output_position;
+	uint64_t output_allocated;
+	silence_gate_t gate;
+	writer_segment_t segment;
 	pthread_mutex_t output_lock;
+
+	writer_ring_t ring;
+	float *ring_copy[MAX_AV_PLANES]; // WRITER_BLOCK_FRAMES per channel, the blocks of an overwriting ring
+	uint32_t preroll_ms;        // requested by the settings
+	uint32_t preroll_frames;    // kept in the ring while not recording, set by the writer thread
+	volatile long stop_position; // ring position where the last recording ended
+	pthread_t writer_thread;
+	os_event_t *writer_event;
+	volatile bool writer_active;
+	volatile bool close_requested;
+	volatile bool prepare_requested;
+	long dropped_frames_reported;
+	uint64_t memory_limit;      // bytes of the ring, 0 when only the process budget limits it
+	uint64_t ring_limit;        // the memory_limit the ring was last sized for
+	uint32_t ring_wanted_frames; // the writer_ring_frames it was last sized for
+	size_t ring_bytes;          // reserved from the process budget
+	enum writer_overflow overflow;
+	bool degraded;              // set by the writer thread, the encoders trade size for speed
+
+	writer_stats_t *stats;      // shared with the fan-out writers
+	uint32_t stats_interval;    // seconds between the summaries, 0 for none
+	char *stats_file;
+	bool trace;                 // dumps the trace of the process when a recording is closed
+
+	uint32_t convert_rate;      // requested by the settings, 0 keeps the source rate
+	uint32_t convert_channels;  // requested by the settings, 0 keeps the source channels
+	uint32_t converted_rate;    // what the conversion stage was last built for
+	uint32_t converted_channels;
+	writer_convert_t *convert;  // NULL when the source format is written
 } writer_data_t;
 
+extern encoder_t encoders[];
+extern const size_t encoders_count;
+extern output_t file_output;
+extern output_t *outputs[];
+#ifdef __linux__
+void uring_output_init(void);
+#endif
+extern const size_t outputs_count;
+
+encoder_t *writer_get_encoder(const char *encoder_name);
+output_t *writer_get_output(const char *output_name);
+
 bool open_output(writer_data_t *data);
+bool output_lock_open(writer_data_t *data);
 void close_output(writer_data_t *data);
+void output_close(writer_data_t *data);
+void output_reset(writer_data_t *data);
+void output_release(output_t *output, void *sink, uint64_t position, uint64_t allocated);
+char *output_next_filename(writer_data_t *data);
+void output_preallocate(writer_data_t *data, size_t size);
+
+void writer_file_init(writer_data_t *data);
+void writer_file_free(writer_data_t *data);
+
+bool writer_engine_init(writer_data_t *data, const struct resample_info *sample_info);
+void writer_engine_free(writer_data_t *data);
+void writer_engine_push(writer_data_t *data, const struct obs_audio_data *audio);
+void writer_engine_prepare(writer_data_t *data);
+void writer_engine_start(writer_data_t *data);
+void writer_engine_stop(writer_data_t *data);
+void writer_engine_disarm(writer_data_t *data);
+
+writer_session_t *writer_session_join(const char *name, writer_data_t *data);
+void writer_session_leave(writer_session_t *session, writer_data_t *data);
+const char *writer_session_name(writer_session_t *session);
+void writer_session_push(writer_data_t *data, const struct obs_audio_data *audio);
+void writer_session_merge(writer_session_t *session, writer_data_t *engine);
+void writer_session_input_free(writer_data_t *data);
+void writer_session_start(writer_session_t *session, writer_data_t *data);
+void writer_session_stop(writer_session_t *session, writer_data_t *data);
+void writer_sessions_free(void);
+
+writer_fanout_t *writer_fanout_create(void);
+void writer_fanout_set(writer_data_t *data, encoder_t **encoders, size_t count);
+void writer_fanout_close(writer_data_t *data);
+void writer_fanout_lock(writer_data_t *data);
+void writer_fanout_unlock(writer_data_t *data);
+void writer_fanout_rename(writer_data_t *data);
+void writer_fanout_format(writer_data_t *data);
+void writer_fanout_each(writer_data_t *data, void (*callback)(writer_data_t *writer));
+void writer_fanout_write(writer_data_t *data, struct obs_audio_data *audio);
+void *writer_fanout_samples(writer_data_t *data, struct obs_audio_data *audio, enum sample_format format, bool dither);
+void writer_fanout_free(writer_data_t *data);
+
+void silence_gate_open(writer_data_t *data);
+void silence_gate_close(writer_data_t *data);
+void silence_gate_flush(writer_data_t *data);
+void silence_gate_write(writer_data_t *data, struct obs_audio_data *audio);
+
+void writer_segment_write(writer_data_t *data, struct obs_audio_data *audio);
+void writer_segment_switch(writer_data_t *data);
+void writer_segment_discard(writer_data_t *data);
+void writer_segment_free(writer_data_t *data);
+
+void writer_convert_apply(writer_data_t *data);
+void writer_convert_update(writer_data_t *data);
+bool writer_convert_block(writer_data_t *data, struct obs_audio_data *audio);
+void writer_convert_flush(writer_data_t *data);
+void writer_convert_free(writer_data_t *data);
+
+uint32_t writer_memory_ring_frames(writer_data_t *data);
+void writer_memory_release(writer_data_t *data);
+
+void writer_stats_format(writer_data_t *data, struct dstr *text);
+void writer_stats_report(writer_data_t *data);
+
+bool writer_thread_start(writer_data_t *data);
+void writer_thread_stop(writer_data_t *data);
+void writer_thread_request_close(writer_data_t *data);
+void writer_thread_request_prepare(writer_data_t *data);
+
+static inline bool writer_recording(writer_data_t *data)
+{
+	return os_atomic_load_long(&data->state) == WRITER_RECORDING;
+}
+
+static inline uint32_t writer_preroll_frames(writer_data_t *data)
+{
+	return (uint32_t)((uint64_t)data->source_info.samples_per_sec * data->preroll_ms / 1000);
+}
+
+/* the ring holds the pre-roll on top of the writer lag */
+static inline uint32_t writer_ring_frames(writer_data_t *data)
+{
+	return data->source_info.samples_per_sec * WRITER_RING_MS / 1000 + writer_preroll_frames(data);
+}
+
+/* the pre-roll never takes more than half of a ring cut by the memory limits */
+static inline uint32_t writer_ring_preroll(writer_data_t *data)
+{
+	const uint32_t frames = writer_preroll_frames(data);
+	return frames < data->ring.capacity / 2 ? frames : data->ring.capacity / 2;
+}
+
+static inline size_t output_write(writer_data_t *data, const void *buffer, size_t size)
+{
+	if (data->output_position + size > data->output_allocated) output_preallocate(data, size);
+
+	const uint64_t trace = writer_trace_begin();
+	const uint64_t start = os_gettime_ns();
+	size_t written = data->output->write(data->sink, buffer, size);
+	writer_stats_add_write(data->stats, os_gettime_ns() - start, written);
+	writer_trace_end("output write", trace);
+
+	data->output_position += written;
+	return written;
+}
+
+/* takes output_lock for an encoder, the wait shows up in a trace */
+static inline void output_lock_wait(writer_data_t *data)
+{
+	const uint64_t trace = writer_trace_begin();
+	pthread_mutex_lock(&data->output_lock);
+	writer_trace_end("output_lock wait", trace);
+}
+
+static inline bool output_write_at(writer_data_t *data, uint64_t offset, const void *buffer, size_t size)
+{
+	return data->output->write_at(data->sink, offset, buffer, size);
+}
+
+/* a mono float packet already is in the interleaved layout, it is written without a copy */
+static inline void *mono_samples(writer_data_t *data, struct obs_audio_data *audio, enum sample_format format)
+{
+	return data->sample_info.speakers == 1 && format == SAMPLE_FORMAT_FLOAT32 ? audio->data[0] : NULL;
+}
 
 static inline void *fill_interleaved_buffer(writer_data_t *data, struct obs_audio_data *audio)
 {
-	const size_t channels = data->sample_info.speakers;
+	void *mono = mono_samples(data, audio, SAMPLE_FORMAT_FLOAT32);
+	if (mono) return mono;
+
+	void *shared = data->fanout ? writer_fanout_samples(data, audio, SAMPLE_FORMAT_FLOAT32, false) : NULL;
+	if (shared) return shared;
 
-	float **fdata = (float**)audio->data;
+	const size_t channels = data->sample_info.speakers;
 
 	circlebuf_upsize(&data->interleaved_buffer, channels * audio->frames * BYTES_PER_SAMPLE);
 	float *buffer = circlebuf_data(&data->interleaved_buffer, 0);
 
-	for (size_t c = 0; c < channels; c++) {
-		if (fdata[c]) {
-			for (size_t i = 0; i < audio->frames; i++) {
-				buffer[i * channels + c] = fdata[c][i];
-			}
-		}
-		else {
-			for (size_t i = 0; i < audio->frames; i++) {
-				buffer[i * channels + c] = 0.0f;
-			}
-		}
-	}
+	const uint64_t trace = writer_trace_begin();
+	interleave_float(buffer, audio->data, channels, audio->frames);
+	writer_trace_end("interleave", trace);
 
 	return buffer;
 }
+
+static inline size_t output_sample_size(writer_data_t *data)
+{
+	return sample_format_size(data->sample_format);
+}
+
+/* same as fill_interleaved_buffer but in the selected output sample format */
+static inline void *fill_output_buffer(writer_data_t *data, struct obs_audio_data *audio)
+{
+	void *mono = mono_samples(data, audio, data->sample_format);
+	if (mono) return mono;
+
+	void *shared = data->fanout ? writer_fanout_samples(data, audio, data->sample_format, data->dither) : NULL;
+	if (shared) return shared;
+
+	const size_t channels = data->sample_info.speakers;
+
+	circlebuf_upsize(&data->interleaved_buffer, channels * audio->frames * output_sample_size(data));
+	void *buffer = circlebuf_data(&data->interleaved_buffer, 0);
+
+	const uint64_t trace = writer_trace_begin();
+	interleave_convert(buffer, audio->data, channels, audio->frames, data->sample_format, data->dither ? data->dither_state : NULL);
+	writer_trace_end("interleave", trace);
+
+	return buffer;
+}
+
+/* appends a packet in the output sample format, converted in place when the sink is mapped */
+static inline size_t output_write_samples(writer_data_t *data, struct obs_audio_data *audio)
+{
+	const size_t channels = data->sample_info.speakers;
+	const size_t size = channels * audio->frames * output_sample_size(data);
+
+	void *mapped = data->output->map ? data->output->map(data->sink, size) : NULL;
+	if (mapped) {
+		const uint64_t trace = writer_trace_begin();
+		interleave_convert(mapped, audio->data, channels, audio->frames, data->sample_format, data->dither ? data->dither_state : NULL);
+		writer_trace_end("interleave", trace);
+		data->output_position += size;
+		writer_stats_add_bytes(data->stats, size);
+		return size;
+	}
+
+	return output_write(data, fill_output_buffer(data, audio), size);
+}
@@ -0,0 +1,471 @@
+/*
+* Audio writer filter benchmark.
+*
+* Drives synthetic obs_audio_data packets through the writer engine of every
+* encoders[] entry, for 1 to 64 simulated sources, as fast as the writer
+* threads accept them. No OBS core is started, only libobs utilities are used.
+*
+* Reported per encoder and source count:
+*  - latency percentiles of writer_engine_push, the part that runs on the
+*    OBS audio thread in the real filter
+*  - throughput in channel-seconds of audio per wall-clock second
+*  - heap allocations per packet on the pushing thread and on all threads
+*
+* usage: audio-writer-bench [-s seconds] [-c channels] [-e encoder] [-o folder] [-b backend] [-p MiB] [-l level]
+* Without -o the encoded bytes go to a null sink and are only counted,
+* with it they go through the output backend named by -b (default "file"),
+* preallocating the files in -p MiB extents (default 0, off).
+* -l sets the FLAC compression level (default 5).
+* -t flac runs the FLAC checks instead: quantized LPC coefficients must be
+* within one step of the exact ones, and level 5 must compress a sine
+* better than level 0. -t resample checks that the resampler returns exactly
+* the frames its input covers, with an impulse at the matching output frame.
+* The exit status is nonzero when a check fails.
+*/
+
+#define _USE_MATH_DEFINES // M_PI with MSVC
+#include <math.h>
+
+#include "../audio-writer-filter.h"
+#include "../flac-lpc.h"
+#include "../io-service.h"
+#include "../resample.h"
+#include "../writer-memory.h"
+
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_FRAMES 1024 // AUDIO_OUTPUT_FRAMES in libobs
+#define BENCH_MAX_SOURCES 64
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* counting allocator */
+
+static volatile long total_allocs = 0;
+static volatile long pusher_allocs = 0;
+static THREAD_LOCAL bool is_pusher_thread = false;
+
+static void count_alloc(void)
+{
+	os_atomic_inc_long(&total_allocs);
+	if (is_pusher_thread) os_atomic_inc_long(&pusher_allocs);
+}
+
+static void *bench_malloc(size_t size)
+{
+	count_alloc();
+	return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size)
+{
+	count_alloc();
+	return realloc(ptr, size);
+}
+
+static void bench_free(void *ptr)
+{
+	free(ptr);
+}
+
+/* null output, counts bytes */
+
+static pthread_mutex_t null_output_lock;
+static uint64_t null_output_bytes = 0;
+
+static void *null_output_open(const char *path)
+{
+	UNUSED_PARAMETER(path);
+	return bzalloc(sizeof(uint64_t));
+}
+
+static size_t null_output_write(void *sink, const void *buffer, size_t size)
+{
+	UNUSED_PARAMETER(buffer);
+	*(uint64_t *)sink += size;
+	return size;
+}
+
+static bool null_output_write_at(void *sink, uint64_t offset, const void *buffer, size_t size)
+{
+	UNUSED_PARAMETER(sink);
+	UNUSED_PARAMETER(offset);
+	UNUSED_PARAMETER(buffer);
+	UNUSED_PARAMETER(size);
+	return true;
+}
+
+static void null_output_close(void *sink)
+{
+	pthread_mutex_lock(&null_output_lock);
+	null_output_bytes += *(uint64_t *)sink;
+	pthread_mutex_unlock(&null_output_lock);
+	bfree(sink);
+}
+
+static output_t null_output = {
+	"null",
+	null_output_open,
+	null_output_write,
+	null_output_write_at,
+	NULL,
+	null_output_close,
+	NULL,
+	NULL,
+	NULL,
+};
+
+/* benchmark */
+
+typedef struct {
+	uint32_t seconds;
+	uint32_t channels;
+	const char *encoder_name;
+	const char *folder;
+	const char *backend;
+	uint32_t preallocate;
+	uint32_t flac_level;
+} bench_options_t;
+
+typedef struct {
+	float *planes[MAX_AV_PLANES];
+	struct obs_audio_data audio;
+} bench_packet_t;
+
+static void packet_init(bench_packet_t *packet, uint32_t channels)
+{
+	for (uint32_t c = 0; c < channels; c++) {
+		packet->planes[c] = bmalloc(BENCH_FRAMES * sizeof(float));
+		for (uint32_t i = 0; i < BENCH_FRAMES; i++) {
+			packet->planes[c][i] = 0.5f * sinf((float)i * (float)(c + 1) * 0.02f);
+		}
+		packet->audio.data[c] = (uint8_t *)packet->planes[c];
+	}
+	packet->audio.frames = BENCH_FRAMES;
+}
+
+static void packet_free(bench_packet_t *packet)
+{
+	for (size_t c = 0; c < MAX_AV_PLANES; c++) {
+		if (packet->planes[c]) bfree(packet->planes[c]);
+	}
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p)
+{
+	size_t index = (size_t)(p * (double)(count - 1));
+	return (double)sorted[index] / 1000.0;
+}
+
+static uint32_t ring_free_frames(writer_ring_t *ring)
+{
+	uint32_t used = (uint32_t)os_atomic_load_long(&ring->write_pos) - (uint32_t)os_atomic_load_long(&ring->read_pos);
+	return ring->capacity - used;
+}
+
+static void bench_run(const bench_options_t *options, encoder_t *encoder, size_t sources)
+{
+	const struct resample_info sample_info = {
+		BENCH_SAMPLE_RATE,
+		AUDIO_FORMAT_FLOAT_PLANAR,
+		(enum speaker_layout)options->channels
+	};
+	const size_t ticks = (size_t)options->seconds * BENCH_SAMPLE_RATE / BENCH_FRAMES;
+	const size_t packets = ticks * sources;
+
+	writer_data_t *writers[BENCH_MAX_SOURCES] = { 0 };
+	char names[BENCH_MAX_SOURCES][16];
+
+	for (size_t s = 0; s < sources; s++) {
+		writer_data_t *data = bzalloc(sizeof(writer_data_t));
+		snprintf(names[s], sizeof(names[s]), "bench-%02d", (int)s);
+		data->source_name = names[s];
+		data->output_folder = (char *)(options->folder ? options->folder : ".");
+		data->output_filename_format = "audio-writer-bench [%SRC] %CCYY-%MM-%DD %hh-%mm-%ss";
+		data->output = options->folder ? writer_get_output(options->backend) : &null_output;
+		data->encoder = encoder;
+		data->preallocate_size = (uint64_t)options->preallocate * 1024 * 1024;
+		data->flac_level = options->flac_level;
+		writer_engine_init(data, &sample_info);
+		writer_engine_prepare(data);
+		writer_engine_start(data);
+		writers[s] = data;
+	}
+
+	bench_packet_t packet = { 0 };
+	packet_init(&packet, options->channels);
+	uint64_t *latencies = bmalloc(packets * sizeof(uint64_t));
+	null_output_bytes = 0;
+
+	os_atomic_set_long(&total_allocs, 0);
+	os_atomic_set_long(&pusher_allocs, 0);
+	is_pusher_thread = true;
+
+	const uint64_t start_time = os_gettime_ns();
+	size_t n = 0;
+	for (size_t t = 0; t < ticks; t++) {
+		packet.audio.timestamp = (uint64_t)t * BENCH_FRAMES * 1000000000ULL / BENCH_SAMPLE_RATE;
+		for (size_t s = 0; s < sources; s++) {
+			// backpressure instead of drops, this is outside the timed region
+			while (ring_free_frames(&writers[s]->ring) < BENCH_FRAMES) os_sleep_ms(0);
+
+			uint64_t t0 = os_gettime_ns();
+			writer_engine_push(writers[s], &packet.audio);
+			latencies[n++] = os_gettime_ns() - t0;
+		}
+	}
+
+	is_pusher_thread = false;
+	long dropped = 0;
+	for (size_t s = 0; s < sources; s++) {
+		dropped += writer_ring_lost(&writers[s]->ring);
+		writer_engine_stop(writers[s]);
+		writer_engine_free(writers[s]);
+	}
+	const uint64_t end_time = os_gettime_ns();
+
+	const long allocs = os_atomic_load_long(&total_allocs);
+	const long allocs_pusher = os_atomic_load_long(&pusher_allocs);
+
+	qsort(latencies, packets, sizeof(uint64_t), compare_u64);
+
+	double wall_seconds = (double)(end_time - start_time) / 1e9;
+	double audio_seconds = (double)packets * BENCH_FRAMES / BENCH_SAMPLE_RATE;
+
+	printf("%-14s %7d %9.2f %9.2f %9.2f %9.2f %12.0f %9.1f %8.3f %8.3f %8ld %10.1f\n",
+		encoder->name, (int)sources,
+		percentile_us(latencies, packets, 0.50),
+		percentile_us(latencies, packets, 0.99),
+		percentile_us(latencies, packets, 0.999),
+		(double)latencies[packets - 1] / 1000.0,
+		audio_seconds * options->channels / wall_seconds,
+		audio_seconds / sources / wall_seconds,
+		(double)allocs_pusher / (double)packets,
+		(double)allocs / (double)packets,
+		dropped,
+		options->folder ? 0.0 : (double)null_output_bytes / (1024.0 * 1024.0));
+	fflush(stdout);
+
+	bfree(latencies);
+	packet_free(&packet);
+	for (size_t s = 0; s < sources; s++) bfree(writers[s]);
+}
+
+/* checks */
+
+static bool check_flac_quantize(void)
+{
+	uint32_t seed = 1;
+	size_t failed = 0, checked = 0;
+
+	for (size_t round = 0; round < 100000; round++) {
+		double coefficients[FLAC_MAX_LPC_ORDER];
+		const unsigned order = 1 + round % FLAC_MAX_LPC_ORDER;
+		const unsigned precision = 5 + (unsigned)(round / FLAC_MAX_LPC_ORDER) % 11;
+		for (unsigned i = 0; i < order; i++) {
+			seed = seed * 1664525u + 1013904223u;
+			const double x = (double)(seed >> 8) / (double)(1 << 24) * 2.0 - 1.0;
+			coefficients[i] = 4.0 * x * x * x;
+		}
+
+		int32_t qlp[FLAC_MAX_LPC_ORDER];
+		int shift;
+		if (!flac_lpc_quantize(coefficients, order, precision, qlp, &shift)) continue;
+
+		checked++;
+		const double step = 1.0 / (double)(1 << shift);
+		for (unsigned i = 0; i < order; i++) {
+			if (fabs((double)qlp[i] * step - coefficients[i]) > step * (1.0 + 1e-9)) {
+				failed++;
+				break;
+			}
+		}
+	}
+
+	// the example that used to be clamped
+	static const double pair[] = { 1.9, -0.95 };
+	int32_t qlp[2];
+	int shift = 0;
+	if (!flac_lpc_quantize(pair, 2, 12, qlp, &shift) || fabs((double)qlp[0] / (double)(1 << shift) - pair[0]) > 1.0 / (double)(1 << shift)) failed++;
+
+	printf("flac quantize: %zu of %zu coefficient sets off by more than one step\n", failed, checked);
+	return failed == 0;
+}
+
+/* bytes of a FLAC file of a sine at the level */
+static uint64_t encode_sine(uint32_t level, uint32_t seconds)
+{
+	const struct resample_info sample_info = { BENCH_SAMPLE_RATE, AUDIO_FORMAT_FLOAT_PLANAR, (enum speaker_layout)2 };
+
+	writer_data_t *data = bzalloc(sizeof(writer_data_t));
+	data->source_name = "check";
+	data->output_folder = ".";
+	data->output_filename_format = "audio-writer-check";
+	data->output = &null_output;
+	data->encoder = writer_get_encoder("internal-flac");
+	data->flac_level = level;
+	writer_engine_init(data, &sample_info);
+	writer_engine_prepare(data);
+	writer_engine_start(data);
+
+	bench_packet_t packet = { 0 };
+	packet_init(&packet, 2);
+	null_output_bytes = 0;
+
+	// continuous across packets, so every block is a clean sine
+	uint64_t frame = 0;
+	const size_t ticks = (size_t)seconds * BENCH_SAMPLE_RATE / BENCH_FRAMES;
+	for (size_t t = 0; t < ticks; t++) {
+		for (uint32_t c = 0; c < 2; c++) {
+			for (uint32_t i = 0; i < BENCH_FRAMES; i++) {
+				packet.planes[c][i] = 0.5f * (float)sin(2.0 * M_PI * 440.0 * (c + 1) * (double)(frame + i) / BENCH_SAMPLE_RATE);
+			}
+		}
+		frame += BENCH_FRAMES;
+
+		while (ring_free_frames(&data->ring) < BENCH_FRAMES) os_sleep_ms(1);
+		writer_engine_push(data, &packet.audio);
+	}
+
+	writer_engine_stop(data);
+	writer_engine_free(data);
+	packet_free(&packet);
+	bfree(data);
+	return null_output_bytes;
+}
+
+static bool check_flac_levels(void)
+{
+	const uint64_t level0 = encode_sine(0, 5);
+	const uint64_t level5 = encode_sine(5, 5);
+
+	printf("flac sine: %llu bytes at level 0, %llu at level 5\n", (unsigned long long)level0, (unsigned long long)level5);
+	return level5 > 0 && level5 < level0;
+}
+
+#define CHECK_RESAMPLE_FRAMES 4800
+#define CHECK_RESAMPLE_IMPULSE 1200
+
+/* an impulse in blocks of BENCH_FRAMES, then the flush */
+static bool check_resample_rate(uint32_t in_rate, uint32_t out_rate)
+{
+	resampler_t *resampler = resampler_create(in_rate, out_rate);
+	if (!resampler) return false;
+	resampler_reserve(resampler, BENCH_FRAMES);
+
+	float *in = bzalloc(CHECK_RESAMPLE_FRAMES * sizeof(float));
+	float *out = bzalloc((resampler_max_output(resampler, CHECK_RESAMPLE_FRAMES) + resampler_max_output(resampler, resampler_delay(resampler))) * sizeof(float));
+	in[CHECK_RESAMPLE_IMPULSE] = 1.0f;
+
+	size_t frames = 0;
+	for (size_t i = 0; i < CHECK_RESAMPLE_FRAMES; i += BENCH_FRAMES) {
+		const size_t block = CHECK_RESAMPLE_FRAMES - i < BENCH_FRAMES ? CHECK_RESAMPLE_FRAMES - i : BENCH_FRAMES;
+		frames += resampler_process(resampler, in + i, block, out + frames);
+	}
+	frames += resampler_flush(resampler, out + frames);
+
+	size_t peak = 0;
+	for (size_t i = 1; i < frames; i++) {
+		if (fabsf(out[i]) > fabsf(out[peak])) peak = i;
+	}
+
+	const size_t expected = (size_t)(((uint64_t)CHECK_RESAMPLE_FRAMES * out_rate + in_rate - 1) / in_rate);
+	const double position = (double)CHECK_RESAMPLE_IMPULSE * out_rate / in_rate;
+	const bool passed = frames == expected && fabs((double)peak - position) <= 1.0;
+	printf("resample %u to %u Hz: %zu frames of %zu, impulse at %zu for %.2f\n", in_rate, out_rate, frames, expected, peak, position);
+
+	bfree(out);
+	bfree(in);
+	resampler_destroy(resampler);
+	return passed;
+}
+
+static bool check_resample(void)
+{
+	static const uint32_t rates[][2] = { { 48000, 44100 }, { 44100, 48000 }, { 48000, 16000 }, { 48000, 96000 }, { 48000, 22050 } };
+
+	bool passed = true;
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (!check_resample_rate(rates[i][0], rates[i][1])) passed = false;
+	}
+	return passed;
+}
+
+static int run_checks(const char *name)
+{
+	if (0 == strcmp(name, "resample")) return check_resample() ? 0 : 1;
+
+	if (0 != strcmp(name, "flac")) {
+		printf("unknown check '%s'\n", name);
+		return 2;
+	}
+
+	const bool quantize = check_flac_quantize();
+	const bool levels = check_flac_levels();
+	return quantize && levels ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_options_t options = { 10, 2, NULL, NULL, "file", 0, 5 };
+	const char *check = NULL;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (0 == strcmp(argv[i], "-s")) options.seconds = (uint32_t)atoi(argv[i + 1]);
+		else if (0 == strcmp(argv[i], "-c")) options.channels = (uint32_t)atoi(argv[i + 1]);
+		else if (0 == strcmp(argv[i], "-e")) options.encoder_name = argv[i + 1];
+		else if (0 == strcmp(argv[i], "-o")) options.folder = argv[i + 1];
+		else if (0 == strcmp(argv[i], "-b")) options.backend = argv[i + 1];
+		else if (0 == strcmp(argv[i], "-p")) options.preallocate = (uint32_t)atoi(argv[i + 1]);
+		else if (0 == strcmp(argv[i], "-l")) options.flac_level = (uint32_t)atoi(argv[i + 1]);
+		else if (0 == strcmp(argv[i], "-t")) check = argv[i + 1];
+	}
+	if (options.seconds < 1) options.seconds = 1;
+	if (options.channels < 1 || options.channels > MAX_AUDIO_CHANNELS) options.channels = 2;
+
+	struct base_allocator allocator = { bench_malloc, bench_realloc, bench_free };
+	base_set_allocator(&allocator);
+	pthread_mutex_init(&null_output_lock, NULL);
+	interleave_init();
+	flac_lpc_init();
+	resample_init();
+	io_service_init(IO_SERVICE_DEFAULT_BUDGET);
+	writer_memory_init(WRITER_MEMORY_DEFAULT_BUDGET);
+
+	if (check) {
+		const int status = run_checks(check);
+		writer_memory_free();
+		io_service_free();
+		pthread_mutex_destroy(&null_output_lock);
+		return status;
+	}
+
+	printf("%u s of %u channel audio per source at %d Hz, %s interleave kernels, %s FLAC kernels, %s output\n",
+		options.seconds, options.channels, BENCH_SAMPLE_RATE, interleave_kernel_name(), flac_lpc_kernel_name(),
+		options.folder ? writer_get_output(options.backend)->name : null_output.name);
+	printf("%-14s %7s %9s %9s %9s %9s %12s %9s %8s %8s %8s %10s\n",
+		"encoder", "sources", "p50 us", "p99 us", "p99.9 us", "max us",
+		"ch-s/s", "x rt/src", "alloc/p", "all/p", "dropped", "MiB out");
+
+	static const size_t source_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+	for (size_t e = 0; e < encoders_count; e++) {
+		if (options.encoder_name && 0 != strcmp(options.encoder_name, encoders[e].name)) continue;
+		for (size_t i = 0; i < sizeof(source_counts) / sizeof(source_counts[0]); i++) {
+			bench_run(&options, &encoders[e], source_counts[i]);
+		}
+	}
+
+	writer_memory_free();
+	io_service_free();
+	pthread_mutex_destroy(&null_output_lock);
+	return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+* The chunked RAW file of the internal-chunked encoder, all numbers little endian:
+*
+*   header   chunk_file_header_t, index_offset is 0 until the file is finished
+*   chunks   chunk_header_t and stored_size bytes each, chunk_frames frames
+*            except the last one
+*   index    "AWCI", u32 count, u64 file offset of every chunk, u64 total frames
+*   footer   chunk_file_footer_t, the last bytes of the file
+*
+* A chunk holds interleaved samples of the header sample format, with
+* CHUNK_FLAG_SHUFFLE the bytes are grouped by their position in the sample
+* first (all low bytes, then all second bytes...), which makes float and
+* 24-bit audio compress better. The sample at frame n is in chunk
+* n / chunk_frames, so a reader finds it with one lookup in the index.
+* A file without the index (a crash) can still be read chunk by chunk.
+*/
+
+#define CHUNK_FILE_VERSION 1
+#define CHUNK_FLAG_SHUFFLE 1
+
+enum chunk_method {
+	CHUNK_STORED = 0, // compression did not help
+	CHUNK_LZ4 = 1,    // one LZ4 block, see lz4-block.h
+};
+
+/* the values of the header sample format, the same as enum sample_format */
+enum chunk_sample_format {
+	CHUNK_FLOAT32 = 0,
+	CHUNK_INT16 = 1,
+	CHUNK_INT24 = 2,
+	CHUNK_INT32 = 3,
+};
+
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t magic;         // "AWCK"
+	uint16_t version;
+	uint16_t channels;
+	uint32_t sample_rate;
+	uint8_t sample_format;
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t chunk_frames;
+	uint64_t index_offset;
+} chunk_file_header_t;
+
+typedef struct {
+	uint32_t frames;
+	uint32_t stored_size;   // bytes that follow the chunk header
+	uint8_t method;
+	uint8_t reserved[3];
+} chunk_header_t;
+
+typedef struct {
+	uint64_t index_offset;
+	uint32_t magic;         // "AWCE"
+} chunk_file_footer_t;
+#pragma pack(pop)
@@ -0,0 +1,275 @@
+#include <stddef.h>
+
+#include "audio-writer-filter.h"
+#include "chunk-format.h"
+#include "lz4-block.h"
+
+/*
+* Chunked RAW encoder, the file layout is in chunk-format.h. Samples are
+* collected into chunks of CHUNK_MS, and a worker thread compresses a chunk
+* while the writer thread fills the next one. The compressed chunk is written
+* by the writer thread when the next one is handed over, so it waits only
+* when the worker falls a whole chunk behind. The index and the footer are
+* written when the file is finished.
+*/
+
+#define CHUNK_MS 1000
+
+#define CHUNK_LOG(level, format, ...) blog(level, "[audio writer filter (chunked)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	size_t sample_size;
+	size_t frame_size;
+	uint32_t chunk_frames;
+	size_t capacity;        // bytes of each chunk buffer
+	bool shuffle;
+
+	uint8_t *filling;       // chunk the writer thread adds to
+	uint32_t fill;
+
+	uint8_t *pending;       // chunk the worker compresses
+	uint32_t pending_frames;
+	bool pending_stored;    // handed over while degraded, stored without compressing
+	bool busy;              // the worker has a chunk that is not written yet
+	uint8_t *shuffled;
+	uint8_t *compressed;
+	uint32_t *table;
+	chunk_header_t result;
+	const uint8_t *result_data;
+
+	pthread_t worker;
+	bool worker_started;
+	os_event_t *work;
+	os_event_t *done;
+	volatile bool stopping;
+
+	uint64_t *index;        // file offset of every chunk
+	size_t index_count;
+	size_t index_capacity;
+	uint64_t total_frames;
+} chunk_encoder_t;
+
+/* groups the bytes of every sample by their position: all first bytes, then all second bytes... */
+static void shuffle_bytes(uint8_t *dst, const uint8_t *src, size_t samples, size_t sample_size)
+{
+	for (size_t b = 0; b < sample_size; b++) {
+		const uint8_t *in = src + b;
+		uint8_t *out = dst + b * samples;
+		for (size_t i = 0; i < samples; i++, in += sample_size) out[i] = *in;
+	}
+}
+
+/* runs on the worker, or on the writer thread when there is no worker */
+static void compress_chunk(chunk_encoder_t *encoder)
+{
+	const uint64_t trace = writer_trace_begin();
+	const size_t size = encoder->pending_frames * encoder->frame_size;
+	const uint8_t *samples = encoder->pending;
+
+	if (encoder->shuffle) {
+		shuffle_bytes(encoder->shuffled, samples, size / encoder->sample_size, encoder->sample_size);
+		samples = encoder->shuffled;
+	}
+
+	// shuffled all the same, the file flag covers every chunk
+	const size_t compressed_size = encoder->pending_stored ? size : lz4_compress_block(samples, size, encoder->compressed, encoder->table);
+
+	memset(&encoder->result, 0, sizeof(chunk_header_t));
+	encoder->result.frames = encoder->pending_frames;
+	if (compressed_size < size) {
+		encoder->result.method = CHUNK_LZ4;
+		encoder->result.stored_size = (uint32_t)compressed_size;
+		encoder->result_data = encoder->compressed;
+	}
+	else {
+		encoder->result.method = CHUNK_STORED;
+		encoder->result.stored_size = (uint32_t)size;
+		encoder->result_data = samples;
+	}
+
+	writer_trace_end("chunk compress", trace);
+}
+
+static void *chunk_worker(void *param)
+{
+	chunk_encoder_t *encoder = param;
+	os_set_thread_name("audio-writer-filter: chunks");
+	writer_trace_thread_name("audio-writer-filter: chunks");
+
+	while (os_event_wait(encoder->work) == 0 && !encoder->stopping) {
+		compress_chunk(encoder);
+		os_event_signal(encoder->done);
+	}
+	return NULL;
+}
+
+/* the buffers follow the sample format, only called while the worker is idle */
+static void chunk_encoder_size(writer_data_t *data, chunk_encoder_t *encoder)
+{
+	encoder->sample_size = output_sample_size(data);
+	encoder->frame_size = data->sample_info.speakers * encoder->sample_size;
+	encoder->chunk_frames = (uint32_t)((uint64_t)data->sample_info.samples_per_sec * CHUNK_MS / 1000);
+	if (encoder->chunk_frames == 0) encoder->chunk_frames = 1;
+
+	const size_t capacity = encoder->chunk_frames * encoder->frame_size;
+	if (capacity <= encoder->capacity) return;
+
+	encoder->filling = brealloc(encoder->filling, capacity);
+	encoder->pending = brealloc(encoder->pending, capacity);
+	encoder->shuffled = brealloc(encoder->shuffled, capacity);
+	encoder->compressed = brealloc(encoder->compressed, lz4_compress_bound(capacity));
+	encoder->capacity = capacity;
+}
+
+static chunk_encoder_t *chunk_encoder_get(writer_data_t *data)
+{
+	if (data->chunks) return data->chunks;
+
+	chunk_encoder_t *encoder = bzalloc(sizeof(chunk_encoder_t));
+	encoder->table = bmalloc(LZ4_TABLE_SIZE * sizeof(uint32_t));
+	chunk_encoder_size(data, encoder);
+
+	if (os_event_init(&encoder->work, OS_EVENT_TYPE_AUTO) == 0 && os_event_init(&encoder->done, OS_EVENT_TYPE_AUTO) == 0) {
+		encoder->worker_started = pthread_create(&encoder->worker, NULL, chunk_worker, encoder) == 0;
+	}
+	if (!encoder->worker_started) CHUNK_LOG(LOG_WARNING, "failed to start the compression thread, chunks are compressed on the writer thread");
+
+	data->chunks = encoder;
+	return encoder;
+}
+
+static void chunk_encoder_reset(writer_data_t *data, chunk_encoder_t *encoder)
+{
+	chunk_encoder_size(data, encoder);
+	encoder->shuffle = data->chunk_shuffle && encoder->sample_size > 1;
+	encoder->fill = 0;
+	encoder->index_count = 0;
+	encoder->total_frames = 0;
+}
+
+bool chunk_writer_prepare(writer_data_t *data)
+{
+	return chunk_encoder_get(data) != NULL;
+}
+
+void chunk_writer_free(writer_data_t *data)
+{
+	chunk_encoder_t *encoder = data->chunks;
+	if (!encoder) return;
+
+	if (encoder->worker_started) {
+		encoder->stopping = true;
+		os_event_signal(encoder->work);
+		pthread_join(encoder->worker, NULL);
+	}
+	if (encoder->work) os_event_destroy(encoder->work);
+	if (encoder->done) os_event_destroy(encoder->done);
+
+	bfree(encoder->filling);
+	bfree(encoder->pending);
+	bfree(encoder->shuffled);
+	bfree(encoder->compressed);
+	bfree(encoder->table);
+	bfree(encoder->index);
+	bfree(encoder);
+	data->chunks = NULL;
+}
+
+/* has no sync, must be called inside locking mutex */
+static void write_chunk_header(writer_data_t *data, chunk_encoder_t *encoder)
+{
+	chunk_file_header_t header = {
+		*(uint32_t*)&"AWCK",
+		CHUNK_FILE_VERSION,
+		(uint16_t)data->sample_info.speakers,
+		data->sample_info.samples_per_sec,
+		(uint8_t)data->sample_format,
+		encoder->shuffle ? CHUNK_FLAG_SHUFFLE : 0,
+		0,
+		encoder->chunk_frames,
+		0 // set when the file is finished
+	};
+	output_write(data, &header, sizeof(chunk_file_header_t));
+}
+
+/* has no sync, must be called inside locking mutex, waits for the worker to finish the chunk */
+static void write_compressed_chunk(writer_data_t *data, chunk_encoder_t *encoder)
+{
+	if (!encoder->busy) return;
+	os_event_wait(encoder->done);
+	encoder->busy = false;
+
+	if (encoder->index_count == encoder->index_capacity) {
+		encoder->index_capacity = encoder->index_capacity ? encoder->index_capacity * 2 : 1024;
+		encoder->index = brealloc(encoder->index, encoder->index_capacity * sizeof(uint64_t));
+	}
+	encoder->index[encoder->index_count++] = data->output_position;
+
+	output_write(data, &encoder->result, sizeof(chunk_header_t));
+	output_write(data, encoder->result_data, encoder->result.stored_size);
+	encoder->total_frames += encoder->result.frames;
+}
+
+/* has no sync, must be called inside locking mutex, writes the previous chunk and hands the filled one to the worker */
+static void submit_chunk(writer_data_t *data, chunk_encoder_t *encoder)
+{
+	write_compressed_chunk(data, encoder);
+
+	uint8_t *filled = encoder->filling;
+	encoder->filling = encoder->pending;
+	encoder->pending = filled;
+	encoder->pending_frames = encoder->fill;
+	encoder->pending_stored = data->degraded;
+	encoder->fill = 0;
+
+	encoder->busy = true;
+	if (!encoder->worker_started) compress_chunk(encoder);
+	os_event_signal(encoder->worker_started ? encoder->work : encoder->done);
+}
+
+void write_chunked_packet(writer_data_t *data, struct obs_audio_data *audio)
+{
+	if (!output_lock_open(data)) return;
+
+	chunk_encoder_t *encoder = chunk_encoder_get(data);
+	if (!data->file_has_header) {
+		chunk_encoder_reset(data, encoder);
+		write_chunk_header(data, encoder);
+		data->file_has_header = true;
+	}
+
+	const uint8_t *samples = fill_output_buffer(data, audio);
+	for (uint32_t offset = 0; offset < audio->frames;) {
+		uint32_t count = audio->frames - offset;
+		if (count > encoder->chunk_frames - encoder->fill) count = encoder->chunk_frames - encoder->fill;
+
+		memcpy(encoder->filling + encoder->fill * encoder->frame_size, samples + offset * encoder->frame_size, count * encoder->frame_size);
+		encoder->fill += count;
+		offset += count;
+
+		if (encoder->fill == encoder->chunk_frames) submit_chunk(data, encoder);
+	}
+
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+/* has no sync, must be called inside locking mutex */
+void write_chunked_finish(writer_data_t *data)
+{
+	chunk_encoder_t *encoder = data->chunks;
+	if (!encoder || !data->file_has_header) return;
+
+	if (encoder->fill > 0) submit_chunk(data, encoder);
+	write_compressed_chunk(data, encoder);
+
+	const uint64_t index_offset = data->output_position;
+	const uint32_t index_head[2] = { *(uint32_t*)&"AWCI", (uint32_t)encoder->index_count };
+	output_write(data, index_head, sizeof(index_head));
+	output_write(data, encoder->index, encoder->index_count * sizeof(uint64_t));
+	output_write(data, &encoder->total_frames, sizeof(uint64_t));
+
+	chunk_file_footer_t footer = { index_offset, *(uint32_t*)&"AWCE" };
+	output_write(data, &footer, sizeof(chunk_file_footer_t));
+
+	output_write_at(data, offsetof(chunk_file_header_t, index_offset), &index_offset, sizeof(uint64_t));
+}
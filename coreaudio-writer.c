@@ -82,11 +82,26 @@ inline bool converter_create(writer_data_t *data)
 	size = sizeof(output_buffer_size);
 	code = AudioConverterGetProperty(data->converter, kAudioConverterPropertyMaximumOutputPacketSize, &size, &output_buffer_size);
 	if (code) output_buffer_size = 32768;
+	data->max_output_packet_size = output_buffer_size;
 	circlebuf_upsize(&data->output_buffer, output_buffer_size);
 
 	return success;
 }
 
+bool coreaudio_writer_prepare(writer_data_t *data)
+{
+	return converter_create(data);
+}
+
+void coreaudio_writer_free(writer_data_t *data)
+{
+	if (!data->converter) return;
+
+	AudioConverterDispose(data->converter);
+	data->converter = NULL;
+	circlebuf_free(&data->input_buffer);
+}
+
 inline uint8_t getSampleRateTableIndex(uint32_t sampleRate) {
 	if (sampleRate == 48000) { return 3; }
 	if (sampleRate == 44100) { return 4; }
@@ -126,9 +141,7 @@ inline uint8_t getSampleRateTableIndex(uint32_t sampleRate) {
 * 11 bits of buffer fullness. 0x7FF for VBR.
 * 2 bits of frames count in one packet. Set to 0.
 */
-inline uint8_t *adts_packet_header(uint32_t packetLength, uint32_t mSampleRate, uint8_t mChannelCount) {
-	static uint8_t header[ADTS_PACKET_HEADER_LENGTH];
-
+inline void adts_packet_header(uint8_t *header, uint32_t packetLength, uint32_t mSampleRate, uint8_t mChannelCount) {
 	uint8_t data = 0xFF;
 	header[0] = data;
 
@@ -171,8 +184,6 @@ inline uint8_t *adts_packet_header(uint32_t packetLength, uint32_t mSampleRate,
 	data = ((kBufferFullness & 0x03F) << 2);
 	data |= kFrameCount;
 	header[6] = data;
-
-	return header;
 }
 
 #define MORE_DATA_REQUIRED 1
@@ -207,40 +218,49 @@ static OSStatus input_data_provider(
 	return 0;
 }
 
+/*
+* Encodes every AAC packet the buffered input is enough for, so the input
+* never holds more than one packet worth of frames. The packets are put
+* behind their ADTS headers in output_buffer and appended with one write.
+*/
 void write_coreaudio_aac_packet(writer_data_t *data, struct obs_audio_data *audio)
 {
-	if (!converter_create(data)) return;
-	if (!open_output(data)) return;
+	if (!converter_create(data)) {
+		writer_stats_add_error(data->stats);
+		return;
+	}
+	if (!output_lock_open(data)) return;
 
 	void *buffer = fill_interleaved_buffer(data, audio);
 	circlebuf_push_back(&data->input_buffer, buffer, audio->frames * data->sample_info.speakers * BYTES_PER_SAMPLE);
 
-	if (EBUSY == pthread_mutex_trylock(&data->output_lock)) {
-		return;
-	}
-	else {
+	size_t batch = 0;
+	for (;;) {
+		circlebuf_upsize(&data->output_buffer, batch + ADTS_PACKET_HEADER_LENGTH + data->max_output_packet_size);
+		uint8_t *packet = (uint8_t *)circlebuf_data(&data->output_buffer, 0) + batch;
+
 		UInt32 packets_count = 1;
 		AudioBufferList output_buffers = { 0 };
 		output_buffers.mNumberBuffers = 1;
 		output_buffers.mBuffers[0].mNumberChannels = (UInt32)data->sample_info.speakers;
-		output_buffers.mBuffers[0].mData = circlebuf_data(&data->output_buffer, 0);
-		output_buffers.mBuffers[0].mDataByteSize = (UInt32)data->output_buffer.size;
-		AudioConverterFillComplexBuffer(data->converter, input_data_provider, data, &packets_count, &output_buffers, NULL);
-
-		if (packets_count > 0) {
-			fwrite(
-				adts_packet_header(
-					output_buffers.mBuffers[0].mDataByteSize,
-					data->sample_info.samples_per_sec,
-					data->sample_info.speakers),
-				ADTS_PACKET_HEADER_LENGTH, 1,
-				data->file);
-			fwrite(
-				output_buffers.mBuffers[0].mData,
-				output_buffers.mBuffers[0].mDataByteSize, 1,
-				data->file);
-		}
+		output_buffers.mBuffers[0].mData = packet + ADTS_PACKET_HEADER_LENGTH;
+		output_buffers.mBuffers[0].mDataByteSize = data->max_output_packet_size;
+		const uint64_t trace = writer_trace_begin();
+		OSStatus code = AudioConverterFillComplexBuffer(data->converter, input_data_provider, data, &packets_count, &output_buffers, NULL);
+		writer_trace_end("AudioConverterFillComplexBuffer", trace);
+
+		const UInt32 size = output_buffers.mBuffers[0].mDataByteSize;
+		if (code != 0 && code != MORE_DATA_REQUIRED) writer_stats_add_error(data->stats);
+		if (packets_count == 0 || size == 0) break;
+
+		adts_packet_header(packet, size, data->sample_info.samples_per_sec, data->sample_info.speakers);
+		batch += ADTS_PACKET_HEADER_LENGTH + size;
 
-		pthread_mutex_unlock(&data->output_lock);
+		// the input ran out while this packet was completed
+		if (code == MORE_DATA_REQUIRED) break;
 	}
+
+	if (batch > 0) output_write(data, circlebuf_data(&data->output_buffer, 0), batch);
+
+	pthread_mutex_unlock(&data->output_lock);
 }
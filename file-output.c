@@ -0,0 +1,110 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+#endif
+
+#include "audio-writer-filter.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Buffered stdio output, the default sink */
+
+static void *file_output_open(const char *path)
+{
+	return os_fopen(path, "wb");
+}
+
+static size_t file_output_write(void *sink, const void *buffer, size_t size)
+{
+	return fwrite(buffer, 1, size, (FILE *)sink);
+}
+
+/* writes at an absolute offset and returns to the end of the file */
+static bool file_output_write_at(void *sink, uint64_t offset, const void *buffer, size_t size)
+{
+	FILE *file = sink;
+	int64_t position = os_ftelli64(file);
+
+	bool success = os_fseeki64(file, (int64_t)offset, SEEK_SET) == 0
+		&& fwrite(buffer, 1, size, file) == size;
+
+	os_fseeki64(file, position, SEEK_SET);
+	return success;
+}
+
+/* pushes buffered data to the disk so a crash loses at most one checkpoint interval */
+static void file_output_sync(void *sink)
+{
+	FILE *file = sink;
+	fflush(file);
+#if defined(_WIN32)
+	FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(file)));
+#elif defined(__APPLE__)
+	fsync(fileno(file));
+#else
+	fdatasync(fileno(file));
+#endif
+}
+
+static bool file_output_preallocate(void *sink, uint64_t offset, uint64_t length)
+{
+	FILE *file = sink;
+#if defined(_WIN32)
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG)(offset + length);
+	return SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(file)), FileAllocationInfo, &info, sizeof(info));
+#elif defined(__APPLE__)
+	UNUSED_PARAMETER(offset);
+	fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)length, 0 };
+	if (fcntl(fileno(file), F_PREALLOCATE, &store) == 0) return true;
+	store.fst_flags = F_ALLOCATEALL;
+	return fcntl(fileno(file), F_PREALLOCATE, &store) == 0;
+#elif defined(__linux__)
+	return fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0;
+#else
+	UNUSED_PARAMETER(file);
+	UNUSED_PARAMETER(offset);
+	UNUSED_PARAMETER(length);
+	return false;
+#endif
+}
+
+static void file_output_trim(void *sink, uint64_t size, uint64_t allocated)
+{
+	FILE *file = sink;
+	fflush(file);
+#if defined(_WIN32)
+	UNUSED_PARAMETER(allocated);
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = (LONGLONG)size;
+	SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(file)), FileAllocationInfo, &info, sizeof(info));
+#else
+	// truncating to the current size releases the blocks past the end, punching a hole there does not on ext4
+	UNUSED_PARAMETER(allocated);
+	if (ftruncate(fileno(file), (off_t)size) != 0) WRITER_LOG(LOG_WARNING, "failed to release the preallocated space");
+#endif
+}
+
+static void file_output_close(void *sink)
+{
+	fclose((FILE *)sink);
+}
+
+output_t file_output = {
+	"file",
+	file_output_open,
+	file_output_write,
+	file_output_write_at,
+	file_output_sync,
+	file_output_close,
+	file_output_preallocate,
+	file_output_trim,
+	NULL,
+};
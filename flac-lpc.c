@@ -0,0 +1,345 @@
+#define _USE_MATH_DEFINES // M_PI with MSVC
+#include <math.h>
+#include <string.h>
+
+#include "flac-lpc.h"
+#include "cpu-features.h"
+
+typedef void (*fixed_residual_kernel_t)(const int32_t *data, size_t n, unsigned order, int32_t *residual);
+typedef void (*lpc_residual_kernel_t)(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual);
+
+typedef struct {
+	const char *name;
+	fixed_residual_kernel_t fixed;
+	lpc_residual_kernel_t lpc;
+} flac_lpc_kernels_t;
+
+void flac_lpc_window(double *window, size_t n)
+{
+	// Tukey window with half of the block tapered, as the reference encoder uses by default
+	const size_t taper = n / 4;
+	for (size_t i = 0; i < n; i++) window[i] = 1.0;
+	if (taper < 2) return;
+
+	for (size_t i = 0; i < taper; i++) {
+		double w = 0.5 - 0.5 * cos(M_PI * (double)i / (double)taper);
+		window[i] = w;
+		window[n - 1 - i] = w;
+	}
+}
+
+void flac_lpc_autocorrelation(const int32_t *data, const double *window, double *windowed, size_t n, unsigned max_lag, double *autoc)
+{
+	for (size_t i = 0; i < n; i++) windowed[i] = (double)data[i] * window[i];
+
+	for (unsigned lag = 0; lag <= max_lag; lag++) {
+		double sum = 0.0;
+		for (size_t i = lag; i < n; i++) sum += windowed[i] * windowed[i - lag];
+		autoc[lag] = sum;
+	}
+}
+
+unsigned flac_lpc_coefficients(const double *autoc, unsigned max_order, double coefficients[][FLAC_MAX_LPC_ORDER], double *errors)
+{
+	double lpc[FLAC_MAX_LPC_ORDER];
+	double error = autoc[0];
+
+	for (unsigned i = 0; i < max_order; i++) {
+		double r = -autoc[i + 1];
+		for (unsigned j = 0; j < i; j++) r -= lpc[j] * autoc[i - j];
+		r /= error;
+
+		lpc[i] = r;
+		unsigned j = 0;
+		for (; j < (i >> 1); j++) {
+			double tmp = lpc[j];
+			lpc[j] += r * lpc[i - 1 - j];
+			lpc[i - 1 - j] += r * tmp;
+		}
+		if (i & 1) lpc[j] += lpc[j] * r;
+
+		error *= 1.0 - r * r;
+
+		for (j = 0; j <= i; j++) coefficients[i][j] = -lpc[j];
+		errors[i] = error;
+
+		if (error == 0.0) return i + 1;
+	}
+
+	return max_order;
+}
+
+double flac_lpc_expected_bits(double error, size_t n)
+{
+	if (error <= 0.0 || n == 0) return error < 0.0 ? 1e32 : 0.0;
+
+	double bits = 0.5 * log(0.5 / (double)n * error) / M_LN2;
+	return bits >= 0.0 ? bits : 0.0;
+}
+
+bool flac_lpc_quantize(const double *coefficients, unsigned order, unsigned precision, int32_t *qlp, int *shift)
+{
+	const int32_t max_coefficient = (1 << (precision - 1)) - 1;
+	const int32_t min_coefficient = -(1 << (precision - 1));
+
+	double cmax = 0.0;
+	for (unsigned i = 0; i < order; i++) {
+		if (fabs(coefficients[i]) > cmax) cmax = fabs(coefficients[i]);
+	}
+	if (cmax <= 0.0) return false;
+
+	int log2cmax;
+	frexp(cmax, &log2cmax);
+	log2cmax--;
+
+	// one bit of the precision is the sign, the largest coefficient must fit the rest
+	int s = (int)precision - 1 - log2cmax - 1;
+	if (s > FLAC_MAX_QLP_SHIFT) s = FLAC_MAX_QLP_SHIFT;
+	if (s < 0) return false; // negative shifts are not supported by decoders
+
+	// error feedback keeps the rounding of one coefficient from biasing the next,
+	// a clamped coefficient passes on no more than a rounding error
+	double error = 0.0;
+	for (unsigned i = 0; i < order; i++) {
+		error += coefficients[i] * (double)(1 << s);
+		long q = lround(error);
+		if (q > max_coefficient) q = max_coefficient;
+		else if (q < min_coefficient) q = min_coefficient;
+		error -= (double)q;
+		if (error > 0.5) error = 0.5;
+		else if (error < -0.5) error = -0.5;
+		qlp[i] = (int32_t)q;
+	}
+
+	*shift = s;
+	return true;
+}
+
+void flac_fixed_abs_sums(const int32_t *data, size_t n, uint64_t *sums)
+{
+	memset(sums, 0, sizeof(uint64_t) * (FLAC_MAX_FIXED_ORDER + 1));
+	if (n <= FLAC_MAX_FIXED_ORDER) return;
+
+	// successive differences, all orders over the same range so the sums compare
+	int32_t e0 = data[3], e1 = data[3] - data[2];
+	int32_t e2 = e1 - (data[2] - data[1]);
+	int32_t e3 = e2 - (data[2] - data[1] - (data[1] - data[0]));
+
+	for (size_t i = FLAC_MAX_FIXED_ORDER; i < n; i++) {
+		int32_t d0 = data[i];
+		int32_t d1 = d0 - e0;
+		int32_t d2 = d1 - e1;
+		int32_t d3 = d2 - e2;
+		int32_t d4 = d3 - e3;
+		sums[0] += (uint64_t)(d0 < 0 ? -(int64_t)d0 : d0);
+		sums[1] += (uint64_t)(d1 < 0 ? -(int64_t)d1 : d1);
+		sums[2] += (uint64_t)(d2 < 0 ? -(int64_t)d2 : d2);
+		sums[3] += (uint64_t)(d3 < 0 ? -(int64_t)d3 : d3);
+		sums[4] += (uint64_t)(d4 < 0 ? -(int64_t)d4 : d4);
+		e0 = d0; e1 = d1; e2 = d2; e3 = d3;
+	}
+}
+
+/* scalar kernels */
+
+static void fixed_residual_c(const int32_t *data, size_t n, unsigned order, int32_t *residual)
+{
+	const int32_t *x = data + order;
+	const size_t count = n - order;
+
+	switch (order) {
+	case 0:
+		memcpy(residual, x, count * sizeof(int32_t));
+		break;
+	case 1:
+		for (size_t i = 0; i < count; i++) residual[i] = x[i] - x[i - 1];
+		break;
+	case 2:
+		for (size_t i = 0; i < count; i++) residual[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+		break;
+	case 3:
+		for (size_t i = 0; i < count; i++) residual[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+		break;
+	case 4:
+		for (size_t i = 0; i < count; i++) residual[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+		break;
+	}
+}
+
+static void lpc_residual_c(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual)
+{
+	for (size_t i = order; i < n; i++) {
+		int32_t sum = 0;
+		for (unsigned j = 0; j < order; j++) sum += qlp[j] * data[i - j - 1];
+		residual[i - order] = data[i] - (sum >> shift);
+	}
+}
+
+bool flac_lpc_residual_wide(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual)
+{
+	for (size_t i = order; i < n; i++) {
+		int64_t sum = 0;
+		for (unsigned j = 0; j < order; j++) sum += (int64_t)qlp[j] * data[i - j - 1];
+		int64_t r = (int64_t)data[i] - (sum >> shift);
+		if (r > INT32_MAX / 2 || r < INT32_MIN / 2) return false;
+		residual[i - order] = (int32_t)r;
+	}
+	return true;
+}
+
+#ifdef CPU_X86
+
+/* the fixed predictors only need additions, SSE2 covers them */
+TARGET_SSE2 static void fixed_residual_sse2(const int32_t *data, size_t n, unsigned order, int32_t *residual)
+{
+	if (order == 0) {
+		fixed_residual_c(data, n, order, residual);
+		return;
+	}
+
+	const int32_t *x = data + order;
+	const size_t count = n - order;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i x0 = _mm_loadu_si128((const __m128i *)(x + i));
+		__m128i x1 = _mm_loadu_si128((const __m128i *)(x + i - 1));
+		__m128i r;
+		switch (order) {
+		case 1:
+			r = _mm_sub_epi32(x0, x1);
+			break;
+		case 2: {
+			__m128i x2 = _mm_loadu_si128((const __m128i *)(x + i - 2));
+			r = _mm_add_epi32(_mm_sub_epi32(x0, _mm_slli_epi32(x1, 1)), x2);
+			break;
+		}
+		case 3: {
+			__m128i x2 = _mm_loadu_si128((const __m128i *)(x + i - 2));
+			__m128i x3 = _mm_loadu_si128((const __m128i *)(x + i - 3));
+			__m128i d = _mm_sub_epi32(x2, x1);
+			r = _mm_sub_epi32(_mm_add_epi32(x0, _mm_add_epi32(d, _mm_slli_epi32(d, 1))), x3);
+			break;
+		}
+		default: {
+			__m128i x2 = _mm_loadu_si128((const __m128i *)(x + i - 2));
+			__m128i x3 = _mm_loadu_si128((const __m128i *)(x + i - 3));
+			__m128i x4 = _mm_loadu_si128((const __m128i *)(x + i - 4));
+			__m128i s13 = _mm_slli_epi32(_mm_add_epi32(x1, x3), 2);
+			__m128i x2_6 = _mm_add_epi32(_mm_slli_epi32(x2, 2), _mm_slli_epi32(x2, 1));
+			r = _mm_add_epi32(_mm_sub_epi32(_mm_add_epi32(x0, x2_6), s13), x4);
+			break;
+		}
+		}
+		_mm_storeu_si128((__m128i *)(residual + i), r);
+	}
+
+	if (i < count) fixed_residual_c(data + i, n - i, order, residual + i);
+}
+
+TARGET_AVX2 static void fixed_residual_avx2(const int32_t *data, size_t n, unsigned order, int32_t *residual)
+{
+	if (order == 0) {
+		fixed_residual_c(data, n, order, residual);
+		return;
+	}
+
+	const int32_t *x = data + order;
+	const size_t count = n - order;
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i x0 = _mm256_loadu_si256((const __m256i *)(x + i));
+		__m256i x1 = _mm256_loadu_si256((const __m256i *)(x + i - 1));
+		__m256i r;
+		switch (order) {
+		case 1:
+			r = _mm256_sub_epi32(x0, x1);
+			break;
+		case 2: {
+			__m256i x2 = _mm256_loadu_si256((const __m256i *)(x + i - 2));
+			r = _mm256_add_epi32(_mm256_sub_epi32(x0, _mm256_slli_epi32(x1, 1)), x2);
+			break;
+		}
+		case 3: {
+			__m256i x2 = _mm256_loadu_si256((const __m256i *)(x + i - 2));
+			__m256i x3 = _mm256_loadu_si256((const __m256i *)(x + i - 3));
+			__m256i d = _mm256_sub_epi32(x2, x1);
+			r = _mm256_sub_epi32(_mm256_add_epi32(x0, _mm256_add_epi32(d, _mm256_slli_epi32(d, 1))), x3);
+			break;
+		}
+		default: {
+			__m256i x2 = _mm256_loadu_si256((const __m256i *)(x + i - 2));
+			__m256i x3 = _mm256_loadu_si256((const __m256i *)(x + i - 3));
+			__m256i x4 = _mm256_loadu_si256((const __m256i *)(x + i - 4));
+			__m256i s13 = _mm256_slli_epi32(_mm256_add_epi32(x1, x3), 2);
+			__m256i x2_6 = _mm256_add_epi32(_mm256_slli_epi32(x2, 2), _mm256_slli_epi32(x2, 1));
+			r = _mm256_add_epi32(_mm256_sub_epi32(_mm256_add_epi32(x0, x2_6), s13), x4);
+			break;
+		}
+		}
+		_mm256_storeu_si256((__m256i *)(residual + i), r);
+	}
+
+	if (i < count) fixed_residual_c(data + i, n - i, order, residual + i);
+}
+
+/* eight residuals at a time, one broadcast coefficient per tap */
+TARGET_AVX2 static void lpc_residual_avx2(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual)
+{
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	__m256i coefficients[FLAC_MAX_LPC_ORDER];
+	for (unsigned j = 0; j < order; j++) coefficients[j] = _mm256_set1_epi32(qlp[j]);
+
+	size_t i = order;
+	for (; i + 8 <= n; i += 8) {
+		__m256i sum = _mm256_setzero_si256();
+		for (unsigned j = 0; j < order; j++) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(data + i - j - 1));
+			sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(coefficients[j], x));
+		}
+		__m256i x0 = _mm256_loadu_si256((const __m256i *)(data + i));
+		_mm256_storeu_si256((__m256i *)(residual + i - order), _mm256_sub_epi32(x0, _mm256_sra_epi32(sum, count)));
+	}
+
+	for (; i < n; i++) {
+		int32_t sum = 0;
+		for (unsigned j = 0; j < order; j++) sum += qlp[j] * data[i - j - 1];
+		residual[i - order] = data[i] - (sum >> shift);
+	}
+}
+
+#endif
+
+static const flac_lpc_kernels_t kernels_c = { "C", fixed_residual_c, lpc_residual_c };
+
+#ifdef CPU_X86
+static const flac_lpc_kernels_t kernels_sse2 = { "SSE2", fixed_residual_sse2, lpc_residual_c };
+static const flac_lpc_kernels_t kernels_avx2 = { "AVX2", fixed_residual_avx2, lpc_residual_avx2 };
+#endif
+
+static const flac_lpc_kernels_t *kernels = &kernels_c;
+
+void flac_lpc_init(void)
+{
+#ifdef CPU_X86
+	if (cpu_has_avx2()) kernels = &kernels_avx2;
+	else if (cpu_has_sse2()) kernels = &kernels_sse2;
+	else kernels = &kernels_c;
+#endif
+}
+
+const char *flac_lpc_kernel_name(void)
+{
+	return kernels->name;
+}
+
+void flac_fixed_residual(const int32_t *data, size_t n, unsigned order, int32_t *residual)
+{
+	kernels->fixed(data, n, order, residual);
+}
+
+void flac_lpc_residual(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual)
+{
+	kernels->lpc(data, n, qlp, order, shift, residual);
+}
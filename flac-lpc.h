@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* prediction for the FLAC encoder: fixed predictors, LPC analysis and residuals */
+
+#define FLAC_MAX_FIXED_ORDER 4
+#define FLAC_MAX_LPC_ORDER 12
+#define FLAC_MAX_QLP_SHIFT 15
+
+/* picks the fastest residual kernels for the running CPU, call once before use */
+void flac_lpc_init(void);
+
+/* name of the instruction set the selected kernels use, for logging */
+const char *flac_lpc_kernel_name(void);
+
+/* Tukey(0.5) window of length n */
+void flac_lpc_window(double *window, size_t n);
+
+/* autocorrelation of the windowed data for lags 0..max_lag */
+void flac_lpc_autocorrelation(const int32_t *data, const double *window, double *windowed, size_t n, unsigned max_lag, double *autoc);
+
+/*
+* Levinson-Durbin recursion. Fills coefficients[order - 1] and errors[order - 1]
+* for every order up to max_order and returns the highest order computed,
+* which is lower than max_order when the signal is perfectly predictable.
+*/
+unsigned flac_lpc_coefficients(const double *autoc, unsigned max_order, double coefficients[][FLAC_MAX_LPC_ORDER], double *errors);
+
+/* expected residual bits per sample for the prediction error of n samples */
+double flac_lpc_expected_bits(double error, size_t n);
+
+/* quantizes coefficients to precision bits, false when they cannot be represented */
+bool flac_lpc_quantize(const double *coefficients, unsigned order, unsigned precision, int32_t *qlp, int *shift);
+
+/*
+* Residuals of the samples data[order..n) go to residual[0..n - order).
+* The 32-bit LPC kernel may be used only when bps + precision + ilog2(order) <= 32,
+* the wide one returns false when a residual does not fit in 31 bits.
+*/
+void flac_fixed_residual(const int32_t *data, size_t n, unsigned order, int32_t *residual);
+void flac_lpc_residual(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual);
+bool flac_lpc_residual_wide(const int32_t *data, size_t n, const int32_t *qlp, unsigned order, int shift, int32_t *residual);
+
+/* sums of absolute residuals of the fixed predictors of order 0..FLAC_MAX_FIXED_ORDER */
+void flac_fixed_abs_sums(const int32_t *data, size_t n, uint64_t *sums);
@@ -0,0 +1,765 @@
+#include "audio-writer-filter.h"
+#include "flac-lpc.h"
+
+/*
+* Native FLAC encoder. Samples are collected into fixed 4096 frame blocks,
+* every channel is coded as the cheapest of a constant, verbatim, fixed or
+* LPC subframe with partitioned Rice residuals, and stereo is decorrelated
+* when that is smaller. Frames carry the sample rate and size, so the
+* stream can be decoded from any frame.
+* STREAMINFO and a SEEKTABLE of reserved points are written up front and
+* patched in place at checkpoints and when the file is closed.
+*/
+
+#define FLAC_BLOCK_SIZE 4096
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_SEEK_POINTS 1024
+
+#define FLAC_STREAMINFO_LENGTH 34
+#define FLAC_SEEK_POINT_LENGTH 18
+#define FLAC_STREAMINFO_OFFSET 8 // after "fLaC" and the block header
+#define FLAC_SEEKTABLE_OFFSET (FLAC_STREAMINFO_OFFSET + FLAC_STREAMINFO_LENGTH + 4)
+#define FLAC_SEEKTABLE_LENGTH (FLAC_SEEK_POINTS * FLAC_SEEK_POINT_LENGTH)
+
+enum flac_subframe_type {
+	SUBFRAME_CONSTANT,
+	SUBFRAME_VERBATIM,
+	SUBFRAME_FIXED,
+	SUBFRAME_LPC,
+};
+
+enum flac_channel_assignment {
+	CHANNELS_LEFT_SIDE = 8,
+	CHANNELS_RIGHT_SIDE = 9,
+	CHANNELS_MID_SIDE = 10,
+};
+
+/* compression levels 0 to 8, roughly following the reference encoder */
+typedef struct {
+	unsigned max_lpc_order;
+	unsigned max_partition_order;
+	bool exhaustive_order_search;
+	bool stereo_decorrelation;
+} flac_level_t;
+
+static const flac_level_t flac_levels[] = {
+	{ 0,  3, false, false },
+	{ 0,  3, false, true },
+	{ 0,  4, false, true },
+	{ 6,  4, false, false },
+	{ 8,  4, false, true },
+	{ 8,  5, false, true },
+	{ 8,  6, false, true },
+	{ 12, 6, true,  true },
+	{ 12, 8, true,  true },
+};
+
+#define FLAC_LEVELS (sizeof(flac_levels) / sizeof(flac_level_t))
+
+typedef struct {
+	enum flac_subframe_type type;
+	unsigned order;
+	unsigned precision;
+	int shift;
+	bool wide;
+	int32_t qlp[FLAC_MAX_LPC_ORDER];
+	unsigned partition_order;
+	bool rice2;
+	uint8_t rice[1 << FLAC_MAX_PARTITION_ORDER];
+	uint64_t bits;
+} flac_model_t;
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	uint64_t accumulator;
+	unsigned bits;
+} flac_bits_t;
+
+typedef struct {
+	uint64_t sample;
+	uint64_t offset;
+	uint32_t frames;
+} flac_seek_point_t;
+
+typedef struct {
+	uint32_t channels;
+	uint32_t bps;
+	flac_level_t level;             // of the next frame
+	flac_level_t file_level;        // picked when the file was opened
+
+	int32_t *samples[MAX_AUDIO_CHANNELS]; // planar block being collected
+	uint32_t fill;
+	int32_t *mid;
+	int32_t *side;
+	int32_t *residual;
+	double *window;
+	double *windowed;
+	uint32_t window_length;
+
+	flac_bits_t bits;
+	uint64_t frame_number;
+	uint64_t total_samples;
+	uint64_t stream_length; // bytes of frames written
+	uint32_t min_frame_size;
+	uint32_t max_frame_size;
+
+	// one point per seek_interval samples, the interval doubles when the table is full
+	flac_seek_point_t seek_points[FLAC_SEEK_POINTS];
+	uint32_t seek_points_count;
+	uint64_t seek_interval;
+	uint64_t next_seek_sample;
+} flac_encoder_t;
+
+/* bit writer */
+
+static void bits_reserve(flac_bits_t *bits, size_t bytes)
+{
+	if (bits->size + bytes <= bits->capacity) return;
+	bits->capacity = (bits->size + bytes) * 2;
+	bits->data = brealloc(bits->data, bits->capacity);
+}
+
+static inline void bits_put(flac_bits_t *bits, unsigned count, uint32_t value)
+{
+	bits->accumulator = (bits->accumulator << count) | (value & (uint32_t)(((uint64_t)1 << count) - 1));
+	bits->bits += count;
+	while (bits->bits >= 8) {
+		bits->bits -= 8;
+		bits->data[bits->size++] = (uint8_t)(bits->accumulator >> bits->bits);
+	}
+}
+
+static inline void bits_put_rice(flac_bits_t *bits, uint32_t value, unsigned k)
+{
+	uint32_t quotient = value >> k;
+	const uint32_t tail = (1u << k) | (value & ((1u << k) - 1));
+
+	if (quotient + 1 + k <= 32) {
+		bits_put(bits, quotient + 1 + k, tail);
+		return;
+	}
+	for (; quotient >= 32; quotient -= 32) bits_put(bits, 32, 0);
+	if (quotient) bits_put(bits, quotient, 0);
+	bits_put(bits, 1 + k, tail);
+}
+
+static void bits_put_utf8(flac_bits_t *bits, uint32_t value)
+{
+	if (value < 0x80) {
+		bits_put(bits, 8, value);
+		return;
+	}
+
+	const unsigned bytes = value < 0x800 ? 2 : value < 0x10000 ? 3 : value < 0x200000 ? 4 : value < 0x4000000 ? 5 : 6;
+	bits_put(bits, 8, ((0xFF00 >> bytes) & 0xFF) | (value >> (6 * (bytes - 1))));
+	for (unsigned i = bytes - 1; i > 0; i--) {
+		bits_put(bits, 8, 0x80 | ((value >> (6 * (i - 1))) & 0x3F));
+	}
+}
+
+static void bits_align(flac_bits_t *bits)
+{
+	if (bits->bits) bits_put(bits, 8 - bits->bits, 0);
+}
+
+/* nibble table CRCs, the frames are small and this keeps the tables short */
+
+static uint8_t crc8(const uint8_t *data, size_t size)
+{
+	static const uint8_t table[16] = {
+		0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+	};
+	uint8_t crc = 0;
+	for (size_t i = 0; i < size; i++) {
+		crc = (uint8_t)(crc << 4) ^ table[(crc >> 4) ^ (data[i] >> 4)];
+		crc = (uint8_t)(crc << 4) ^ table[(crc >> 4) ^ (data[i] & 0x0F)];
+	}
+	return crc;
+}
+
+static uint16_t crc16(const uint8_t *data, size_t size)
+{
+	static const uint16_t table[16] = {
+		0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+		0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022
+	};
+	uint16_t crc = 0;
+	for (size_t i = 0; i < size; i++) {
+		crc = (uint16_t)(crc << 4) ^ table[(crc >> 12) ^ (data[i] >> 4)];
+		crc = (uint16_t)(crc << 4) ^ table[(crc >> 12) ^ (data[i] & 0x0F)];
+	}
+	return crc;
+}
+
+/* Rice coding */
+
+static inline uint32_t zigzag(int32_t residual)
+{
+	return ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+}
+
+static unsigned rice_parameter(uint64_t sum, uint32_t count, uint64_t *bits)
+{
+	if (count == 0) {
+		*bits = 0;
+		return 0;
+	}
+
+	unsigned k = 0;
+	while (k < 30 && ((uint64_t)count << (k + 1)) <= sum) k++;
+
+	// the estimate is an upper bound of the coded size, the neighbours may be smaller
+	unsigned best = k;
+	*bits = (uint64_t)count * (k + 1) + (sum >> k);
+	for (unsigned candidate = k ? k - 1 : 0; candidate <= k + 1 && candidate <= 30; candidate++) {
+		uint64_t candidate_bits = (uint64_t)count * (candidate + 1) + (sum >> candidate);
+		if (candidate_bits < *bits) {
+			*bits = candidate_bits;
+			best = candidate;
+		}
+	}
+	return best;
+}
+
+/* picks the partition order and parameters, sums of the finest order are merged upwards */
+static uint64_t rice_search(const flac_encoder_t *encoder, const int32_t *residual, uint32_t n, unsigned order, flac_model_t *model)
+{
+	unsigned max_order = encoder->level.max_partition_order;
+	while (max_order > 0 && ((n & ((1u << max_order) - 1)) != 0 || (n >> max_order) <= order)) max_order--;
+
+	uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+	const uint32_t finest_length = n >> max_order;
+	const int32_t *r = residual;
+	for (uint32_t p = 0; p < (1u << max_order); p++) {
+		const uint32_t count = p == 0 ? finest_length - order : finest_length;
+		uint64_t sum = 0;
+		for (uint32_t i = 0; i < count; i++) sum += zigzag(r[i]);
+		sums[p] = sum;
+		r += count;
+	}
+
+	uint64_t best_bits = UINT64_MAX;
+	for (unsigned partition_order = max_order;; partition_order--) {
+		const uint32_t partitions = 1u << partition_order;
+		const uint32_t length = n >> partition_order;
+		uint8_t parameters[1 << FLAC_MAX_PARTITION_ORDER];
+		bool rice2 = false;
+		uint64_t bits = 6;
+
+		for (uint32_t p = 0; p < partitions; p++) {
+			uint64_t partition_bits;
+			parameters[p] = (uint8_t)rice_parameter(sums[p], p == 0 ? length - order : length, &partition_bits);
+			if (parameters[p] > 14) rice2 = true;
+			bits += partition_bits;
+		}
+		bits += partitions * (rice2 ? 5 : 4);
+
+		if (bits < best_bits) {
+			best_bits = bits;
+			model->partition_order = partition_order;
+			model->rice2 = rice2;
+			memcpy(model->rice, parameters, partitions);
+		}
+
+		if (partition_order == 0) break;
+		for (uint32_t p = 0; p < partitions / 2; p++) sums[p] = sums[2 * p] + sums[2 * p + 1];
+	}
+
+	return best_bits;
+}
+
+static void write_residual(flac_bits_t *bits, const int32_t *residual, uint32_t n, unsigned order, const flac_model_t *model)
+{
+	const uint32_t partitions = 1u << model->partition_order;
+	const uint32_t length = n >> model->partition_order;
+	const unsigned parameter_bits = model->rice2 ? 5 : 4;
+
+	bits_put(bits, 2, model->rice2 ? 1 : 0);
+	bits_put(bits, 4, model->partition_order);
+
+	for (uint32_t p = 0; p < partitions; p++) {
+		const unsigned k = model->rice[p];
+		const uint32_t count = p == 0 ? length - order : length;
+		bits_put(bits, parameter_bits, k);
+		for (uint32_t i = 0; i < count; i++) bits_put_rice(bits, zigzag(residual[i]), k);
+		residual += count;
+	}
+}
+
+/* subframe analysis */
+
+static unsigned ilog2(unsigned value)
+{
+	unsigned log = 0;
+	while (value >>= 1) log++;
+	return log;
+}
+
+static unsigned lpc_precision(uint32_t n, unsigned bps, unsigned order)
+{
+	unsigned precision = n <= 192 ? 7 : n <= 384 ? 8 : n <= 576 ? 9 : n <= 1152 ? 10 : n <= 2304 ? 11 : n <= 4608 ? 12 : 13;
+
+	// keeps 16-bit material on the 32-bit residual kernels
+	if (bps <= 17 && precision > 32 - bps - ilog2(order)) precision = 32 - bps - ilog2(order);
+	return precision;
+}
+
+static bool lpc_residual(const int32_t *x, uint32_t n, const flac_model_t *model, int32_t *residual)
+{
+	if (model->wide) return flac_lpc_residual_wide(x, n, model->qlp, model->order, model->shift, residual);
+
+	flac_lpc_residual(x, n, model->qlp, model->order, model->shift, residual);
+	return true;
+}
+
+static void try_lpc_order(flac_encoder_t *encoder, const int32_t *x, uint32_t n, unsigned bps,
+	const double *coefficients, unsigned order, flac_model_t *best)
+{
+	flac_model_t candidate;
+	candidate.type = SUBFRAME_LPC;
+	candidate.order = order;
+	candidate.precision = lpc_precision(n, bps, order);
+	candidate.wide = bps + candidate.precision + ilog2(order) > 32;
+
+	if (!flac_lpc_quantize(coefficients, order, candidate.precision, candidate.qlp, &candidate.shift)) return;
+	if (!lpc_residual(x, n, &candidate, encoder->residual)) return;
+
+	candidate.bits = 8 + order * bps + 4 + 5 + order * candidate.precision
+		+ rice_search(encoder, encoder->residual, n, order, &candidate);
+	if (candidate.bits < best->bits) *best = candidate;
+}
+
+static void analyze_subframe(flac_encoder_t *encoder, const int32_t *x, uint32_t n, unsigned bps, flac_model_t *model)
+{
+	model->type = SUBFRAME_VERBATIM;
+	model->order = 0;
+	model->bits = 8 + (uint64_t)n * bps;
+
+	bool constant = true;
+	for (uint32_t i = 1; i < n && constant; i++) constant = x[i] == x[0];
+	if (constant) {
+		model->type = SUBFRAME_CONSTANT;
+		model->bits = 8 + bps;
+		return;
+	}
+
+	// fixed predictor with the smallest absolute residual sum
+	unsigned fixed_order = 0;
+	if (n > FLAC_MAX_FIXED_ORDER) {
+		uint64_t sums[FLAC_MAX_FIXED_ORDER + 1];
+		flac_fixed_abs_sums(x, n, sums);
+		for (unsigned order = 1; order <= FLAC_MAX_FIXED_ORDER; order++) {
+			if (sums[order] < sums[fixed_order]) fixed_order = order;
+		}
+	}
+
+	flac_model_t candidate;
+	candidate.type = SUBFRAME_FIXED;
+	candidate.order = fixed_order;
+	flac_fixed_residual(x, n, fixed_order, encoder->residual);
+	candidate.bits = 8 + fixed_order * bps + rice_search(encoder, encoder->residual, n, fixed_order, &candidate);
+	if (candidate.bits < model->bits) *model = candidate;
+
+	unsigned max_order = encoder->level.max_lpc_order;
+	if (max_order == 0 || n <= max_order * 2) return;
+
+	if (encoder->window_length != n) {
+		flac_lpc_window(encoder->window, n);
+		encoder->window_length = n;
+	}
+
+	double autoc[FLAC_MAX_LPC_ORDER + 1];
+	flac_lpc_autocorrelation(x, encoder->window, encoder->windowed, n, max_order, autoc);
+	if (autoc[0] == 0.0) return;
+
+	double coefficients[FLAC_MAX_LPC_ORDER][FLAC_MAX_LPC_ORDER];
+	double errors[FLAC_MAX_LPC_ORDER];
+	max_order = flac_lpc_coefficients(autoc, max_order, coefficients, errors);
+
+	if (encoder->level.exhaustive_order_search) {
+		for (unsigned order = 1; order <= max_order; order++) {
+			try_lpc_order(encoder, x, n, bps, coefficients[order - 1], order, model);
+		}
+		return;
+	}
+
+	// the order with the smallest expected size from the prediction errors
+	unsigned best_order = 1;
+	double best_bits = 1e300;
+	for (unsigned order = 1; order <= max_order; order++) {
+		const uint32_t count = n - order;
+		double bits = flac_lpc_expected_bits(errors[order - 1], count) * count + order * (lpc_precision(n, bps, order) + bps);
+		if (bits < best_bits) {
+			best_bits = bits;
+			best_order = order;
+		}
+	}
+	try_lpc_order(encoder, x, n, bps, coefficients[best_order - 1], best_order, model);
+}
+
+static void write_subframe(flac_encoder_t *encoder, const int32_t *x, uint32_t n, unsigned bps, const flac_model_t *model)
+{
+	flac_bits_t *bits = &encoder->bits;
+
+	switch (model->type) {
+	case SUBFRAME_CONSTANT:
+		bits_put(bits, 8, 0x00);
+		bits_put(bits, bps, (uint32_t)x[0]);
+		break;
+
+	case SUBFRAME_VERBATIM:
+		bits_put(bits, 8, 0x01 << 1);
+		for (uint32_t i = 0; i < n; i++) bits_put(bits, bps, (uint32_t)x[i]);
+		break;
+
+	case SUBFRAME_FIXED:
+		bits_put(bits, 8, (0x08 | model->order) << 1);
+		for (unsigned i = 0; i < model->order; i++) bits_put(bits, bps, (uint32_t)x[i]);
+		flac_fixed_residual(x, n, model->order, encoder->residual);
+		write_residual(bits, encoder->residual, n, model->order, model);
+		break;
+
+	case SUBFRAME_LPC:
+		bits_put(bits, 8, (0x20 | (model->order - 1)) << 1);
+		for (unsigned i = 0; i < model->order; i++) bits_put(bits, bps, (uint32_t)x[i]);
+		bits_put(bits, 4, model->precision - 1);
+		bits_put(bits, 5, (uint32_t)model->shift);
+		for (unsigned i = 0; i < model->order; i++) bits_put(bits, model->precision, (uint32_t)model->qlp[i]);
+		lpc_residual(x, n, model, encoder->residual);
+		write_residual(bits, encoder->residual, n, model->order, model);
+		break;
+	}
+}
+
+/* frames */
+
+static void write_frame_header(flac_encoder_t *encoder, uint32_t rate, uint32_t n, unsigned assignment)
+{
+	flac_bits_t *bits = &encoder->bits;
+
+	unsigned rate_code = 0;
+	switch (rate) {
+	case 88200: rate_code = 1; break;
+	case 176400: rate_code = 2; break;
+	case 192000: rate_code = 3; break;
+	case 8000: rate_code = 4; break;
+	case 16000: rate_code = 5; break;
+	case 22050: rate_code = 6; break;
+	case 24000: rate_code = 7; break;
+	case 32000: rate_code = 8; break;
+	case 44100: rate_code = 9; break;
+	case 48000: rate_code = 10; break;
+	case 96000: rate_code = 11; break;
+	default:
+		if (rate % 1000 == 0 && rate / 1000 <= 255) rate_code = 12;
+		else if (rate <= 65535) rate_code = 13;
+		else if (rate % 10 == 0 && rate / 10 <= 65535) rate_code = 14;
+	}
+
+	bits_put(bits, 16, 0xFFF8); // sync code, fixed block size stream
+	bits_put(bits, 4, n == FLAC_BLOCK_SIZE ? 12 : 7);
+	bits_put(bits, 4, rate_code);
+	bits_put(bits, 4, assignment);
+	bits_put(bits, 3, encoder->bps == 16 ? 4 : 6);
+	bits_put(bits, 1, 0);
+	bits_put_utf8(bits, (uint32_t)encoder->frame_number);
+
+	if (n != FLAC_BLOCK_SIZE) bits_put(bits, 16, n - 1);
+	if (rate_code == 12) bits_put(bits, 8, rate / 1000);
+	else if (rate_code == 13) bits_put(bits, 16, rate);
+	else if (rate_code == 14) bits_put(bits, 16, rate / 10);
+
+	bits_put(bits, 8, crc8(bits->data, bits->size));
+}
+
+static void add_seek_point(flac_encoder_t *encoder, uint32_t n)
+{
+	if (encoder->total_samples < encoder->next_seek_sample) return;
+
+	if (encoder->seek_points_count == FLAC_SEEK_POINTS) {
+		for (uint32_t i = 0; i < FLAC_SEEK_POINTS / 2; i++) encoder->seek_points[i] = encoder->seek_points[2 * i];
+		encoder->seek_points_count = FLAC_SEEK_POINTS / 2;
+		encoder->seek_interval *= 2;
+		encoder->next_seek_sample = encoder->seek_points[encoder->seek_points_count - 1].sample + encoder->seek_interval;
+		if (encoder->total_samples < encoder->next_seek_sample) return;
+	}
+
+	flac_seek_point_t *point = &encoder->seek_points[encoder->seek_points_count++];
+	point->sample = encoder->total_samples;
+	point->offset = encoder->stream_length;
+	point->frames = n;
+	encoder->next_seek_sample = encoder->total_samples + encoder->seek_interval;
+}
+
+static void encode_frame(writer_data_t *data, flac_encoder_t *encoder)
+{
+	const uint32_t n = encoder->fill;
+	const uint32_t channels = encoder->channels;
+	const unsigned bps = encoder->bps;
+	flac_bits_t *bits = &encoder->bits;
+
+	const int32_t *inputs[MAX_AUDIO_CHANNELS];
+	unsigned input_bps[MAX_AUDIO_CHANNELS];
+	flac_model_t models[MAX_AUDIO_CHANNELS];
+	unsigned assignment = channels - 1;
+
+	for (uint32_t c = 0; c < channels; c++) {
+		inputs[c] = encoder->samples[c];
+		input_bps[c] = bps;
+	}
+
+	if (channels == 2 && encoder->level.stereo_decorrelation) {
+		const int32_t *left = encoder->samples[0];
+		const int32_t *right = encoder->samples[1];
+		for (uint32_t i = 0; i < n; i++) {
+			encoder->mid[i] = (left[i] + right[i]) >> 1;
+			encoder->side[i] = left[i] - right[i];
+		}
+
+		flac_model_t mid, side;
+		analyze_subframe(encoder, left, n, bps, &models[0]);
+		analyze_subframe(encoder, right, n, bps, &models[1]);
+		analyze_subframe(encoder, encoder->mid, n, bps, &mid);
+		analyze_subframe(encoder, encoder->side, n, bps + 1, &side);
+
+		const uint64_t independent = models[0].bits + models[1].bits;
+		const uint64_t left_side = models[0].bits + side.bits;
+		const uint64_t right_side = side.bits + models[1].bits;
+		const uint64_t mid_side = mid.bits + side.bits;
+
+		if (mid_side < independent && mid_side <= left_side && mid_side <= right_side) {
+			assignment = CHANNELS_MID_SIDE;
+			inputs[0] = encoder->mid; models[0] = mid;
+			inputs[1] = encoder->side; models[1] = side; input_bps[1] = bps + 1;
+		}
+		else if (left_side < independent && left_side <= right_side) {
+			assignment = CHANNELS_LEFT_SIDE;
+			inputs[1] = encoder->side; models[1] = side; input_bps[1] = bps + 1;
+		}
+		else if (right_side < independent) {
+			assignment = CHANNELS_RIGHT_SIDE;
+			inputs[0] = encoder->side; models[0] = side; input_bps[0] = bps + 1;
+		}
+	}
+	else {
+		for (uint32_t c = 0; c < channels; c++) analyze_subframe(encoder, inputs[c], n, bps, &models[c]);
+	}
+
+	// no subframe is bigger than verbatim, so this bounds the frame
+	bits->size = 0;
+	bits->bits = 0;
+	bits_reserve(bits, channels * ((size_t)n * (bps + 1) / 8 + 64) + 64);
+
+	write_frame_header(encoder, data->sample_info.samples_per_sec, n, assignment);
+	for (uint32_t c = 0; c < channels; c++) write_subframe(encoder, inputs[c], n, input_bps[c], &models[c]);
+	bits_align(bits);
+
+	const uint16_t crc = crc16(bits->data, bits->size);
+	bits_put(bits, 16, crc);
+
+	add_seek_point(encoder, n);
+	output_write(data, bits->data, bits->size);
+
+	const uint32_t frame_size = (uint32_t)bits->size;
+	if (encoder->min_frame_size == 0 || frame_size < encoder->min_frame_size) encoder->min_frame_size = frame_size;
+	if (frame_size > encoder->max_frame_size) encoder->max_frame_size = frame_size;
+
+	encoder->stream_length += bits->size;
+	encoder->total_samples += n;
+	encoder->frame_number++;
+	encoder->fill = 0;
+}
+
+/* metadata */
+
+static inline void put_be(uint8_t *p, uint64_t value, unsigned bytes)
+{
+	for (unsigned i = 0; i < bytes; i++) p[i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+}
+
+/* has no sync, must be called inside locking mutex */
+static void write_flac_metadata(writer_data_t *data, flac_encoder_t *encoder, bool header)
+{
+	uint8_t streaminfo[FLAC_STREAMINFO_LENGTH] = { 0 };
+	put_be(streaminfo + 0, FLAC_BLOCK_SIZE, 2);
+	put_be(streaminfo + 2, FLAC_BLOCK_SIZE, 2);
+	put_be(streaminfo + 4, encoder->min_frame_size, 3);
+	put_be(streaminfo + 7, encoder->max_frame_size, 3);
+	put_be(streaminfo + 10,
+		((uint64_t)data->sample_info.samples_per_sec << 44)
+		| ((uint64_t)(encoder->channels - 1) << 41)
+		| ((uint64_t)(encoder->bps - 1) << 36)
+		| (encoder->total_samples & 0xFFFFFFFFFULL), 8);
+	// the MD5 signature stays zero, which means it was not computed
+
+	uint8_t *seektable = bmalloc(FLAC_SEEKTABLE_LENGTH);
+	for (uint32_t i = 0; i < FLAC_SEEK_POINTS; i++) {
+		uint8_t *p = seektable + i * FLAC_SEEK_POINT_LENGTH;
+		if (i < encoder->seek_points_count) {
+			put_be(p, encoder->seek_points[i].sample, 8);
+			put_be(p + 8, encoder->seek_points[i].offset, 8);
+			put_be(p + 16, encoder->seek_points[i].frames, 2);
+		}
+		else {
+			put_be(p, UINT64_MAX, 8); // placeholder point
+			put_be(p + 8, 0, 8);
+			put_be(p + 16, 0, 2);
+		}
+	}
+
+	if (header) {
+		uint8_t block_header[4];
+		output_write(data, "fLaC", 4);
+		put_be(block_header, FLAC_STREAMINFO_LENGTH, 4); // not last, STREAMINFO
+		output_write(data, block_header, 4);
+		output_write(data, streaminfo, FLAC_STREAMINFO_LENGTH);
+		put_be(block_header, (uint64_t)(0x80 | 3) << 24 | FLAC_SEEKTABLE_LENGTH, 4); // last, SEEKTABLE
+		output_write(data, block_header, 4);
+		output_write(data, seektable, FLAC_SEEKTABLE_LENGTH);
+	}
+	else {
+		output_write_at(data, FLAC_STREAMINFO_OFFSET, streaminfo, FLAC_STREAMINFO_LENGTH);
+		output_write_at(data, FLAC_SEEKTABLE_OFFSET, seektable, FLAC_SEEKTABLE_LENGTH);
+	}
+
+	bfree(seektable);
+}
+
+/* encoder state */
+
+static flac_encoder_t *flac_encoder_get(writer_data_t *data)
+{
+	if (data->flac) return data->flac;
+
+	flac_encoder_t *encoder = bzalloc(sizeof(flac_encoder_t));
+	encoder->channels = (uint32_t)data->sample_info.speakers;
+	for (uint32_t c = 0; c < encoder->channels; c++) {
+		encoder->samples[c] = bmalloc(FLAC_BLOCK_SIZE * sizeof(int32_t));
+	}
+	encoder->mid = bmalloc(FLAC_BLOCK_SIZE * sizeof(int32_t));
+	encoder->side = bmalloc(FLAC_BLOCK_SIZE * sizeof(int32_t));
+	encoder->residual = bmalloc(FLAC_BLOCK_SIZE * sizeof(int32_t));
+	encoder->window = bmalloc(FLAC_BLOCK_SIZE * sizeof(double));
+	encoder->windowed = bmalloc(FLAC_BLOCK_SIZE * sizeof(double));
+
+	data->flac = encoder;
+	return encoder;
+}
+
+static void flac_encoder_reset(writer_data_t *data, flac_encoder_t *encoder)
+{
+	const uint32_t level = data->flac_level < FLAC_LEVELS ? data->flac_level : FLAC_LEVELS - 1;
+
+	encoder->bps = data->sample_format == SAMPLE_FORMAT_INT16 ? 16 : 24;
+	encoder->file_level = flac_levels[level];
+	encoder->level = encoder->file_level;
+	encoder->fill = 0;
+	encoder->frame_number = 0;
+	encoder->total_samples = 0;
+	encoder->stream_length = 0;
+	encoder->min_frame_size = 0;
+	encoder->max_frame_size = 0;
+	encoder->seek_points_count = 0;
+	encoder->seek_interval = data->sample_info.samples_per_sec;
+	encoder->next_seek_sample = 0;
+}
+
+bool flac_writer_prepare(writer_data_t *data)
+{
+	return flac_encoder_get(data) != NULL;
+}
+
+void flac_writer_free(writer_data_t *data)
+{
+	flac_encoder_t *encoder = data->flac;
+	if (!encoder) return;
+
+	for (uint32_t c = 0; c < encoder->channels; c++) bfree(encoder->samples[c]);
+	bfree(encoder->mid);
+	bfree(encoder->side);
+	bfree(encoder->residual);
+	bfree(encoder->window);
+	bfree(encoder->windowed);
+	bfree(encoder->bits.data);
+	bfree(encoder);
+	data->flac = NULL;
+}
+
+/* converts frames of the packet to integers of the stream sample size */
+static void collect_samples(writer_data_t *data, flac_encoder_t *encoder, struct obs_audio_data *audio, uint32_t offset, uint32_t count)
+{
+	const enum sample_format format = encoder->bps == 16 ? SAMPLE_FORMAT_INT16 : SAMPLE_FORMAT_INT24;
+
+	circlebuf_upsize(&data->interleaved_buffer, count * sample_format_size(format));
+	uint8_t *converted = circlebuf_data(&data->interleaved_buffer, 0);
+
+	for (uint32_t c = 0; c < encoder->channels; c++) {
+		uint8_t *plane = audio->data[c] ? audio->data[c] + offset * sizeof(float) : NULL;
+		int32_t *out = encoder->samples[c] + encoder->fill;
+
+		interleave_convert(converted, &plane, 1, count, format, data->dither ? data->dither_state : NULL);
+
+		if (format == SAMPLE_FORMAT_INT16) {
+			const int16_t *in = (const int16_t *)converted;
+			for (uint32_t i = 0; i < count; i++) out[i] = in[i];
+		}
+		else {
+			const uint8_t *in = converted;
+			for (uint32_t i = 0; i < count; i++, in += 3) {
+				out[i] = (int32_t)((uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)(int8_t)in[2] << 16));
+			}
+		}
+	}
+}
+
+void write_flac_packet(writer_data_t *data, struct obs_audio_data *audio)
+{
+	if (!output_lock_open(data)) return;
+
+	flac_encoder_t *encoder = flac_encoder_get(data);
+	if (!data->file_has_header) {
+		flac_encoder_reset(data, encoder);
+		write_flac_metadata(data, encoder, true);
+		data->file_has_header = true;
+	}
+
+	for (uint32_t offset = 0; offset < audio->frames;) {
+		uint32_t count = audio->frames - offset;
+		if (count > FLAC_BLOCK_SIZE - encoder->fill) count = FLAC_BLOCK_SIZE - encoder->fill;
+
+		collect_samples(data, encoder, audio, offset, count);
+		encoder->fill += count;
+		offset += count;
+
+		if (encoder->fill == FLAC_BLOCK_SIZE) {
+			// frames are encoded at level 0 while the writer queue is degraded
+			encoder->level = data->degraded ? flac_levels[0] : encoder->file_level;
+			const uint64_t trace = writer_trace_begin();
+			encode_frame(data, encoder);
+			writer_trace_end("flac encode", trace);
+		}
+	}
+
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+/* has no sync, must be called inside locking mutex */
+void write_flac_finish(writer_data_t *data)
+{
+	flac_encoder_t *encoder = data->flac;
+	if (!encoder || !data->file_has_header) return;
+
+	if (encoder->fill > 0) encode_frame(data, encoder);
+	write_flac_metadata(data, encoder, false);
+}
+
+/* has no sync, must be called inside locking mutex */
+void write_flac_checkpoint(writer_data_t *data)
+{
+	flac_encoder_t *encoder = data->flac;
+	if (!encoder || !data->file_has_header) return;
+
+	write_flac_metadata(data, encoder, false);
+}
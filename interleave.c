@@ -0,0 +1,582 @@
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "interleave.h"
+#include "cpu-features.h"
+
+#define CONVERT_STRIP_FRAMES 256 // strip of interleaved floats that stays in L1
+
+typedef void (*interleave_kernel_t)(float *dst, const float *const *src, size_t frames);
+typedef void (*convert_kernel_t)(void *dst, const float *src, size_t count, uint32_t *dither);
+typedef void (*levels_kernel_t)(const float *src, size_t count, float *peak, float *sum_squares);
+
+typedef struct {
+	const char *name;
+	interleave_kernel_t stereo;
+	interleave_kernel_t surround51;
+	interleave_kernel_t surround71;
+	convert_kernel_t int16;
+	convert_kernel_t int24;
+	convert_kernel_t int32;
+	levels_kernel_t levels;
+} interleave_kernels_t;
+
+/* scalar kernels, writes are sequential so they are already cache friendly */
+
+static void interleave_generic(float *dst, const float *const *src, size_t channels, size_t frames)
+{
+	for (size_t i = 0; i < frames; i++) {
+		for (size_t c = 0; c < channels; c++) {
+			*dst++ = src[c] ? src[c][i] : 0.0f;
+		}
+	}
+}
+
+static void interleave_stereo_c(float *dst, const float *const *src, size_t frames)
+{
+	interleave_generic(dst, src, 2, frames);
+}
+
+static void interleave_51_c(float *dst, const float *const *src, size_t frames)
+{
+	interleave_generic(dst, src, 6, frames);
+}
+
+static void interleave_71_c(float *dst, const float *const *src, size_t frames)
+{
+	interleave_generic(dst, src, 8, frames);
+}
+
+/*
+* TPDF dither is the sum of two uniform values in [-0.5, 0.5) LSB.
+* The generator is xorshift32, one state per vector lane, lane 0 is shared
+* with the scalar code.
+*/
+static inline uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static inline float tpdf_c(uint32_t *dither)
+{
+	if (!dither) return 0.0f;
+	float r1 = (float)(int32_t)xorshift32(dither);
+	float r2 = (float)(int32_t)xorshift32(dither);
+	return (r1 + r2) * (1.0f / 4294967296.0f);
+}
+
+static inline float convert_scale(float sample, float scale, float min, float max, uint32_t *dither)
+{
+	float value = sample * scale + tpdf_c(dither);
+	if (value < min) value = min;
+	if (value > max) value = max;
+	return value;
+}
+
+static void convert_int16_c(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	int16_t *out = dst;
+	for (size_t i = 0; i < count; i++) {
+		out[i] = (int16_t)lrintf(convert_scale(src[i], 32767.0f, -32768.0f, 32767.0f, dither));
+	}
+}
+
+static void convert_int24_c(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	uint8_t *out = dst;
+	for (size_t i = 0; i < count; i++) {
+		int32_t value = (int32_t)lrintf(convert_scale(src[i], 8388607.0f, -8388608.0f, 8388607.0f, dither));
+		*out++ = (uint8_t)value;
+		*out++ = (uint8_t)(value >> 8);
+		*out++ = (uint8_t)(value >> 16);
+	}
+}
+
+/* 2147483520 is the largest float below 2^31 */
+static void convert_int32_c(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	int32_t *out = dst;
+	for (size_t i = 0; i < count; i++) {
+		out[i] = (int32_t)lrintf(convert_scale(src[i], 2147483648.0f, -2147483648.0f, 2147483520.0f, dither));
+	}
+}
+
+static void levels_c(const float *src, size_t count, float *peak, float *sum_squares)
+{
+	float max = 0.0f, sum = 0.0f;
+	for (size_t i = 0; i < count; i++) {
+		const float value = fabsf(src[i]);
+		if (value > max) max = value;
+		sum += src[i] * src[i];
+	}
+	*peak = max;
+	*sum_squares = sum;
+}
+
+#ifdef CPU_X86
+
+/* the tails shorter than one vector are left to the scalar code */
+static inline void interleave_tail(float *dst, const float *const *src, size_t channels, size_t start, size_t frames)
+{
+	const float *tail[INTERLEAVE_MAX_CHANNELS];
+	for (size_t c = 0; c < channels; c++) tail[c] = src[c] + start;
+	interleave_generic(dst + start * channels, tail, channels, frames - start);
+}
+
+TARGET_SSE2 static void interleave_stereo_sse2(float *dst, const float *const *src, size_t frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		__m128 l = _mm_loadu_ps(src[0] + i);
+		__m128 r = _mm_loadu_ps(src[1] + i);
+		_mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(l, r));
+	}
+	interleave_tail(dst, src, 2, i, frames);
+}
+
+TARGET_SSE2 static void interleave_51_sse2(float *dst, const float *const *src, size_t frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		__m128 c0 = _mm_loadu_ps(src[0] + i);
+		__m128 c1 = _mm_loadu_ps(src[1] + i);
+		__m128 c2 = _mm_loadu_ps(src[2] + i);
+		__m128 c3 = _mm_loadu_ps(src[3] + i);
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+		__m128 c4 = _mm_loadu_ps(src[4] + i);
+		__m128 c5 = _mm_loadu_ps(src[5] + i);
+		__m128 lo = _mm_unpacklo_ps(c4, c5);
+		__m128 hi = _mm_unpackhi_ps(c4, c5);
+
+		float *out = dst + 6 * i;
+		_mm_storeu_ps(out, c0);
+		_mm_storel_pi((__m64 *)(out + 4), lo);
+		_mm_storeu_ps(out + 6, c1);
+		_mm_storeh_pi((__m64 *)(out + 10), lo);
+		_mm_storeu_ps(out + 12, c2);
+		_mm_storel_pi((__m64 *)(out + 16), hi);
+		_mm_storeu_ps(out + 18, c3);
+		_mm_storeh_pi((__m64 *)(out + 22), hi);
+	}
+	interleave_tail(dst, src, 6, i, frames);
+}
+
+TARGET_SSE2 static void interleave_71_sse2(float *dst, const float *const *src, size_t frames)
+{
+	size_t i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		__m128 a0 = _mm_loadu_ps(src[0] + i);
+		__m128 a1 = _mm_loadu_ps(src[1] + i);
+		__m128 a2 = _mm_loadu_ps(src[2] + i);
+		__m128 a3 = _mm_loadu_ps(src[3] + i);
+		_MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+
+		__m128 b0 = _mm_loadu_ps(src[4] + i);
+		__m128 b1 = _mm_loadu_ps(src[5] + i);
+		__m128 b2 = _mm_loadu_ps(src[6] + i);
+		__m128 b3 = _mm_loadu_ps(src[7] + i);
+		_MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+
+		float *out = dst + 8 * i;
+		_mm_storeu_ps(out, a0);
+		_mm_storeu_ps(out + 4, b0);
+		_mm_storeu_ps(out + 8, a1);
+		_mm_storeu_ps(out + 12, b1);
+		_mm_storeu_ps(out + 16, a2);
+		_mm_storeu_ps(out + 20, b2);
+		_mm_storeu_ps(out + 24, a3);
+		_mm_storeu_ps(out + 28, b3);
+	}
+	interleave_tail(dst, src, 8, i, frames);
+}
+
+TARGET_AVX2 static void interleave_stereo_avx2(float *dst, const float *const *src, size_t frames)
+{
+	size_t i = 0;
+	for (; i + 8 <= frames; i += 8) {
+		__m256 l = _mm256_loadu_ps(src[0] + i);
+		__m256 r = _mm256_loadu_ps(src[1] + i);
+		__m256 lo = _mm256_unpacklo_ps(l, r); // l0 r0 l1 r1 | l4 r4 l5 r5
+		__m256 hi = _mm256_unpackhi_ps(l, r); // l2 r2 l3 r3 | l6 r6 l7 r7
+		_mm256_storeu_ps(dst + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(dst + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	interleave_tail(dst, src, 2, i, frames);
+}
+
+/* 8x8 transpose, one row per channel in, one row per frame out */
+TARGET_AVX2 static void interleave_71_avx2(float *dst, const float *const *src, size_t frames)
+{
+	size_t i = 0;
+	for (; i + 8 <= frames; i += 8) {
+		__m256 r0 = _mm256_loadu_ps(src[0] + i);
+		__m256 r1 = _mm256_loadu_ps(src[1] + i);
+		__m256 r2 = _mm256_loadu_ps(src[2] + i);
+		__m256 r3 = _mm256_loadu_ps(src[3] + i);
+		__m256 r4 = _mm256_loadu_ps(src[4] + i);
+		__m256 r5 = _mm256_loadu_ps(src[5] + i);
+		__m256 r6 = _mm256_loadu_ps(src[6] + i);
+		__m256 r7 = _mm256_loadu_ps(src[7] + i);
+
+		__m256 t0 = _mm256_unpacklo_ps(r0, r1);
+		__m256 t1 = _mm256_unpackhi_ps(r0, r1);
+		__m256 t2 = _mm256_unpacklo_ps(r2, r3);
+		__m256 t3 = _mm256_unpackhi_ps(r2, r3);
+		__m256 t4 = _mm256_unpacklo_ps(r4, r5);
+		__m256 t5 = _mm256_unpackhi_ps(r4, r5);
+		__m256 t6 = _mm256_unpacklo_ps(r6, r7);
+		__m256 t7 = _mm256_unpackhi_ps(r6, r7);
+
+		__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+		__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+		__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+		__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+		__m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+		float *out = dst + 8 * i;
+		_mm256_storeu_ps(out, _mm256_permute2f128_ps(s0, s4, 0x20));
+		_mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(s1, s5, 0x20));
+		_mm256_storeu_ps(out + 16, _mm256_permute2f128_ps(s2, s6, 0x20));
+		_mm256_storeu_ps(out + 24, _mm256_permute2f128_ps(s3, s7, 0x20));
+		_mm256_storeu_ps(out + 32, _mm256_permute2f128_ps(s0, s4, 0x31));
+		_mm256_storeu_ps(out + 40, _mm256_permute2f128_ps(s1, s5, 0x31));
+		_mm256_storeu_ps(out + 48, _mm256_permute2f128_ps(s2, s6, 0x31));
+		_mm256_storeu_ps(out + 56, _mm256_permute2f128_ps(s3, s7, 0x31));
+	}
+	interleave_tail(dst, src, 8, i, frames);
+}
+
+TARGET_SSE2 static inline __m128 tpdf_sse2(__m128i *state)
+{
+	__m128i x = *state;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	__m128 r1 = _mm_cvtepi32_ps(x);
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	__m128 r2 = _mm_cvtepi32_ps(x);
+	*state = x;
+	return _mm_mul_ps(_mm_add_ps(r1, r2), _mm_set1_ps(1.0f / 4294967296.0f));
+}
+
+/* scales, dithers, clamps and rounds 4 samples to int32 */
+TARGET_SSE2 static inline __m128i convert_sse2(const float *src, __m128 scale, __m128 min, __m128 max, __m128i *state, bool dither)
+{
+	__m128 value = _mm_mul_ps(_mm_loadu_ps(src), scale);
+	if (dither) value = _mm_add_ps(value, tpdf_sse2(state));
+	value = _mm_max_ps(_mm_min_ps(value, max), min);
+	return _mm_cvtps_epi32(value);
+}
+
+TARGET_SSE2 static void convert_int16_sse2(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	const __m128 scale = _mm_set1_ps(32767.0f);
+	const __m128 min = _mm_set1_ps(-32768.0f);
+	const __m128 max = _mm_set1_ps(32767.0f);
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither) : _mm_setzero_si128();
+	int16_t *out = dst;
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m128i a = convert_sse2(src + i, scale, min, max, &state, dither != NULL);
+		__m128i b = convert_sse2(src + i + 4, scale, min, max, &state, dither != NULL);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(a, b));
+	}
+
+	if (dither) _mm_storeu_si128((__m128i *)dither, state);
+	convert_int16_c(out + i, src + i, count - i, dither);
+}
+
+TARGET_SSE2 static void convert_int24_sse2(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	const __m128 scale = _mm_set1_ps(8388607.0f);
+	const __m128 min = _mm_set1_ps(-8388608.0f);
+	const __m128 max = _mm_set1_ps(8388607.0f);
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither) : _mm_setzero_si128();
+	uint8_t *out = dst;
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		int32_t values[4];
+		_mm_storeu_si128((__m128i *)values, convert_sse2(src + i, scale, min, max, &state, dither != NULL));
+		for (size_t k = 0; k < 4; k++) {
+			*out++ = (uint8_t)values[k];
+			*out++ = (uint8_t)(values[k] >> 8);
+			*out++ = (uint8_t)(values[k] >> 16);
+		}
+	}
+
+	if (dither) _mm_storeu_si128((__m128i *)dither, state);
+	convert_int24_c(out, src + i, count - i, dither);
+}
+
+TARGET_SSE2 static void convert_int32_sse2(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	const __m128 scale = _mm_set1_ps(2147483648.0f);
+	const __m128 min = _mm_set1_ps(-2147483648.0f);
+	const __m128 max = _mm_set1_ps(2147483520.0f);
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither) : _mm_setzero_si128();
+	int32_t *out = dst;
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128((__m128i *)(out + i), convert_sse2(src + i, scale, min, max, &state, dither != NULL));
+	}
+
+	if (dither) _mm_storeu_si128((__m128i *)dither, state);
+	convert_int32_c(out + i, src + i, count - i, dither);
+}
+
+TARGET_AVX2 static inline __m256 tpdf_avx2(__m256i *state)
+{
+	__m256i x = *state;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	__m256 r1 = _mm256_cvtepi32_ps(x);
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	__m256 r2 = _mm256_cvtepi32_ps(x);
+	*state = x;
+	return _mm256_mul_ps(_mm256_add_ps(r1, r2), _mm256_set1_ps(1.0f / 4294967296.0f));
+}
+
+TARGET_AVX2 static inline __m256i convert_avx2(const float *src, __m256 scale, __m256 min, __m256 max, __m256i *state, bool dither)
+{
+	__m256 value = _mm256_mul_ps(_mm256_loadu_ps(src), scale);
+	if (dither) value = _mm256_add_ps(value, tpdf_avx2(state));
+	value = _mm256_max_ps(_mm256_min_ps(value, max), min);
+	return _mm256_cvtps_epi32(value);
+}
+
+TARGET_AVX2 static void convert_int16_avx2(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	const __m256 scale = _mm256_set1_ps(32767.0f);
+	const __m256 min = _mm256_set1_ps(-32768.0f);
+	const __m256 max = _mm256_set1_ps(32767.0f);
+	__m256i state = dither ? _mm256_loadu_si256((const __m256i *)dither) : _mm256_setzero_si256();
+	int16_t *out = dst;
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m256i a = convert_avx2(src + i, scale, min, max, &state, dither != NULL);
+		__m256i b = convert_avx2(src + i + 8, scale, min, max, &state, dither != NULL);
+		// packs works per 128-bit lane, put the quarters back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)(out + i), packed);
+	}
+
+	if (dither) _mm256_storeu_si256((__m256i *)dither, state);
+	convert_int16_c(out + i, src + i, count - i, dither);
+}
+
+TARGET_AVX2 static void convert_int32_avx2(void *dst, const float *src, size_t count, uint32_t *dither)
+{
+	const __m256 scale = _mm256_set1_ps(2147483648.0f);
+	const __m256 min = _mm256_set1_ps(-2147483648.0f);
+	const __m256 max = _mm256_set1_ps(2147483520.0f);
+	__m256i state = dither ? _mm256_loadu_si256((const __m256i *)dither) : _mm256_setzero_si256();
+	int32_t *out = dst;
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_si256((__m256i *)(out + i), convert_avx2(src + i, scale, min, max, &state, dither != NULL));
+	}
+
+	if (dither) _mm256_storeu_si256((__m256i *)dither, state);
+	convert_int32_c(out + i, src + i, count - i, dither);
+}
+
+/* peak is the maximum of the values with the sign bit cleared, squares are summed per lane */
+TARGET_SSE2 static void levels_sse2(const float *src, size_t count, float *peak, float *sum_squares)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 max = _mm_setzero_ps(), sum = _mm_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(src + i);
+		max = _mm_max_ps(max, _mm_and_ps(x, abs_mask));
+		sum = _mm_add_ps(sum, _mm_mul_ps(x, x));
+	}
+
+	float lanes_max[4], lanes_sum[4];
+	_mm_storeu_ps(lanes_max, max);
+	_mm_storeu_ps(lanes_sum, sum);
+
+	levels_c(src + i, count - i, peak, sum_squares);
+	for (size_t l = 0; l < 4; l++) {
+		if (lanes_max[l] > *peak) *peak = lanes_max[l];
+		*sum_squares += lanes_sum[l];
+	}
+}
+
+TARGET_AVX2 static void levels_avx2(const float *src, size_t count, float *peak, float *sum_squares)
+{
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	__m256 max = _mm256_setzero_ps(), sum = _mm256_setzero_ps();
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(src + i);
+		max = _mm256_max_ps(max, _mm256_and_ps(x, abs_mask));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(x, x));
+	}
+
+	float lanes_max[8], lanes_sum[8];
+	_mm256_storeu_ps(lanes_max, max);
+	_mm256_storeu_ps(lanes_sum, sum);
+
+	levels_c(src + i, count - i, peak, sum_squares);
+	for (size_t l = 0; l < 8; l++) {
+		if (lanes_max[l] > *peak) *peak = lanes_max[l];
+		*sum_squares += lanes_sum[l];
+	}
+}
+
+#endif
+
+static const interleave_kernels_t kernels_c = {
+	"C", interleave_stereo_c, interleave_51_c, interleave_71_c,
+	convert_int16_c, convert_int24_c, convert_int32_c, levels_c
+};
+
+#ifdef CPU_X86
+static const interleave_kernels_t kernels_sse2 = {
+	"SSE2", interleave_stereo_sse2, interleave_51_sse2, interleave_71_sse2,
+	convert_int16_sse2, convert_int24_sse2, convert_int32_sse2, levels_sse2
+};
+
+static const interleave_kernels_t kernels_avx2 = {
+	"AVX2", interleave_stereo_avx2, interleave_51_sse2, interleave_71_avx2,
+	convert_int16_avx2, convert_int24_sse2, convert_int32_avx2, levels_avx2
+};
+#endif
+
+static const interleave_kernels_t *kernels = &kernels_c;
+
+void interleave_init(void)
+{
+#ifdef CPU_X86
+	if (cpu_has_avx2()) kernels = &kernels_avx2;
+	else if (cpu_has_sse2()) kernels = &kernels_sse2;
+	else kernels = &kernels_c;
+#endif
+}
+
+const char *interleave_kernel_name(void)
+{
+	return kernels->name;
+}
+
+void interleave_float(float *dst, uint8_t *const *planes, size_t channels, size_t frames)
+{
+	const float *const *src = (const float *const *)planes;
+
+	size_t silent_channels = 0;
+	for (size_t c = 0; c < channels; c++) {
+		if (!src[c]) silent_channels++;
+	}
+
+	if (silent_channels == channels) {
+		memset(dst, 0, channels * frames * sizeof(float));
+		return;
+	}
+	if (silent_channels > 0) {
+		interleave_generic(dst, src, channels, frames);
+		return;
+	}
+
+	switch (channels) {
+	case 1:
+		memcpy(dst, src[0], frames * sizeof(float));
+		break;
+	case 2:
+		kernels->stereo(dst, src, frames);
+		break;
+	case 6:
+		kernels->surround51(dst, src, frames);
+		break;
+	case 8:
+		kernels->surround71(dst, src, frames);
+		break;
+	default:
+		interleave_generic(dst, src, channels, frames);
+		break;
+	}
+}
+
+size_t sample_format_size(enum sample_format format)
+{
+	switch (format) {
+	case SAMPLE_FORMAT_INT16: return 2;
+	case SAMPLE_FORMAT_INT24: return 3;
+	case SAMPLE_FORMAT_INT32: return 4;
+	default:                  return 4;
+	}
+}
+
+/*
+* Interleaving and conversion are done strip by strip, so the floats are
+* converted while they are still in L1 and the only full size pass over
+* memory is the store of the converted samples.
+*/
+void interleave_convert(void *dst, uint8_t *const *planes, size_t channels, size_t frames, enum sample_format format, uint32_t *dither)
+{
+	convert_kernel_t convert;
+	switch (format) {
+	case SAMPLE_FORMAT_INT16: convert = kernels->int16; break;
+	case SAMPLE_FORMAT_INT24: convert = kernels->int24; break;
+	case SAMPLE_FORMAT_INT32: convert = kernels->int32; break;
+	default:
+		interleave_float(dst, planes, channels, frames);
+		return;
+	}
+
+	float strip[CONVERT_STRIP_FRAMES * INTERLEAVE_MAX_CHANNELS];
+	uint8_t *strip_planes[INTERLEAVE_MAX_CHANNELS];
+	uint8_t *out = dst;
+	const size_t strip_bytes = channels * sample_format_size(format);
+
+	for (size_t i = 0; i < frames; i += CONVERT_STRIP_FRAMES) {
+		size_t count = frames - i < CONVERT_STRIP_FRAMES ? frames - i : CONVERT_STRIP_FRAMES;
+		for (size_t c = 0; c < channels; c++) {
+			strip_planes[c] = planes[c] ? planes[c] + i * sizeof(float) : NULL;
+		}
+
+		interleave_float(strip, strip_planes, channels, count);
+		convert(out, strip, count * channels, dither);
+		out += count * strip_bytes;
+	}
+}
+
+/* the loudest channel decides, silent (NULL) planes count as zero */
+void interleave_levels(uint8_t *const *planes, size_t channels, size_t frames, float *peak, float *rms)
+{
+	float max_peak = 0.0f, max_sum = 0.0f;
+
+	for (size_t c = 0; c < channels; c++) {
+		if (!planes[c]) continue;
+
+		float channel_peak, channel_sum;
+		kernels->levels((const float *)planes[c], frames, &channel_peak, &channel_sum);
+		if (channel_peak > max_peak) max_peak = channel_peak;
+		if (channel_sum > max_sum) max_sum = channel_sum;
+	}
+
+	*peak = max_peak;
+	*rms = frames > 0 ? sqrtf(max_sum / (float)frames) : 0.0f;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define INTERLEAVE_MAX_CHANNELS 8
+
+/* sample formats the internal writers can store */
+enum sample_format {
+	SAMPLE_FORMAT_FLOAT32,
+	SAMPLE_FORMAT_INT16,
+	SAMPLE_FORMAT_INT24,
+	SAMPLE_FORMAT_INT32,
+};
+
+/* picks the fastest interleave kernels for the running CPU, call once before use */
+void interleave_init(void);
+
+/* name of the instruction set the selected kernels use, for logging */
+const char *interleave_kernel_name(void);
+
+/*
+* Interleaves planar float channels into dst.
+* NULL planes are written as silence.
+*/
+void interleave_float(float *dst, uint8_t *const *planes, size_t channels, size_t frames);
+
+size_t sample_format_size(enum sample_format format);
+
+/*
+* Interleaves planar float channels into dst converting them to format.
+* dither points to INTERLEAVE_MAX_CHANNELS nonzero generator states for
+* TPDF dither, or is NULL to round without dither.
+*/
+void interleave_convert(void *dst, uint8_t *const *planes, size_t channels, size_t frames, enum sample_format format, uint32_t *dither);
+
+/* peak and RMS level of the loudest channel, NULL planes are silence */
+void interleave_levels(uint8_t *const *planes, size_t channels, size_t frames, float *peak, float *rms);
@@ -6,89 +6,199 @@ typedef struct {
 	uint32_t ChunkID;
 	uint32_t ChunkSize;
 	uint32_t Format;
-	uint32_t Subchunk1ID;
-	uint32_t Subchunk1Size;
+} wav_riff_t;
+
+// WAVEFORMATEXTENSIBLE, the plain fmt chunk ends after BitsPerSample
+typedef struct {
+	uint32_t ChunkID;
+	uint32_t ChunkSize;
 	uint16_t AudioFormat;
 	uint16_t NumChannels;
 	uint32_t SampleRate;
 	uint32_t ByteRate;
 	uint16_t BlockAlign;
 	uint16_t BitsPerSample;
-	uint32_t Subchunk2ID;
-	uint32_t Subchunk2Size;
-} wav_header_t;
+	uint16_t ExtensionSize;
+	uint16_t ValidBitsPerSample;
+	uint32_t ChannelMask;
+	uint8_t SubFormat[16];
+} wav_fmt_t;
+
+typedef struct {
+	uint32_t ChunkID;
+	uint32_t ChunkSize;
+} wav_chunk_t;
+
+// EBU Tech 3306, reserved as JUNK right after "WAVE" and turned into ds64 when the file outgrows RIFF
+typedef struct {
+	uint32_t ChunkID;
+	uint32_t ChunkSize;
+	uint64_t RiffSize;
+	uint64_t DataSize;
+	uint64_t SampleCount;
+	uint32_t TableLength;
+} wav_ds64_t;
 #pragma pack(pop)
 
 const int PLACEHOLDER1_OFFSET = 4;
-const int PLACEHOLDER2_OFFSET = 40;
-const int DATA_BEGINNING = 36; // 4 + (8 + 16) + (8)
+const int DS64_OFFSET = 12;
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_FMT_SIZE 16
+#define WAV_FMT_EXTENSIBLE_SIZE 40
+
+/* speaker positions of the OBS layout with that many channels, 0 when it has no standard one */
+static uint32_t wav_channel_mask(uint32_t channels)
+{
+	switch (channels) {
+	case 1: return 0x4;   // FC
+	case 2: return 0x3;   // FL FR
+	case 3: return 0xB;   // FL FR LFE
+	case 4: return 0x107; // FL FR FC BC
+	case 5: return 0x10F; // FL FR FC LFE BC
+	case 6: return 0x60F; // FL FR FC LFE SL SR
+	case 8: return 0x63F; // FL FR FC LFE BL BR SL SR
+	default: return 0;
+	}
+}
 
 /* has no sync, must be called inside locking mutex */
 static inline void write_wav_header(writer_data_t *data)
 {
-	wav_header_t header = {
+	const uint16_t sample_size = (uint16_t)output_sample_size(data);
+	const uint16_t channels = (uint16_t)data->sample_info.speakers;
+	const bool is_float = data->sample_format == SAMPLE_FORMAT_FLOAT32;
+	// the plain fmt chunk is ambiguous for integers over 16 bits and has no channel positions
+	const bool extensible = (!is_float && sample_size > 2) || channels > 2;
+
+	wav_riff_t riff = {
 		*(uint32_t*)&"RIFF",
-		0, // PLACEHOLDER1 for size of 2 chunks
-		*(uint32_t*)&"WAVE",
+		0, // PLACEHOLDER1 for size of all chunks
+		*(uint32_t*)&"WAVE"
+	};
 
-		// chunk 1
+	wav_fmt_t fmt = {
 		*(uint32_t*)&"fmt ",
-		16, // size of fmt chunk
-		BYTES_PER_SAMPLE - 1, // 1 PCM, 3 IEEE float
-		(uint16_t)data->sample_info.speakers, // number of channels
+		extensible ? WAV_FMT_EXTENSIBLE_SIZE : WAV_FMT_SIZE,
+		extensible ? WAV_FORMAT_EXTENSIBLE : is_float ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM,
+		channels,
 		data->sample_info.samples_per_sec, // 48000 or 44100 in OBS
-		data->sample_info.samples_per_sec * data->sample_info.speakers * BYTES_PER_SAMPLE, // bytes per second
-		(uint16_t)data->sample_info.speakers * BYTES_PER_SAMPLE, // bytes per block including one sample of each channel
-		8 * BYTES_PER_SAMPLE, // bits per sample
+		data->sample_info.samples_per_sec * channels * sample_size, // bytes per second
+		channels * sample_size, // bytes per block including one sample of each channel
+		8 * sample_size, // bits per sample
+
+		// extensible only
+		WAV_FMT_EXTENSIBLE_SIZE - WAV_FMT_SIZE - 2,
+		8 * sample_size, // all bits are valid
+		wav_channel_mask(channels),
+		// KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT
+		{ is_float ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 }
+	};
 
-		// chunk 2
+	wav_chunk_t data_chunk = {
 		*(uint32_t*)&"data",
-		0 // PLACEHOLDER2 for chunk 2 size
+		0 // PLACEHOLDER2 for data chunk size
 	};
 
-	fwrite(&header, sizeof(wav_header_t), 1, data->file);
+	output_write(data, &riff, sizeof(wav_riff_t));
+	data->header_length = sizeof(wav_riff_t);
+	if (data->wav_rf64) {
+		wav_ds64_t junk = { *(uint32_t*)&"JUNK", sizeof(wav_ds64_t) - 8, 0, 0, 0, 0 };
+		output_write(data, &junk, sizeof(wav_ds64_t));
+		data->header_length += sizeof(wav_ds64_t);
+	}
+	output_write(data, &fmt, 8 + fmt.ChunkSize);
+	output_write(data, &data_chunk, sizeof(wav_chunk_t));
+	data->header_length += 8 + fmt.ChunkSize + sizeof(wav_chunk_t);
+	data->wav_ds64 = data->wav_rf64;
 	data->file_has_header = true;
 }
 
-void write_raw_packet(writer_data_t *data, struct obs_audio_data *audio)
+/* files without the reserved ds64 chunk must stay below 4 GiB, the pad byte included */
+static inline bool wav_can_grow(writer_data_t *data, uint32_t packet_length)
 {
-	if (!open_output(data)) return;
+	if (data->wav_ds64) return true;
+	return data->data_length + packet_length + 1 <= UINT32_MAX - (data->header_length - 8);
+}
 
-	pthread_mutex_lock(&data->output_lock);
+void write_raw_packet(writer_data_t *data, struct obs_audio_data *audio)
+{
+	if (!output_lock_open(data)) return;
 
-	void *buffer = fill_interleaved_buffer(data, audio);
-	fwrite(buffer, BYTES_PER_SAMPLE, audio->frames * data->sample_info.speakers, data->file);
+	output_write_samples(data, audio);
 
 	pthread_mutex_unlock(&data->output_lock);
 }
 
 void write_wav_packet(writer_data_t *data, struct obs_audio_data *audio)
 {
-	uint32_t packet_length = BYTES_PER_SAMPLE * audio->frames * data->sample_info.speakers;
+	uint32_t packet_length = (uint32_t)output_sample_size(data) * audio->frames * data->sample_info.speakers;
 
-	if (data->data_length > UINT32_MAX - DATA_BEGINNING - packet_length) close_output(data);
+	if (data->file_has_header && !wav_can_grow(data, packet_length)) writer_segment_switch(data);
 
-	if (!open_output(data)) return;
-
-	pthread_mutex_lock(&data->output_lock);
+	if (!output_lock_open(data)) return;
 
 	if (!data->file_has_header) write_wav_header(data);
 	
-	void *buffer = fill_interleaved_buffer(data, audio);
-	fwrite(buffer, packet_length, 1, data->file);
+	output_write_samples(data, audio);
 	data->data_length += packet_length;
 
 	pthread_mutex_unlock(&data->output_lock);
 }
 
-/* has no sync, must be called inside locking mutex */
-void write_wav_placeholders(writer_data_t *data)
+/*
+* has no sync, must be called inside locking mutex
+* Files that fit in 4 GiB stay plain RIFF, bigger ones are turned into RF64.
+* The RIFF size counts the pad byte of an odd data chunk once it is written.
+*/
+void write_wav_placeholders(writer_data_t *data, bool padded)
 {
-	uint32_t chunks_length = DATA_BEGINNING + data->data_length;
+	const uint64_t chunks_length = data->header_length - 8 + data->data_length + (padded ? data->data_length & 1 : 0);
+	const uint64_t data_size_offset = data->header_length - 4;
+
+	if (chunks_length <= UINT32_MAX) {
+		uint32_t chunks_length32 = (uint32_t)chunks_length;
+		uint32_t data_length32 = (uint32_t)data->data_length;
+		output_write_at(data, PLACEHOLDER1_OFFSET, &chunks_length32, sizeof(uint32_t));
+		output_write_at(data, data_size_offset, &data_length32, sizeof(uint32_t));
+		return;
+	}
+
+	const uint64_t block_align = output_sample_size(data) * data->sample_info.speakers;
+	wav_ds64_t ds64 = {
+		*(uint32_t*)&"ds64",
+		sizeof(wav_ds64_t) - 8,
+		chunks_length,
+		data->data_length,
+		data->data_length / block_align,
+		0
+	};
+	uint32_t rf64 = *(uint32_t*)&"RF64";
+	uint32_t size_in_ds64 = UINT32_MAX;
+
+	output_write_at(data, 0, &rf64, sizeof(uint32_t));
+	output_write_at(data, PLACEHOLDER1_OFFSET, &size_in_ds64, sizeof(uint32_t));
+	output_write_at(data, DS64_OFFSET, &ds64, sizeof(wav_ds64_t));
+	output_write_at(data, data_size_offset, &size_in_ds64, sizeof(uint32_t));
+}
 
-	fseek(data->file, PLACEHOLDER1_OFFSET, SEEK_SET);
-	fwrite(&chunks_length, sizeof(uint32_t), 1, data->file);
+/* has no sync, must be called inside locking mutex */
+void write_wav_finish(writer_data_t *data)
+{
+	if (!data->file_has_header) return;
+
+	// chunks are word aligned, the pad byte is a part of the RIFF size but not of the data size
+	if (data->data_length & 1) {
+		uint8_t pad = 0;
+		output_write(data, &pad, 1);
+	}
+	write_wav_placeholders(data, true);
+}
 
-	fseek(data->file, PLACEHOLDER2_OFFSET, SEEK_SET);
-	fwrite(&data->data_length, sizeof(uint32_t), 1, data->file);
+/* has no sync, must be called inside locking mutex */
+void write_wav_checkpoint(writer_data_t *data)
+{
+	if (data->file_has_header) write_wav_placeholders(data, false);
 }
@@ -0,0 +1,526 @@
+#include <sys/stat.h>
+
+#include "audio-writer-filter.h"
+#include "io-service.h"
+
+/*
+* Process-wide I/O service. The writer threads of all filter instances copy
+* their bytes into pooled buffers and queue them here, one thread per storage
+* device writes them out through the stdio file output. A device thread
+* serves its files round-robin, at most IO_QUANTUM bytes from one file before
+* moving to the next, so 40 recordings on one disk become one write stream
+* instead of 40 competing ones.
+* Queued bytes of all devices are bounded by max_in_flight, a writer thread
+* that would exceed it waits for the disks to catch up.
+*/
+
+#define IO_BUFFER_SIZE (256 * 1024)
+#define IO_QUANTUM (1024 * 1024)
+
+#define IO_LOG(level, format, ...) blog(level, "[audio writer filter (shared output)] " format, ##__VA_ARGS__)
+
+enum io_request_type {
+	IO_WRITE,
+	IO_WRITE_AT,
+	IO_PREALLOCATE,
+	IO_TRIM,
+	IO_SYNC,
+	IO_CLOSE,
+};
+
+typedef struct io_request {
+	struct io_request *next;
+	enum io_request_type type;
+	uint64_t offset;        // WRITE_AT and PREALLOCATE, the file size for TRIM
+	uint64_t length;        // PREALLOCATE, the allocated size for TRIM
+	size_t size;            // payload bytes, counted against the budget
+	bool done;              // SYNC, set by the device thread
+	uint8_t *data;
+} io_request_t;
+
+struct io_device;
+
+typedef struct io_sink {
+	struct io_sink *next;   // in the device ring
+	struct io_device *device;
+	void *file;             // file_output sink, touched by the device thread only
+	io_request_t *head;     // queued requests, under the device lock
+	io_request_t *tail;
+	io_request_t *current;  // buffer being filled by the writer thread
+	uint64_t submitted;     // file offset of the current buffer
+	volatile bool failed;
+	volatile bool preallocate_failed;
+	io_request_t close_request;
+} io_sink_t;
+
+typedef struct io_device {
+	struct io_device *next;
+	uint64_t id;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	io_sink_t *sinks;
+	io_sink_t *cursor;      // the sink served next
+	bool stopping;
+} io_device_t;
+
+static struct {
+	bool initialized;
+	pthread_mutex_t lock;   // budget, buffer pool and the device list
+	pthread_cond_t released;
+	size_t max_in_flight;
+	size_t in_flight;
+	io_request_t *pool;
+	size_t pool_count;
+	io_device_t *devices;
+} service;
+
+/* buffers and budget */
+
+static io_request_t *acquire_buffer(void)
+{
+	pthread_mutex_lock(&service.lock);
+	io_request_t *request = service.pool;
+	if (request) {
+		service.pool = request->next;
+		service.pool_count--;
+	}
+	pthread_mutex_unlock(&service.lock);
+
+	if (!request) {
+		request = bmalloc(sizeof(io_request_t) + IO_BUFFER_SIZE);
+		request->data = (uint8_t *)(request + 1);
+	}
+	request->next = NULL;
+	request->type = IO_WRITE;
+	request->size = 0;
+	return request;
+}
+
+static void release_buffer(io_request_t *request)
+{
+	pthread_mutex_lock(&service.lock);
+	if (service.pool_count < service.max_in_flight / IO_BUFFER_SIZE) {
+		request->next = service.pool;
+		service.pool = request;
+		service.pool_count++;
+		request = NULL;
+	}
+	pthread_mutex_unlock(&service.lock);
+
+	if (request) bfree(request);
+}
+
+/* waits while the queued bytes would exceed the budget, a lone request always passes */
+static void reserve_budget(size_t size)
+{
+	pthread_mutex_lock(&service.lock);
+	while (service.in_flight > 0 && service.in_flight + size > service.max_in_flight) {
+		pthread_cond_wait(&service.released, &service.lock);
+	}
+	service.in_flight += size;
+	pthread_mutex_unlock(&service.lock);
+}
+
+static void release_budget(size_t size)
+{
+	pthread_mutex_lock(&service.lock);
+	service.in_flight -= size;
+	pthread_cond_broadcast(&service.released);
+	pthread_mutex_unlock(&service.lock);
+}
+
+/* device threads */
+
+static io_sink_t *next_sink_with_work(io_device_t *device)
+{
+	io_sink_t *sink = device->cursor ? device->cursor : device->sinks;
+	for (io_sink_t *start = sink; sink; ) {
+		if (sink->head) return sink;
+		sink = sink->next ? sink->next : device->sinks;
+		if (sink == start) break;
+	}
+	return NULL;
+}
+
+/* takes up to IO_QUANTUM bytes of the sink queue, a sync or close ends the batch */
+static io_request_t *take_batch(io_sink_t *sink)
+{
+	io_request_t *first = sink->head;
+	io_request_t *last = first;
+	size_t bytes = first->size;
+
+	while (last->next && last->type != IO_SYNC && last->type != IO_CLOSE && bytes + last->next->size <= IO_QUANTUM) {
+		last = last->next;
+		bytes += last->size;
+	}
+
+	sink->head = last->next;
+	if (!sink->head) sink->tail = NULL;
+	last->next = NULL;
+	return first;
+}
+
+static void run_request(io_sink_t *sink, io_request_t *request)
+{
+	switch (request->type) {
+	case IO_WRITE:
+		if (!sink->failed && file_output.write(sink->file, request->data, request->size) != request->size) {
+			IO_LOG(LOG_ERROR, "failed to write the file, the rest of the recording is lost");
+			os_atomic_set_bool(&sink->failed, true);
+		}
+		break;
+	case IO_WRITE_AT:
+		if (!sink->failed) file_output.write_at(sink->file, request->offset, request->data, request->size);
+		break;
+	case IO_PREALLOCATE:
+		if (!file_output.preallocate(sink->file, request->offset, request->length))
+			os_atomic_set_bool(&sink->preallocate_failed, true);
+		break;
+	case IO_TRIM:
+		file_output.trim(sink->file, request->offset, request->length);
+		break;
+	case IO_SYNC:
+		file_output.sync(sink->file);
+		break;
+	case IO_CLOSE:
+		file_output.close(sink->file);
+		break;
+	}
+}
+
+static void remove_sink(io_device_t *device, io_sink_t *sink)
+{
+	io_sink_t **link = &device->sinks;
+	while (*link != sink) link = &(*link)->next;
+	*link = sink->next;
+
+	if (device->cursor == sink) device->cursor = sink->next;
+}
+
+static void *io_device_thread(void *param)
+{
+	io_device_t *device = param;
+
+	os_set_thread_name("audio-writer-filter: io");
+	writer_trace_thread_name("audio-writer-filter: io");
+
+	pthread_mutex_lock(&device->lock);
+	for (;;) {
+		io_sink_t *sink = next_sink_with_work(device);
+		if (!sink) {
+			if (device->stopping) break;
+			pthread_cond_wait(&device->work, &device->lock);
+			continue;
+		}
+
+		io_request_t *batch = take_batch(sink);
+		device->cursor = sink->next;
+		pthread_mutex_unlock(&device->lock);
+
+		const uint64_t trace = writer_trace_begin();
+		for (io_request_t *request = batch; request; request = request->next) run_request(sink, request);
+		writer_trace_end("io batch", trace);
+
+		// a sync or close ends the batch, the sync request lives on the waiting stack
+		io_request_t *sync = NULL;
+		bool closed = false;
+		while (batch) {
+			io_request_t *request = batch;
+			batch = batch->next;
+
+			switch (request->type) {
+			case IO_WRITE:
+				release_budget(request->size);
+				release_buffer(request);
+				break;
+			case IO_WRITE_AT:
+				release_budget(request->size);
+				bfree(request);
+				break;
+			case IO_PREALLOCATE:
+			case IO_TRIM:
+				bfree(request);
+				break;
+			case IO_SYNC:
+				sync = request;
+				break;
+			case IO_CLOSE:
+				closed = true;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&device->lock);
+		if (sync) {
+			sync->done = true;
+			pthread_cond_broadcast(&device->done);
+		}
+		if (closed) {
+			remove_sink(device, sink);
+			bfree(sink);
+		}
+	}
+	pthread_mutex_unlock(&device->lock);
+
+	return NULL;
+}
+
+/* the thread of the device holding the path, started on the first file there */
+static io_device_t *get_device(const char *path)
+{
+	struct stat st;
+	const uint64_t id = os_stat(path, &st) == 0 ? (uint64_t)st.st_dev : 0;
+
+	pthread_mutex_lock(&service.lock);
+	io_device_t *device = service.devices;
+	while (device && device->id != id) device = device->next;
+
+	if (!device) {
+		device = bzalloc(sizeof(io_device_t));
+		device->id = id;
+		pthread_mutex_init(&device->lock, NULL);
+		pthread_cond_init(&device->work, NULL);
+		pthread_cond_init(&device->done, NULL);
+		if (pthread_create(&device->thread, NULL, io_device_thread, device) == 0) {
+			device->next = service.devices;
+			service.devices = device;
+		}
+		else {
+			IO_LOG(LOG_ERROR, "failed to start the I/O thread");
+			pthread_cond_destroy(&device->done);
+			pthread_cond_destroy(&device->work);
+			pthread_mutex_destroy(&device->lock);
+			bfree(device);
+			device = NULL;
+		}
+	}
+	pthread_mutex_unlock(&service.lock);
+
+	return device;
+}
+
+static void enqueue(io_sink_t *sink, io_request_t *request)
+{
+	io_device_t *device = sink->device;
+
+	request->next = NULL;
+	pthread_mutex_lock(&device->lock);
+	if (sink->tail) sink->tail->next = request;
+	else sink->head = request;
+	sink->tail = request;
+	pthread_cond_signal(&device->work);
+	pthread_mutex_unlock(&device->lock);
+}
+
+static void submit_current(io_sink_t *sink)
+{
+	io_request_t *request = sink->current;
+	if (!request || request->size == 0) return;
+
+	reserve_budget(request->size);
+	sink->submitted += request->size;
+	sink->current = NULL;
+	enqueue(sink, request);
+}
+
+static io_request_t *new_request(enum io_request_type type, size_t size)
+{
+	io_request_t *request = bzalloc(sizeof(io_request_t) + size);
+	request->type = type;
+	request->size = size;
+	request->data = (uint8_t *)(request + 1);
+	return request;
+}
+
+/* the output backend, called on the writer threads */
+
+static void *shared_output_open(const char *path)
+{
+	if (!service.initialized) {
+		IO_LOG(LOG_ERROR, "the I/O service is not running");
+		return NULL;
+	}
+
+	void *file = file_output.open(path);
+	if (!file) return NULL;
+
+	io_device_t *device = get_device(path);
+	if (!device) {
+		file_output.close(file);
+		return NULL;
+	}
+
+	io_sink_t *sink = bzalloc(sizeof(io_sink_t));
+	sink->device = device;
+	sink->file = file;
+	sink->close_request.type = IO_CLOSE;
+
+	pthread_mutex_lock(&device->lock);
+	sink->next = device->sinks;
+	device->sinks = sink;
+	pthread_mutex_unlock(&device->lock);
+
+	return sink;
+}
+
+static size_t shared_output_write(void *data, const void *buffer, size_t size)
+{
+	io_sink_t *sink = data;
+	const uint8_t *bytes = buffer;
+	size_t left = size;
+
+	if (os_atomic_load_bool(&sink->failed)) return 0;
+
+	while (left > 0) {
+		if (!sink->current) sink->current = acquire_buffer();
+
+		size_t chunk = IO_BUFFER_SIZE - sink->current->size;
+		if (chunk > left) chunk = left;
+
+		memcpy(sink->current->data + sink->current->size, bytes, chunk);
+		sink->current->size += chunk;
+		bytes += chunk;
+		left -= chunk;
+
+		if (sink->current->size == IO_BUFFER_SIZE) submit_current(sink);
+	}
+
+	return size;
+}
+
+/* patches the buffer being filled in place, anything older is queued behind the writes */
+static bool shared_output_write_at(void *data, uint64_t offset, const void *buffer, size_t size)
+{
+	io_sink_t *sink = data;
+
+	if (sink->current && offset >= sink->submitted && offset + size <= sink->submitted + sink->current->size) {
+		memcpy(sink->current->data + (offset - sink->submitted), buffer, size);
+		return true;
+	}
+
+	submit_current(sink);
+
+	io_request_t *request = new_request(IO_WRITE_AT, size);
+	request->offset = offset;
+	memcpy(request->data, buffer, size);
+	reserve_budget(size);
+	enqueue(sink, request);
+
+	return !os_atomic_load_bool(&sink->failed);
+}
+
+/* waits until everything queued so far is on the disk */
+static void shared_output_sync(void *data)
+{
+	io_sink_t *sink = data;
+	io_device_t *device = sink->device;
+
+	submit_current(sink);
+
+	io_request_t request = { 0 };
+	request.type = IO_SYNC;
+	enqueue(sink, &request);
+
+	pthread_mutex_lock(&device->lock);
+	while (!request.done) pthread_cond_wait(&device->done, &device->lock);
+	pthread_mutex_unlock(&device->lock);
+}
+
+/* the device thread learns of a failure later, the next extent is refused then */
+static bool shared_output_preallocate(void *data, uint64_t offset, uint64_t length)
+{
+	io_sink_t *sink = data;
+	if (os_atomic_load_bool(&sink->preallocate_failed)) return false;
+
+	io_request_t *request = new_request(IO_PREALLOCATE, 0);
+	request->offset = offset;
+	request->length = length;
+	enqueue(sink, request);
+	return true;
+}
+
+static void shared_output_trim(void *data, uint64_t size, uint64_t allocated)
+{
+	io_sink_t *sink = data;
+
+	submit_current(sink);
+
+	io_request_t *request = new_request(IO_TRIM, 0);
+	request->offset = size;
+	request->length = allocated;
+	enqueue(sink, request);
+}
+
+/* does not wait, the device thread closes the file and frees the sink */
+static void shared_output_close(void *data)
+{
+	io_sink_t *sink = data;
+
+	submit_current(sink);
+	if (sink->current) release_buffer(sink->current);
+	sink->current = NULL;
+
+	enqueue(sink, &sink->close_request);
+}
+
+output_t shared_output = {
+	"shared",
+	shared_output_open,
+	shared_output_write,
+	shared_output_write_at,
+	shared_output_sync,
+	shared_output_close,
+	shared_output_preallocate,
+	shared_output_trim,
+	NULL,
+};
+
+/* module lifetime */
+
+void io_service_init(size_t max_in_flight)
+{
+	if (service.initialized) return;
+
+	pthread_mutex_init(&service.lock, NULL);
+	pthread_cond_init(&service.released, NULL);
+	service.max_in_flight = max_in_flight;
+	service.initialized = true;
+}
+
+void io_service_free(void)
+{
+	if (!service.initialized) return;
+	service.initialized = false;
+
+	io_device_t *device = service.devices;
+	while (device) {
+		io_device_t *next = device->next;
+
+		pthread_mutex_lock(&device->lock);
+		device->stopping = true;
+		pthread_cond_signal(&device->work);
+		pthread_mutex_unlock(&device->lock);
+		pthread_join(device->thread, NULL);
+
+		if (device->sinks) IO_LOG(LOG_WARNING, "files left open on shutdown");
+		pthread_cond_destroy(&device->done);
+		pthread_cond_destroy(&device->work);
+		pthread_mutex_destroy(&device->lock);
+		bfree(device);
+
+		device = next;
+	}
+	service.devices = NULL;
+
+	while (service.pool) {
+		io_request_t *request = service.pool;
+		service.pool = request->next;
+		bfree(request);
+	}
+	service.pool_count = 0;
+
+	pthread_cond_destroy(&service.released);
+	pthread_mutex_destroy(&service.lock);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+/* process-wide I/O service behind the "shared" output backend */
+
+#define IO_SERVICE_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+/* starts the service, max_in_flight bounds the bytes queued for all devices */
+void io_service_init(size_t max_in_flight);
+
+/* writes out everything queued and stops the device threads */
+void io_service_free(void);
@@ -0,0 +1,153 @@
+#include <string.h>
+
+#include "lz4-block.h"
+
+/*
+* Greedy LZ4 compressor: a hash of the next 4 bytes finds the last position
+* with the same hash, a match is extended both ways and coded against it.
+* After 64 misses in a row the search skips ahead faster, so data that does
+* not compress costs little more than a copy.
+*/
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block ends with at least that many literals
+#define LZ4_MFLIMIT 12      // no match starts closer to the end
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t read_u32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash4(const uint8_t *p)
+{
+	return (read_u32(p) * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+static uint8_t *write_literals(uint8_t *op, uint8_t *token, const uint8_t *literals, size_t count)
+{
+	*token = (uint8_t)((count < 15 ? count : 15) << 4);
+	if (count >= 15) op = write_length(op, count - 15);
+	memcpy(op, literals, count);
+	return op + count;
+}
+
+size_t lz4_compress_block(const uint8_t *src, size_t size, uint8_t *dst, uint32_t *table)
+{
+	const uint8_t *const end = src + size;
+	const uint8_t *anchor = src;
+	uint8_t *op = dst;
+
+	if (size > LZ4_MFLIMIT) {
+		const uint8_t *const match_limit = end - LZ4_LAST_LITERALS;
+		const uint8_t *const input_limit = end - LZ4_MFLIMIT;
+
+		memset(table, 0, LZ4_TABLE_SIZE * sizeof(uint32_t));
+		const uint8_t *ip = src + 1;
+		unsigned misses = 1 << LZ4_SKIP_TRIGGER;
+
+		while (ip <= input_limit) {
+			const uint32_t h = hash4(ip);
+			const uint8_t *ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+
+			if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read_u32(ref) != read_u32(ip)) {
+				ip += misses++ >> LZ4_SKIP_TRIGGER;
+				continue;
+			}
+			misses = 1 << LZ4_SKIP_TRIGGER;
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+
+			const uint8_t *match_end = ip + LZ4_MIN_MATCH;
+			const uint8_t *match_ref = ref + LZ4_MIN_MATCH;
+			while (match_end < match_limit && *match_end == *match_ref) {
+				match_end++;
+				match_ref++;
+			}
+
+			uint8_t *token = op++;
+			op = write_literals(op, token, anchor, (size_t)(ip - anchor));
+
+			const uint16_t offset = (uint16_t)(ip - ref);
+			*op++ = (uint8_t)offset;
+			*op++ = (uint8_t)(offset >> 8);
+
+			const size_t match_length = (size_t)(match_end - ip) - LZ4_MIN_MATCH;
+			*token |= (uint8_t)(match_length < 15 ? match_length : 15);
+			if (match_length >= 15) op = write_length(op, match_length - 15);
+
+			ip = anchor = match_end;
+			if (ip - 2 > src && ip <= input_limit) table[hash4(ip - 2)] = (uint32_t)(ip - 2 - src);
+		}
+	}
+
+	uint8_t *token = op++;
+	op = write_literals(op, token, anchor, (size_t)(end - anchor));
+	return (size_t)(op - dst);
+}
+
+static bool read_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+	uint8_t byte;
+	do {
+		if (*ip >= end) return false;
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool lz4_decompress_block(const uint8_t *src, size_t compressed_size, uint8_t *dst, size_t size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *const end = src + compressed_size;
+	uint8_t *op = dst;
+	uint8_t *const out_end = dst + size;
+
+	while (ip < end) {
+		const uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15 && !read_length(&ip, end, &literals)) return false;
+		if (literals > (size_t)(end - ip) || literals > (size_t)(out_end - op)) return false;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		if (ip == end) break; // the last sequence has no match
+
+		if (end - ip < 2) return false;
+		const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) return false;
+
+		size_t match_length = token & 15;
+		if (match_length == 15 && !read_length(&ip, end, &match_length)) return false;
+		match_length += LZ4_MIN_MATCH;
+		if (match_length > (size_t)(out_end - op)) return false;
+
+		// byte by byte, the match may overlap the bytes it produces
+		const uint8_t *ref = op - offset;
+		for (size_t i = 0; i < match_length; i++) op[i] = ref[i];
+		op += match_length;
+	}
+
+	return op == out_end;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+* without the frame around it. The output can be read by any LZ4 decoder that
+* is given the decompressed size, e.g. LZ4_decompress_safe.
+*/
+
+#define LZ4_HASH_LOG 14
+#define LZ4_TABLE_SIZE ((size_t)1 << LZ4_HASH_LOG) // entries of the table lz4_compress_block needs
+
+/* the largest compressed size of size bytes */
+static inline size_t lz4_compress_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+/*
+* Compresses size bytes into dst of at least lz4_compress_bound(size) bytes
+* and returns the compressed size. The table is scratch space of
+* LZ4_TABLE_SIZE entries, it is not kept between the calls.
+*/
+size_t lz4_compress_block(const uint8_t *src, size_t size, uint8_t *dst, uint32_t *table);
+
+/* decompresses a block of exactly size bytes into dst, false when the block is damaged */
+bool lz4_decompress_block(const uint8_t *src, size_t compressed_size, uint8_t *dst, size_t size);
@@ -0,0 +1,305 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+#endif
+
+#include "audio-writer-filter.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+* Output that maps a sliding window of the file, so samples are converted
+* straight into the page cache through output_write_samples. A background
+* thread maps the next window ahead of the cursor and unmaps the filled one,
+* the writer thread only switches pointers. The first page stays mapped for
+* the header patches.
+* Windows are reserved with fallocate(FALLOC_FL_KEEP_SIZE) before they are
+* mapped, a full disk then fails the output instead of raising SIGBUS on a
+* store. The end of the file only follows the cursor in MMAP_GROW_SIZE steps
+* and is cut back to the logical size on every sync, so a crash leaves at
+* most one step of zeros after the data.
+*/
+
+#define MMAP_WINDOW_SIZE (8 * 1024 * 1024)
+#define MMAP_HEAD_SIZE 4096
+#define MMAP_GROW_SIZE (64 * 1024)
+
+#define MMAP_LOG(level, format, ...) blog(level, "[audio writer filter (mmap output)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	int fd;
+	uint8_t *head;          // first page, for header patches
+	uint8_t *window;        // window with the write cursor
+	uint64_t window_offset;
+	size_t fill;            // bytes written to the current window
+	uint64_t size;          // logical file size
+	uint64_t file_end;      // size of the file on disk, stores stay below it
+
+	pthread_t thread;
+	bool has_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *next;          // mapped ahead by the thread
+	uint8_t *retired;       // filled, waiting to be unmapped by the thread
+	bool stopping;
+	bool failed;
+} mmap_output_t;
+
+/* allocates the blocks of a window without moving the end of the file */
+static bool reserve_window(int fd, uint64_t offset)
+{
+#if defined(__APPLE__)
+	// the length counts from the physical end, reserving a bit more is trimmed on close
+	fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)(offset + MMAP_WINDOW_SIZE), 0 };
+	if (fcntl(fd, F_PREALLOCATE, &store) == 0) return true;
+	store.fst_flags = F_ALLOCATEALL;
+	return fcntl(fd, F_PREALLOCATE, &store) == 0;
+#elif defined(__linux__)
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, MMAP_WINDOW_SIZE) == 0) return true;
+	// without the reservation the blocks are allocated on the first store
+	return errno == EOPNOTSUPP;
+#else
+	UNUSED_PARAMETER(fd);
+	UNUSED_PARAMETER(offset);
+	return true;
+#endif
+}
+
+static uint8_t *map_window(int fd, uint64_t offset)
+{
+	if (!reserve_window(fd, offset)) {
+		MMAP_LOG(LOG_ERROR, "failed to allocate the file: %s", strerror(errno));
+		return NULL;
+	}
+
+	void *window = mmap(NULL, MMAP_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)offset);
+	if (window == MAP_FAILED) {
+		MMAP_LOG(LOG_ERROR, "failed to map the file: %s", strerror(errno));
+		return NULL;
+	}
+	return window;
+}
+
+static void unmap_window(uint8_t *window)
+{
+	msync(window, MMAP_WINDOW_SIZE, MS_ASYNC);
+	munmap(window, MMAP_WINDOW_SIZE);
+}
+
+static void *mmap_output_thread(void *param)
+{
+	mmap_output_t *output = param;
+
+	os_set_thread_name("audio-writer-filter: mmap");
+
+	pthread_mutex_lock(&output->lock);
+	while (!output->stopping) {
+		if (output->retired) {
+			uint8_t *retired = output->retired;
+			pthread_mutex_unlock(&output->lock);
+			unmap_window(retired);
+			pthread_mutex_lock(&output->lock);
+			output->retired = NULL;
+			pthread_cond_broadcast(&output->cond);
+		}
+		else if (!output->next && !output->failed) {
+			const uint64_t offset = output->window_offset + MMAP_WINDOW_SIZE;
+			pthread_mutex_unlock(&output->lock);
+			uint8_t *next = map_window(output->fd, offset);
+			pthread_mutex_lock(&output->lock);
+			output->next = next;
+			output->failed = !next;
+			pthread_cond_broadcast(&output->cond);
+		}
+		else {
+			pthread_cond_wait(&output->cond, &output->lock);
+		}
+	}
+	pthread_mutex_unlock(&output->lock);
+
+	return NULL;
+}
+
+/* moves the end of the file past the bytes about to be stored */
+static bool grow_file(mmap_output_t *output, uint64_t end)
+{
+	if (end <= output->file_end) return true;
+
+	end = (end + MMAP_GROW_SIZE - 1) / MMAP_GROW_SIZE * MMAP_GROW_SIZE;
+	if (ftruncate(output->fd, (off_t)end) != 0) {
+		MMAP_LOG(LOG_ERROR, "failed to extend the file: %s", strerror(errno));
+		return false;
+	}
+	output->file_end = end;
+	return true;
+}
+
+/* swaps in the window mapped ahead, waits only when the thread fell behind */
+static bool advance_window(mmap_output_t *output)
+{
+	pthread_mutex_lock(&output->lock);
+	while (!output->failed && (output->retired || !output->next)) {
+		pthread_cond_wait(&output->cond, &output->lock);
+	}
+	if (!output->failed) {
+		output->retired = output->window;
+		output->window = output->next;
+		output->window_offset += MMAP_WINDOW_SIZE;
+		output->fill = 0;
+		output->next = NULL;
+		pthread_cond_broadcast(&output->cond);
+	}
+	bool success = !output->failed;
+	pthread_mutex_unlock(&output->lock);
+
+	return success;
+}
+
+static void *mmap_output_open(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return NULL;
+
+	uint8_t *window = map_window(fd, 0);
+	uint8_t *head = window ? mmap(NULL, MMAP_HEAD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (head == MAP_FAILED) {
+		if (window) munmap(window, MMAP_WINDOW_SIZE);
+		close(fd);
+		return NULL;
+	}
+
+	mmap_output_t *output = bzalloc(sizeof(mmap_output_t));
+	output->fd = fd;
+	output->head = head;
+	output->window = window;
+
+	pthread_mutex_init(&output->lock, NULL);
+	pthread_cond_init(&output->cond, NULL);
+	output->has_thread = pthread_create(&output->thread, NULL, mmap_output_thread, output) == 0;
+	if (!output->has_thread) {
+		// the first window is still written, the output fails when it is full
+		MMAP_LOG(LOG_ERROR, "failed to start the mapping thread");
+		output->failed = true;
+	}
+
+	return output;
+}
+
+static size_t mmap_output_write(void *sink, const void *buffer, size_t size)
+{
+	mmap_output_t *output = sink;
+	const uint8_t *data = buffer;
+	size_t left = size;
+
+	while (left > 0) {
+		if (output->fill == MMAP_WINDOW_SIZE && !advance_window(output)) return size - left;
+
+		size_t chunk = MMAP_WINDOW_SIZE - output->fill;
+		if (chunk > left) chunk = left;
+		if (!grow_file(output, output->window_offset + output->fill + chunk)) return size - left;
+
+		memcpy(output->window + output->fill, data, chunk);
+		output->fill += chunk;
+		output->size += chunk;
+		data += chunk;
+		left -= chunk;
+	}
+
+	return size;
+}
+
+/* the bytes at the cursor, when they fit in the current window */
+static void *mmap_output_map(void *sink, size_t size)
+{
+	mmap_output_t *output = sink;
+
+	if (output->fill == MMAP_WINDOW_SIZE && !advance_window(output)) return NULL;
+	if (output->fill + size > MMAP_WINDOW_SIZE) return NULL;
+	if (!grow_file(output, output->window_offset + output->fill + size)) return NULL;
+
+	void *pointer = output->window + output->fill;
+	output->fill += size;
+	output->size += size;
+	return pointer;
+}
+
+static bool mmap_output_write_at(void *sink, uint64_t offset, const void *buffer, size_t size)
+{
+	mmap_output_t *output = sink;
+
+	if (offset + size <= MMAP_HEAD_SIZE && offset + size <= output->file_end) {
+		memcpy(output->head + offset, buffer, size);
+		return true;
+	}
+	if (offset >= output->window_offset && offset + size <= output->window_offset + output->fill) {
+		memcpy(output->window + (offset - output->window_offset), buffer, size);
+		return true;
+	}
+	return pwrite(output->fd, buffer, size, (off_t)offset) == (ssize_t)size;
+}
+
+static void mmap_output_sync(void *sink)
+{
+	mmap_output_t *output = sink;
+
+	msync(output->head, MMAP_HEAD_SIZE, MS_SYNC);
+	msync(output->window, MMAP_WINDOW_SIZE, MS_SYNC);
+	// the zeros past the cursor are not audio, the next store grows the file again
+	if (output->file_end > output->size) {
+		if (ftruncate(output->fd, (off_t)output->size) == 0)
+			output->file_end = output->size;
+		else
+			MMAP_LOG(LOG_WARNING, "failed to trim the file: %s", strerror(errno));
+	}
+#ifdef __APPLE__
+	fsync(output->fd);
+#else
+	fdatasync(output->fd);
+#endif
+}
+
+static void mmap_output_close(void *sink)
+{
+	mmap_output_t *output = sink;
+
+	pthread_mutex_lock(&output->lock);
+	output->stopping = true;
+	pthread_cond_broadcast(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+	if (output->has_thread) pthread_join(output->thread, NULL);
+
+	if (output->retired) unmap_window(output->retired);
+	if (output->next) munmap(output->next, MMAP_WINDOW_SIZE);
+	unmap_window(output->window);
+	msync(output->head, MMAP_HEAD_SIZE, MS_ASYNC);
+	munmap(output->head, MMAP_HEAD_SIZE);
+
+	// releases the blocks reserved past the end of the data
+	if (ftruncate(output->fd, (off_t)output->size) != 0)
+		MMAP_LOG(LOG_WARNING, "failed to trim the file: %s", strerror(errno));
+	close(output->fd);
+
+	pthread_cond_destroy(&output->cond);
+	pthread_mutex_destroy(&output->lock);
+	bfree(output);
+}
+
+output_t mmap_output = {
+	"mmap",
+	mmap_output_open,
+	mmap_output_write,
+	mmap_output_write_at,
+	mmap_output_sync,
+	mmap_output_close,
+	NULL,
+	NULL,
+	mmap_output_map,
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "audio-writer-filter.h"
+
+/*
+* Planar RAW output: every channel goes to a file of its own, "name.ch1.raw",
+* "name.ch2.raw" and so on, in the selected sample format. The first channel
+* is the file of the filter, so segments, preallocation and the mapped
+* output work as usual for it. The other files are opened next to it with
+* the first packet and closed with it.
+* A float plane is written straight from the writer queue without a copy,
+* other formats are converted one plane at a time.
+*/
+
+#define PLANAR_LOG(level, format, ...) blog(level, "[audio writer filter (planar)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	size_t channels;
+	output_t *output;
+	void *sinks[MAX_AV_PLANES];     // the first one is data->sink, not owned
+	uint64_t positions[MAX_AV_PLANES];
+	uint32_t dither[MAX_AV_PLANES][INTERLEAVE_MAX_CHANNELS]; // a whole kernel block of states per plane
+} planar_writer_t;
+
+static planar_writer_t *planar_writer_get(writer_data_t *data)
+{
+	if (data->planar) return data->planar;
+
+	planar_writer_t *planar = bzalloc(sizeof(planar_writer_t));
+	for (size_t p = 0; p < MAX_AV_PLANES; p++) {
+		for (size_t c = 0; c < INTERLEAVE_MAX_CHANNELS; c++) {
+			planar->dither[p][c] = 0x9E3779B9u * (uint32_t)(p * INTERLEAVE_MAX_CHANNELS + c + 1);
+		}
+	}
+
+	data->planar = planar;
+	return planar;
+}
+
+bool planar_writer_prepare(writer_data_t *data)
+{
+	return planar_writer_get(data) != NULL;
+}
+
+void planar_writer_free(writer_data_t *data)
+{
+	bfree(data->planar);
+	data->planar = NULL;
+}
+
+/* "name.ch1.raw" becomes "name.chN.raw" */
+static char *channel_filename(writer_data_t *data, size_t channel)
+{
+	const size_t stem = strlen(data->output_filename) - strlen(data->encoder->ext) + strlen("ch");
+
+	struct dstr filename = { 0 };
+	dstr_ncopy(&filename, data->output_filename, stem);
+	dstr_catf(&filename, "%zu.raw", channel + 1);
+	return filename.array;
+}
+
+/* has no sync, must be called inside locking mutex */
+static void open_channels(writer_data_t *data, planar_writer_t *planar)
+{
+	planar->channels = data->sample_info.speakers;
+	planar->output = data->output;
+	planar->sinks[0] = data->sink;
+
+	for (size_t c = 1; c < planar->channels; c++) {
+		char *filename = channel_filename(data, c);
+		planar->sinks[c] = planar->output->open(filename);
+		planar->positions[c] = 0;
+		if (!planar->sinks[c]) PLANAR_LOG(LOG_ERROR, "failed to open '%s', the channel is not written", filename);
+		bfree(filename);
+	}
+
+	data->file_has_header = true;
+}
+
+/* has no sync, must be called inside locking mutex */
+static void write_plane(writer_data_t *data, planar_writer_t *planar, size_t channel, uint8_t *plane, uint32_t frames)
+{
+	const size_t size = frames * output_sample_size(data);
+	const void *buffer = plane;
+
+	// NULL planes are silence and integer formats need converting, a float plane is written as is
+	if (!plane || data->sample_format != SAMPLE_FORMAT_FLOAT32) {
+		circlebuf_upsize(&data->interleaved_buffer, size);
+		buffer = circlebuf_data(&data->interleaved_buffer, 0);
+
+		const uint64_t trace = writer_trace_begin();
+		interleave_convert((void *)buffer, &plane, 1, frames, data->sample_format, data->dither ? planar->dither[channel] : NULL);
+		writer_trace_end("interleave", trace);
+	}
+
+	if (channel == 0) {
+		output_write(data, buffer, size);
+		return;
+	}
+
+	if (!planar->sinks[channel]) return;
+
+	const uint64_t trace = writer_trace_begin();
+	const uint64_t start = os_gettime_ns();
+	const size_t written = planar->output->write(planar->sinks[channel], buffer, size);
+	writer_stats_add_write(data->stats, os_gettime_ns() - start, written);
+	writer_trace_end("output write", trace);
+
+	planar->positions[channel] += written;
+}
+
+void write_planar_packet(writer_data_t *data, struct obs_audio_data *audio)
+{
+	if (!output_lock_open(data)) return;
+
+	planar_writer_t *planar = planar_writer_get(data);
+	if (!data->file_has_header) open_channels(data, planar);
+
+	for (size_t c = 0; c < planar->channels; c++) {
+		write_plane(data, planar, c, audio->data[c], audio->frames);
+	}
+
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+/* has no sync, must be called inside locking mutex, the file of the first channel is closed by the caller */
+void write_planar_finish(writer_data_t *data)
+{
+	planar_writer_t *planar = data->planar;
+	if (!planar || !data->file_has_header) return;
+
+	for (size_t c = 1; c < planar->channels; c++) {
+		if (planar->sinks[c]) output_release(planar->output, planar->sinks[c], planar->positions[c], UINT64_MAX);
+		planar->sinks[c] = NULL;
+	}
+	planar->sinks[0] = NULL;
+	planar->channels = 0;
+}
+
+/* has no sync, must be called inside locking mutex, the file of the first channel is synced by the caller */
+void write_planar_checkpoint(writer_data_t *data)
+{
+	planar_writer_t *planar = data->planar;
+	if (!planar || !planar->output->sync) return;
+
+	for (size_t c = 1; c < planar->channels; c++) {
+		if (planar->sinks[c]) planar->output->sync(planar->sinks[c]);
+	}
+}
@@ -0,0 +1,395 @@
+#define _USE_MATH_DEFINES // M_PI with MSVC
+#include <math.h>
+#include <string.h>
+
+#include "util/bmem.h"
+#include "resample.h"
+#include "cpu-features.h"
+
+/*
+* Polyphase resampler. The rates are reduced to up/down, the prototype
+* low-pass is a Kaiser windowed sinc at up times the input rate, and it is
+* split into up phases of taps coefficients each. An output frame picks the
+* phase of its position and is one dot product of that phase with the last
+* taps input frames, so no zero-stuffed signal is ever computed. The
+* coefficients of a phase are stored reversed to run along the input, which
+* lets the dot product kernel read both arrays forward.
+* The first output is placed half the filter length past the start, so
+* output n is centred on input frame n * down / up and the file is not
+* shifted. That holds back taps / 2 input frames, which resampler_flush
+* pushes out with silence, keeping exactly the outputs the input covers.
+*/
+
+#define RESAMPLE_TAPS 32          // per phase when not decimating, more for lower output rates
+#define RESAMPLE_MAX_TAPS 256
+#define RESAMPLE_CUTOFF 0.45      // of the lower rate, 0.5 would be its Nyquist frequency
+#define RESAMPLE_KAISER_BETA 8.0  // about 80 dB stopband
+
+typedef float (*dot_kernel_t)(const float *a, const float *b, size_t count);
+typedef void (*mix_kernel_t)(float *dst, const float *src, float gain, size_t count);
+
+typedef struct {
+	const char *name;
+	dot_kernel_t dot;   // count is a multiple of 8
+	mix_kernel_t mix;   // dst += src * gain
+} resample_kernels_t;
+
+struct resampler {
+	uint32_t up;
+	uint32_t down;
+	uint32_t taps;
+	float *coefficients;    // up phases of taps each
+	float *buffer;          // taps - 1 frames of history, then the new input
+	size_t buffered;
+	size_t capacity;
+	uint64_t position;      // of the next output, in upsampled frames from the buffer start
+	uint64_t input_frames;  // since the reset
+	uint64_t output_frames;
+};
+
+/* scalar kernels */
+
+static float dot_c(const float *a, const float *b, size_t count)
+{
+	float sum = 0.0f;
+	for (size_t i = 0; i < count; i++) sum += a[i] * b[i];
+	return sum;
+}
+
+static void mix_c(float *dst, const float *src, float gain, size_t count)
+{
+	for (size_t i = 0; i < count; i++) dst[i] += src[i] * gain;
+}
+
+#ifdef CPU_X86
+
+TARGET_SSE2 static float dot_sse2(const float *a, const float *b, size_t count)
+{
+	__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+	for (size_t i = 0; i < count; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+TARGET_SSE2 static void mix_sse2(float *dst, const float *src, float gain, size_t count)
+{
+	const __m128 g = _mm_set1_ps(gain);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+	}
+	mix_c(dst + i, src + i, gain, count - i);
+}
+
+TARGET_AVX2 static float dot_avx2(const float *a, const float *b, size_t count)
+{
+	__m256 sum = _mm256_setzero_ps();
+	for (size_t i = 0; i < count; i += 8) {
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	}
+
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+	float lanes[4];
+	_mm_storeu_ps(lanes, half);
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+TARGET_AVX2 static void mix_avx2(float *dst, const float *src, float gain, size_t count)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g)));
+	}
+	mix_c(dst + i, src + i, gain, count - i);
+}
+
+#endif
+
+static const resample_kernels_t kernels_c = { "C", dot_c, mix_c };
+
+#ifdef CPU_X86
+static const resample_kernels_t kernels_sse2 = { "SSE2", dot_sse2, mix_sse2 };
+static const resample_kernels_t kernels_avx2 = { "AVX2", dot_avx2, mix_avx2 };
+#endif
+
+static const resample_kernels_t *kernels = &kernels_c;
+
+void resample_init(void)
+{
+#ifdef CPU_X86
+	if (cpu_has_avx2()) kernels = &kernels_avx2;
+	else if (cpu_has_sse2()) kernels = &kernels_sse2;
+	else kernels = &kernels_c;
+#endif
+}
+
+const char *resample_kernel_name(void)
+{
+	return kernels->name;
+}
+
+/* filter design */
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		const uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		const double half = x / (2.0 * k);
+		term *= half * half;
+		sum += term;
+	}
+	return sum;
+}
+
+static void design_filter(resampler_t *resampler)
+{
+	const uint32_t up = resampler->up, taps = resampler->taps;
+	const size_t length = (size_t)up * taps;
+	const double ratio = (double)up / (double)resampler->down;
+	const double cutoff = RESAMPLE_CUTOFF * (ratio < 1.0 ? ratio : 1.0) / up; // cycles per upsampled frame
+	const double center = (double)(length - 1) / 2.0;
+	const double window_scale = 1.0 / bessel_i0(RESAMPLE_KAISER_BETA);
+
+	for (uint32_t phase = 0; phase < up; phase++) {
+		float *row = resampler->coefficients + (size_t)phase * taps;
+		double sum = 0.0;
+
+		for (uint32_t j = 0; j < taps; j++) {
+			const double x = (double)((size_t)j * up + phase) - center;
+			const double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+			const double r = 2.0 * x / (double)(length - 1);
+			const double window = bessel_i0(RESAMPLE_KAISER_BETA * sqrt(r < 1.0 ? 1.0 - r * r : 0.0)) * window_scale;
+
+			row[taps - 1 - j] = (float)(sinc * window);
+			sum += sinc * window;
+		}
+
+		// every phase passes DC at unity gain, a constant stays constant
+		const float gain = sum != 0.0 ? (float)(1.0 / sum) : 0.0f;
+		for (uint32_t j = 0; j < taps; j++) row[j] *= gain;
+	}
+}
+
+resampler_t *resampler_create(uint32_t in_rate, uint32_t out_rate)
+{
+	if (in_rate == 0 || out_rate == 0) return NULL;
+
+	const uint32_t divisor = gcd(in_rate, out_rate);
+	const uint32_t up = out_rate / divisor, down = in_rate / divisor;
+	if (up > RESAMPLE_MAX_PHASES) return NULL;
+
+	uint32_t taps = RESAMPLE_TAPS * ((down + up - 1) / up);
+	if (taps > RESAMPLE_MAX_TAPS) taps = RESAMPLE_MAX_TAPS;
+
+	resampler_t *resampler = bzalloc(sizeof(resampler_t));
+	resampler->up = up;
+	resampler->down = down;
+	resampler->taps = taps;
+	resampler->coefficients = bmalloc((size_t)up * taps * sizeof(float));
+	design_filter(resampler);
+
+	resampler->capacity = taps;
+	resampler->buffer = bmalloc(resampler->capacity * sizeof(float));
+	resampler_reset(resampler);
+
+	return resampler;
+}
+
+void resampler_reset(resampler_t *resampler)
+{
+	// starts from silence, the filter centre of the first output is on the first input frame
+	const uint32_t up = resampler->up, taps = resampler->taps;
+	memset(resampler->buffer, 0, resampler->capacity * sizeof(float));
+	resampler->buffered = taps - 1;
+	resampler->position = (uint64_t)(taps - 1) * up + ((uint64_t)up * taps - 1) / 2;
+	resampler->input_frames = 0;
+	resampler->output_frames = 0;
+}
+
+size_t resampler_delay(const resampler_t *resampler)
+{
+	return resampler->taps / 2;
+}
+
+void resampler_destroy(resampler_t *resampler)
+{
+	if (!resampler) return;
+
+	bfree(resampler->coefficients);
+	bfree(resampler->buffer);
+	bfree(resampler);
+}
+
+void resampler_reserve(resampler_t *resampler, size_t frames)
+{
+	// the filter history plus at most one output step of input is kept between calls
+	const size_t needed = resampler->taps + resampler->down / resampler->up + 1 + frames;
+	if (needed <= resampler->capacity) return;
+
+	resampler->capacity = needed;
+	resampler->buffer = brealloc(resampler->buffer, needed * sizeof(float));
+}
+
+size_t resampler_max_output(const resampler_t *resampler, size_t frames)
+{
+	return (size_t)((uint64_t)frames * resampler->up / resampler->down) + 2;
+}
+
+static size_t resample_block(resampler_t *resampler, const float *in, size_t frames, float *out)
+{
+	const size_t needed = resampler->buffered + frames;
+	if (needed > resampler->capacity) {
+		resampler->capacity = needed;
+		resampler->buffer = brealloc(resampler->buffer, needed * sizeof(float));
+	}
+
+	float *tail = resampler->buffer + resampler->buffered;
+	if (in) memcpy(tail, in, frames * sizeof(float));
+	else memset(tail, 0, frames * sizeof(float));
+	resampler->buffered = needed;
+
+	const uint32_t up = resampler->up, taps = resampler->taps;
+	size_t count = 0;
+	for (;;) {
+		const uint64_t last = resampler->position / up; // newest input frame under the filter
+		if (last >= resampler->buffered) break;
+
+		const uint32_t phase = (uint32_t)(resampler->position % up);
+		out[count++] = kernels->dot(resampler->coefficients + (size_t)phase * taps, resampler->buffer + last + 1 - taps, taps);
+		resampler->position += resampler->down;
+	}
+
+	// the history the next output needs moves to the front
+	size_t drop = (size_t)(resampler->position / up) + 1 - taps;
+	if (drop > resampler->buffered) drop = resampler->buffered;
+	memmove(resampler->buffer, resampler->buffer + drop, (resampler->buffered - drop) * sizeof(float));
+	resampler->buffered -= drop;
+	resampler->position -= (uint64_t)drop * up;
+
+	return count;
+}
+
+size_t resampler_process(resampler_t *resampler, const float *in, size_t frames, float *out)
+{
+	const size_t count = resample_block(resampler, in, frames, out);
+	resampler->input_frames += frames;
+	resampler->output_frames += count;
+	return count;
+}
+
+size_t resampler_flush(resampler_t *resampler, float *out)
+{
+	// the outputs up to the end of the input, the rest of the silence is not part of the file
+	const uint64_t total = (resampler->input_frames * resampler->up + resampler->down - 1) / resampler->down;
+	const uint64_t remaining = total > resampler->output_frames ? total - resampler->output_frames : 0;
+
+	size_t count = resample_block(resampler, NULL, resampler_delay(resampler), out);
+	if (count > remaining) count = (size_t)remaining;
+	resampler->output_frames += count;
+	return count;
+}
+
+/* downmix */
+
+#define MINUS_3DB 0.70710678f
+
+/* the OBS channel order of the layout with that many channels, left and right of stereo */
+static void stereo_row_gains(size_t in_channels, size_t channel, float *left, float *right)
+{
+	*left = *right = 0.0f;
+
+	switch (in_channels) {
+	case 1: // C
+		*left = *right = 1.0f;
+		return;
+	case 2: // L R
+	case 3: // L R LFE
+		if (channel == 0) *left = 1.0f;
+		if (channel == 1) *right = 1.0f;
+		return;
+	case 4: // L R C S
+	case 5: // L R C LFE S
+		if (channel == 0) *left = 1.0f;
+		else if (channel == 1) *right = 1.0f;
+		else if (channel == 2 || channel == in_channels - 1) *left = *right = MINUS_3DB;
+		return;
+	case 6: // L R C LFE SL SR
+	case 8: // L R C LFE RL RR SL SR
+		if (channel == 0) *left = 1.0f;
+		else if (channel == 1) *right = 1.0f;
+		else if (channel == 2) *left = *right = MINUS_3DB;
+		else if (channel >= 4 && channel % 2 == 0) *left = MINUS_3DB;
+		else if (channel >= 4) *right = MINUS_3DB;
+		return;
+	default: // no standard layout, even channels go left and odd ones right
+		if (channel % 2 == 0) *left = 1.0f;
+		else *right = 1.0f;
+		return;
+	}
+}
+
+static void normalize_row(float *row, size_t count)
+{
+	float sum = 0.0f;
+	for (size_t c = 0; c < count; c++) sum += row[c];
+	if (sum <= 0.0f) return;
+	for (size_t c = 0; c < count; c++) row[c] /= sum;
+}
+
+void resample_downmix_matrix(float *matrix, size_t in_channels, size_t out_channels)
+{
+	memset(matrix, 0, out_channels * in_channels * sizeof(float));
+
+	if (out_channels != 1 && out_channels != 2) {
+		// other layouts are passed through, missing channels are silent
+		for (size_t c = 0; c < out_channels && c < in_channels; c++) matrix[c * in_channels + c] = 1.0f;
+		return;
+	}
+
+	float *left = matrix, *right = out_channels == 2 ? matrix + in_channels : NULL;
+	for (size_t c = 0; c < in_channels; c++) {
+		float l, r;
+		stereo_row_gains(in_channels, c, &l, &r);
+		if (right) {
+			left[c] = l;
+			right[c] = r;
+		}
+		else {
+			left[c] = l + r;
+		}
+	}
+
+	normalize_row(left, in_channels);
+	if (right) normalize_row(right, in_channels);
+}
+
+void resample_downmix(float *const *dst, size_t out_channels, uint8_t *const *src, size_t in_channels, const float *matrix, size_t frames)
+{
+	for (size_t o = 0; o < out_channels; o++) {
+		const float *row = matrix + o * in_channels;
+		memset(dst[o], 0, frames * sizeof(float));
+
+		for (size_t c = 0; c < in_channels; c++) {
+			if (row[c] == 0.0f || !src[c]) continue;
+			kernels->mix(dst[o], (const float *)src[c], row[c], frames);
+		}
+	}
+}
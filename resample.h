@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* sample rate and channel conversion for the optional pre-encode stage */
+
+#define RESAMPLE_MAX_PHASES 1024 // output to input rate ratio reduced to at most this many phases
+
+typedef struct resampler resampler_t;
+
+/* picks the fastest kernels for the running CPU, call once before use */
+void resample_init(void);
+
+/* name of the instruction set the selected kernels use, for logging */
+const char *resample_kernel_name(void);
+
+/* one channel, NULL when the rates need more than RESAMPLE_MAX_PHASES phases */
+resampler_t *resampler_create(uint32_t in_rate, uint32_t out_rate);
+void resampler_destroy(resampler_t *resampler);
+
+/* forgets the input so far, the next frames start from silence as after resampler_create */
+void resampler_reset(resampler_t *resampler);
+
+/* input frames the output lags behind while streaming, resampler_flush pushes that much silence */
+size_t resampler_delay(const resampler_t *resampler);
+
+/* sizes the input buffer for blocks of up to frames, so processing them does not allocate */
+void resampler_reserve(resampler_t *resampler, size_t frames);
+
+/* upper bound of the frames resampler_process returns for frames of input */
+size_t resampler_max_output(const resampler_t *resampler, size_t frames);
+
+/*
+* Resamples the next frames of the channel into out and returns the number
+* of frames written. The filter state is carried from call to call, so the
+* output of consecutive blocks joins without a seam. NULL input is silence.
+*/
+size_t resampler_process(resampler_t *resampler, const float *in, size_t frames, float *out);
+
+/*
+* Writes the frames still held back into out, up to resampler_max_output of
+* resampler_delay frames, and returns their number. With them the output
+* has ceil(input frames * out rate / in rate) frames since the reset.
+*/
+size_t resampler_flush(resampler_t *resampler, float *out);
+
+/*
+* Downmix matrix of out_channels rows by in_channels columns for the OBS
+* speaker layout of in_channels. Centre and surround channels are mixed in
+* at -3 dB, LFE is dropped, every row is normalized to unity gain.
+*/
+void resample_downmix_matrix(float *matrix, size_t in_channels, size_t out_channels);
+
+/* dst[o] = sum of matrix[o][c] * src[c], NULL source planes are silence */
+void resample_downmix(float *const *dst, size_t out_channels, uint8_t *const *src, size_t in_channels, const float *matrix, size_t frames);
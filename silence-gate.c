@@ -0,0 +1,124 @@
+#include "audio-writer-filter.h"
+
+/*
+* Voice activated writing. Every block of up to GATE_BLOCK_FRAMES frames is
+* measured before it reaches the encoder: a peak above the threshold opens
+* the gate, an RMS level within GATE_HYSTERESIS of the threshold keeps it
+* open, and the gate closes after hold_frames of quieter audio. Blocks behind
+* a closed gate are not written at all.
+* The sidecar index next to the file lists the original start frame and the
+* length of every written segment, one line each, so the full timeline can be
+* rebuilt by inserting silence between the segments.
+*/
+
+#define GATE_BLOCK_FRAMES 1024
+#define GATE_HYSTERESIS 0.5f // -6 dB
+#define GATE_INDEX_EXT ".segments.txt"
+
+#define GATE_LOG(level, format, ...) blog(level, "[audio writer filter (silence gate)] " format, ##__VA_ARGS__)
+
+static void write_segment(silence_gate_t *gate)
+{
+	if (!gate->index) return;
+	fprintf(gate->index, "%llu %llu\n", (unsigned long long)gate->segment_start, (unsigned long long)(gate->position - gate->segment_start));
+}
+
+/* advances the gate over one block and tells whether the block is written */
+static bool gate_update(silence_gate_t *gate, float peak, float rms, uint32_t frames)
+{
+	const uint64_t end = gate->position + frames;
+
+	if (peak >= gate->open_level) {
+		if (!gate->open) {
+			gate->open = true;
+			gate->segment_start = gate->position;
+		}
+		gate->loud_end = end;
+	}
+	else if (gate->open && rms >= gate->open_level * GATE_HYSTERESIS) {
+		gate->loud_end = end;
+	}
+	else if (gate->open && gate->position >= gate->loud_end + gate->hold_frames) {
+		write_segment(gate);
+		gate->open = false;
+	}
+
+	return gate->open;
+}
+
+/* has no sync, must be called inside locking mutex */
+void silence_gate_open(writer_data_t *data)
+{
+	silence_gate_t *gate = &data->gate;
+	if (!gate->enabled || gate->index) return;
+
+	struct dstr path = { 0 };
+	dstr_printf(&path, "%s%s", data->output_filename, GATE_INDEX_EXT);
+	gate->index = os_fopen(path.array, "w");
+	if (gate->index) {
+		fprintf(gate->index, "# %u Hz, original start frame and length of every written segment\n", data->sample_info.samples_per_sec);
+	}
+	else {
+		GATE_LOG(LOG_WARNING, "failed to create '%s', the silence is written", path.array);
+		gate->enabled = false;
+	}
+	dstr_free(&path);
+}
+
+/* has no sync, must be called inside locking mutex */
+void silence_gate_close(writer_data_t *data)
+{
+	silence_gate_t *gate = &data->gate;
+
+	if (gate->open) write_segment(gate);
+	if (gate->index) fclose(gate->index);
+
+	gate->index = NULL;
+	gate->open = false;
+	gate->position = 0;
+	gate->serial++;
+}
+
+/* has no sync, must be called inside locking mutex */
+void silence_gate_flush(writer_data_t *data)
+{
+	if (data->gate.index) fflush(data->gate.index);
+}
+
+/* passes the blocks of a packet that are not silence to the encoder */
+void silence_gate_write(writer_data_t *data, struct obs_audio_data *audio)
+{
+	silence_gate_t *gate = &data->gate;
+	if (!gate->enabled) {
+		data->encoder->write_packet(data, audio);
+		return;
+	}
+
+	const size_t channels = data->sample_info.speakers;
+	for (uint32_t offset = 0; offset < audio->frames; ) {
+		struct obs_audio_data block = *audio;
+		block.frames = audio->frames - offset < GATE_BLOCK_FRAMES ? audio->frames - offset : GATE_BLOCK_FRAMES;
+		for (size_t c = 0; c < channels; c++) {
+			block.data[c] = audio->data[c] ? audio->data[c] + offset * sizeof(float) : NULL;
+		}
+
+		float peak, rms;
+		interleave_levels(block.data, channels, block.frames, &peak, &rms);
+		if (gate_update(gate, peak, rms, block.frames)) {
+			const uint32_t serial = gate->serial;
+			data->encoder->write_packet(data, &block);
+			if (gate->serial != serial) {
+				// the encoder rolled over to a new file, the block starts its first segment
+				gate->open = true;
+				gate->segment_start = 0;
+				gate->loud_end = block.frames;
+			}
+		}
+		else {
+			data->stats->gated_frames += block.frames;
+		}
+
+		gate->position += block.frames;
+		offset += block.frames;
+	}
+}
@@ -0,0 +1,300 @@
+/*
+* Extracts a time range of a chunked RAW file (internal-chunked encoder)
+* into a WAV file.
+*
+* The index at the end of the file gives the offset of the chunk that holds
+* the start, so only the chunks of the range are read and decompressed.
+* A file without the index, e.g. after a crash, is scanned chunk by chunk
+* up to the first incomplete one.
+*
+* usage: audio-writer-chunk-extract [-s seconds] [-d seconds] file.awc out.wav
+*   -s  start of the range, 0 by default
+*   -d  length of the range, up to the end by default
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chunk-format.h"
+#include "../lz4-block.h"
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define ID_AWCK FOURCC('A', 'W', 'C', 'K')
+#define ID_AWCI FOURCC('A', 'W', 'C', 'I')
+#define ID_AWCE FOURCC('A', 'W', 'C', 'E')
+
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+	chunk_file_header_t header;
+	uint64_t file_size;
+	uint64_t *offsets;
+	uint32_t count;
+	uint64_t total_frames;
+	size_t sample_size;
+	size_t frame_size;
+} chunk_file_t;
+
+static size_t sample_size_of(uint8_t format)
+{
+	switch (format) {
+	case CHUNK_FLOAT32: return 4;
+	case CHUNK_INT16: return 2;
+	case CHUNK_INT24: return 3;
+	case CHUNK_INT32: return 4;
+	default: return 0;
+	}
+}
+
+static bool read_at(FILE *file, uint64_t offset, void *buffer, size_t size)
+{
+	return fseek64(file, (int64_t)offset, SEEK_SET) == 0 && fread(buffer, 1, size, file) == size;
+}
+
+static bool add_offset(chunk_file_t *chunks, uint64_t offset)
+{
+	if ((chunks->count & 1023) == 0) {
+		uint64_t *offsets = realloc(chunks->offsets, (chunks->count + 1024) * sizeof(uint64_t));
+		if (!offsets) return false;
+		chunks->offsets = offsets;
+	}
+	chunks->offsets[chunks->count++] = offset;
+	return true;
+}
+
+static bool read_index(FILE *file, chunk_file_t *chunks)
+{
+	chunk_file_footer_t footer;
+	uint32_t head[2];
+
+	if (chunks->file_size < sizeof(chunk_file_header_t) + sizeof(footer)) return false;
+	if (!read_at(file, chunks->file_size - sizeof(footer), &footer, sizeof(footer)) || footer.magic != ID_AWCE) return false;
+	if (footer.index_offset < sizeof(chunk_file_header_t) || footer.index_offset + sizeof(head) > chunks->file_size) return false;
+	if (!read_at(file, footer.index_offset, head, sizeof(head)) || head[0] != ID_AWCI) return false;
+	if (footer.index_offset + sizeof(head) + ((uint64_t)head[1] + 1) * sizeof(uint64_t) > chunks->file_size) return false;
+
+	chunks->offsets = malloc(((size_t)head[1] + 1) * sizeof(uint64_t));
+	if (!chunks->offsets || fread(chunks->offsets, sizeof(uint64_t), head[1], file) != head[1]) return false;
+	if (fread(&chunks->total_frames, sizeof(uint64_t), 1, file) != 1) return false;
+	chunks->count = head[1];
+	return true;
+}
+
+/* without the index every chunk header is visited, the last chunk may be incomplete */
+static bool scan_chunks(FILE *file, chunk_file_t *chunks)
+{
+	free(chunks->offsets);
+	chunks->offsets = NULL;
+	chunks->count = 0;
+	chunks->total_frames = 0;
+
+	uint64_t offset = sizeof(chunk_file_header_t);
+	chunk_header_t chunk;
+	while (offset + sizeof(chunk) <= chunks->file_size && read_at(file, offset, &chunk, sizeof(chunk))) {
+		if (chunk.frames == 0 || chunk.frames > chunks->header.chunk_frames) break;
+		if (offset + sizeof(chunk) + chunk.stored_size > chunks->file_size) break;
+		if (!add_offset(chunks, offset)) return false;
+		chunks->total_frames += chunk.frames;
+		offset += sizeof(chunk) + chunk.stored_size;
+	}
+	return true;
+}
+
+static bool open_chunks(FILE *file, chunk_file_t *chunks, const char *path)
+{
+	memset(chunks, 0, sizeof(chunk_file_t));
+
+	if (fseek64(file, 0, SEEK_END) != 0) return false;
+	chunks->file_size = (uint64_t)ftell64(file);
+
+	chunk_file_header_t *header = &chunks->header;
+	if (!read_at(file, 0, header, sizeof(chunk_file_header_t)) || header->magic != ID_AWCK) return false;
+	if (header->version != CHUNK_FILE_VERSION || header->channels == 0 || header->chunk_frames == 0) return false;
+
+	chunks->sample_size = sample_size_of(header->sample_format);
+	chunks->frame_size = chunks->sample_size * header->channels;
+	if (chunks->sample_size == 0) return false;
+
+	if (!read_index(file, chunks)) {
+		fprintf(stderr, "%s: no index, the file was not finished, scanning the chunks\n", path);
+		return scan_chunks(file, chunks);
+	}
+	return true;
+}
+
+/* reverses the byte grouping of CHUNK_FLAG_SHUFFLE */
+static void unshuffle_bytes(uint8_t *dst, const uint8_t *src, size_t samples, size_t sample_size)
+{
+	for (size_t b = 0; b < sample_size; b++) {
+		const uint8_t *in = src + b * samples;
+		uint8_t *out = dst + b;
+		for (size_t i = 0; i < samples; i++, out += sample_size) *out = in[i];
+	}
+}
+
+/* reads the interleaved samples of a chunk into samples, returns its frames or 0 */
+static uint32_t read_chunk(FILE *file, const chunk_file_t *chunks, uint32_t number, uint8_t *stored, uint8_t *decoded, uint8_t *samples)
+{
+	chunk_header_t chunk;
+	if (!read_at(file, chunks->offsets[number], &chunk, sizeof(chunk))) return 0;
+	if (chunk.frames == 0 || chunk.frames > chunks->header.chunk_frames) return 0;
+
+	const size_t size = chunk.frames * chunks->frame_size;
+	if (chunk.stored_size > lz4_compress_bound(chunks->header.chunk_frames * chunks->frame_size)) return 0;
+	if (fread(stored, 1, chunk.stored_size, file) != chunk.stored_size) return 0;
+
+	if (chunk.method == CHUNK_LZ4) {
+		if (!lz4_decompress_block(stored, chunk.stored_size, decoded, size)) return 0;
+	}
+	else if (chunk.method == CHUNK_STORED && chunk.stored_size == size) {
+		memcpy(decoded, stored, size);
+	}
+	else {
+		return 0;
+	}
+
+	if (chunks->header.flags & CHUNK_FLAG_SHUFFLE) unshuffle_bytes(samples, decoded, size / chunks->sample_size, chunks->sample_size);
+	else memcpy(samples, decoded, size);
+	return chunk.frames;
+}
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+	p[0] = (uint8_t)value;
+	p[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	put_u16(p, (uint16_t)value);
+	put_u16(p + 2, (uint16_t)(value >> 16));
+}
+
+static bool write_wav_header(FILE *out, const chunk_file_t *chunks, uint64_t frames)
+{
+	const chunk_file_header_t *header = &chunks->header;
+	const uint32_t data_size = (uint32_t)(frames * chunks->frame_size);
+	uint8_t wav[WAV_HEADER_SIZE];
+
+	memcpy(wav, "RIFF", 4);
+	put_u32(wav + 4, WAV_HEADER_SIZE - 8 + data_size);
+	memcpy(wav + 8, "WAVEfmt ", 8);
+	put_u32(wav + 16, 16);
+	put_u16(wav + 20, header->sample_format == CHUNK_FLOAT32 ? 3 : 1);
+	put_u16(wav + 22, header->channels);
+	put_u32(wav + 24, header->sample_rate);
+	put_u32(wav + 28, header->sample_rate * (uint32_t)chunks->frame_size);
+	put_u16(wav + 32, (uint16_t)chunks->frame_size);
+	put_u16(wav + 34, (uint16_t)(8 * chunks->sample_size));
+	memcpy(wav + 36, "data", 4);
+	put_u32(wav + 40, data_size);
+
+	return fwrite(wav, 1, sizeof(wav), out) == sizeof(wav);
+}
+
+static bool extract(const char *path, const char *out_path, double start_seconds, double duration_seconds)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "%s: cannot open\n", path);
+		return false;
+	}
+
+	chunk_file_t chunks;
+	if (!open_chunks(file, &chunks, path)) {
+		fprintf(stderr, "%s: not a chunked file the filter wrote\n", path);
+		free(chunks.offsets);
+		fclose(file);
+		return false;
+	}
+
+	const uint32_t rate = chunks.header.sample_rate;
+	uint64_t first = (uint64_t)(start_seconds * rate);
+	if (first > chunks.total_frames) first = chunks.total_frames;
+	uint64_t frames = chunks.total_frames - first;
+	if (duration_seconds >= 0 && (uint64_t)(duration_seconds * rate) < frames) frames = (uint64_t)(duration_seconds * rate);
+
+	const uint64_t max_frames = (UINT32_MAX - WAV_HEADER_SIZE) / chunks.frame_size;
+	if (frames > max_frames) {
+		fprintf(stderr, "%s: the range is over 4 GiB, only the first %llu frames are extracted\n", path, (unsigned long long)max_frames);
+		frames = max_frames;
+	}
+
+	const size_t chunk_size = chunks.header.chunk_frames * chunks.frame_size;
+	uint8_t *stored = malloc(lz4_compress_bound(chunk_size));
+	uint8_t *decoded = malloc(chunk_size);
+	uint8_t *samples = malloc(chunk_size);
+	FILE *out = fopen(out_path, "wb");
+
+	bool success = stored && decoded && samples && out && write_wav_header(out, &chunks, frames);
+	if (!out) fprintf(stderr, "%s: cannot create\n", out_path);
+
+	// every chunk but the last has chunk_frames frames, the first one of the range is found directly
+	uint32_t number = (uint32_t)(first / chunks.header.chunk_frames);
+	uint64_t skip = first % chunks.header.chunk_frames;
+	uint64_t left = frames;
+	while (success && left > 0 && number < chunks.count) {
+		const uint32_t chunk_frames = read_chunk(file, &chunks, number++, stored, decoded, samples);
+		if (chunk_frames == 0) {
+			fprintf(stderr, "%s: chunk %u is damaged\n", path, number - 1);
+			success = false;
+			break;
+		}
+		if (skip >= chunk_frames) {
+			skip -= chunk_frames;
+			continue;
+		}
+
+		uint64_t count = chunk_frames - skip;
+		if (count > left) count = left;
+		success = fwrite(samples + skip * chunks.frame_size, chunks.frame_size, (size_t)count, out) == count;
+		left -= count;
+		skip = 0;
+	}
+
+	if (success) {
+		printf("%s: %u Hz, %u channels, %u chunks, %llu frames extracted from frame %llu\n", path, rate, chunks.header.channels,
+			chunks.count, (unsigned long long)(frames - left), (unsigned long long)first);
+	}
+
+	if (out) fclose(out);
+	free(stored);
+	free(decoded);
+	free(samples);
+	free(chunks.offsets);
+	fclose(file);
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	double start = 0;
+	double duration = -1;
+	const char *paths[2];
+	int files = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "-s") && i + 1 < argc) start = atof(argv[++i]);
+		else if (0 == strcmp(argv[i], "-d") && i + 1 < argc) duration = atof(argv[++i]);
+		else if (files < 2) paths[files++] = argv[i];
+		else files++;
+	}
+
+	if (files != 2 || start < 0) {
+		fprintf(stderr, "usage: %s [-s seconds] [-d seconds] file.awc out.wav\n", argv[0]);
+		return 2;
+	}
+	return extract(paths[0], paths[1], start, duration) ? 0 : 1;
+}
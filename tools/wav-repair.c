@@ -0,0 +1,184 @@
+/*
+* Repairs WAV files left with zero or stale sizes in the header, e.g. when
+* OBS crashed or was killed while the Audio Writer filter was writing.
+*
+* The data chunk is assumed to run to the end of the file. Its size is
+* rounded down to whole frames, the RIFF and data sizes are rewritten in
+* place, and files over 4 GiB are turned into RF64 when they have the
+* reserved JUNK/ds64 chunk the filter writes. Nothing else is changed.
+*
+* usage: audio-writer-wav-repair [-n] file.wav...
+*   -n  only report what would be changed
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define ID_RIFF FOURCC('R', 'I', 'F', 'F')
+#define ID_RF64 FOURCC('R', 'F', '6', '4')
+#define ID_WAVE FOURCC('W', 'A', 'V', 'E')
+#define ID_JUNK FOURCC('J', 'U', 'N', 'K')
+#define ID_DS64 FOURCC('d', 's', '6', '4')
+#define ID_FMT  FOURCC('f', 'm', 't', ' ')
+#define ID_DATA FOURCC('d', 'a', 't', 'a')
+
+#define DS64_SIZE 28
+
+typedef struct {
+	uint64_t file_size;
+	uint64_t ds64_offset; // 0 when there is no reserved chunk
+	uint64_t data_offset; // offset of the data chunk header
+	uint16_t block_align;
+} wav_layout_t;
+
+static bool read_u32(FILE *file, uint32_t *value)
+{
+	uint8_t b[4];
+	if (fread(b, 1, 4, file) != 4) return false;
+	*value = (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+	return true;
+}
+
+static bool write_u32_at(FILE *file, uint64_t offset, uint32_t value)
+{
+	uint8_t b[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+	return fseek64(file, (int64_t)offset, SEEK_SET) == 0 && fwrite(b, 1, 4, file) == 4;
+}
+
+static bool write_u64_at(FILE *file, uint64_t offset, uint64_t value)
+{
+	return write_u32_at(file, offset, (uint32_t)value) && write_u32_at(file, offset + 4, (uint32_t)(value >> 32));
+}
+
+static bool scan_layout(FILE *file, wav_layout_t *layout)
+{
+	uint32_t id, size, format;
+
+	memset(layout, 0, sizeof(wav_layout_t));
+
+	if (fseek64(file, 0, SEEK_END) != 0) return false;
+	layout->file_size = (uint64_t)ftell64(file);
+	if (fseek64(file, 0, SEEK_SET) != 0) return false;
+
+	if (!read_u32(file, &id) || !read_u32(file, &size) || !read_u32(file, &format)) return false;
+	if ((id != ID_RIFF && id != ID_RF64) || format != ID_WAVE) return false;
+
+	uint64_t offset = 12;
+	while (offset + 8 <= layout->file_size) {
+		if (fseek64(file, (int64_t)offset, SEEK_SET) != 0) return false;
+		if (!read_u32(file, &id) || !read_u32(file, &size)) return false;
+
+		if (id == ID_DATA) {
+			layout->data_offset = offset;
+			return layout->block_align != 0;
+		}
+		if ((id == ID_JUNK || id == ID_DS64) && offset == 12 && size >= DS64_SIZE) {
+			layout->ds64_offset = offset;
+		}
+		if (id == ID_FMT && size >= 16) {
+			uint32_t skip, rates;
+			uint8_t align[2];
+			if (!read_u32(file, &skip) || !read_u32(file, &rates) || !read_u32(file, &rates)) return false;
+			if (fread(align, 1, 2, file) != 2) return false;
+			layout->block_align = (uint16_t)(align[0] | (align[1] << 8));
+		}
+
+		offset += 8 + (uint64_t)size + (size & 1);
+	}
+
+	return false;
+}
+
+static bool repair(const char *path, bool dry_run)
+{
+	FILE *file = fopen(path, dry_run ? "rb" : "r+b");
+	if (!file) {
+		fprintf(stderr, "%s: cannot open\n", path);
+		return false;
+	}
+
+	wav_layout_t layout;
+	if (!scan_layout(file, &layout)) {
+		fprintf(stderr, "%s: not a WAV file the filter wrote, or no data chunk\n", path);
+		fclose(file);
+		return false;
+	}
+
+	const uint64_t data_start = layout.data_offset + 8;
+	uint64_t data_size = layout.file_size - data_start;
+	data_size -= data_size % layout.block_align;
+
+	bool rf64 = data_start - 8 + data_size > UINT32_MAX;
+	if (rf64 && !layout.ds64_offset) {
+		// no room for 64-bit sizes, keep as much as a RIFF file can address
+		data_size = UINT32_MAX - (data_start - 8);
+		data_size -= data_size % layout.block_align;
+		rf64 = false;
+		fprintf(stderr, "%s: over 4 GiB without a ds64 chunk, only the first %llu bytes of audio will be addressable\n",
+			path, (unsigned long long)data_size);
+	}
+
+	// the pad byte after an odd data chunk is a part of the RIFF size when the file has it
+	const bool has_pad = (data_size & 1) && layout.file_size > data_start + data_size;
+	const uint64_t pad = has_pad && (rf64 || data_start - 8 + data_size < UINT32_MAX) ? 1 : 0;
+	const uint64_t riff_size = data_start - 8 + data_size + pad;
+	printf("%s: %s, %llu bytes of audio (%llu frames)\n", path, rf64 ? "RF64" : "RIFF",
+		(unsigned long long)data_size, (unsigned long long)(data_size / layout.block_align));
+
+	bool success = true;
+	if (!dry_run) {
+		if (rf64) {
+			success = write_u32_at(file, 0, ID_RF64)
+				&& write_u32_at(file, 4, UINT32_MAX)
+				&& write_u32_at(file, layout.ds64_offset, ID_DS64)
+				&& write_u64_at(file, layout.ds64_offset + 8, riff_size)
+				&& write_u64_at(file, layout.ds64_offset + 16, data_size)
+				&& write_u64_at(file, layout.ds64_offset + 24, data_size / layout.block_align)
+				&& write_u32_at(file, layout.data_offset + 4, UINT32_MAX);
+		}
+		else {
+			success = write_u32_at(file, 0, ID_RIFF)
+				&& write_u32_at(file, 4, (uint32_t)riff_size)
+				&& (!layout.ds64_offset || write_u32_at(file, layout.ds64_offset, ID_JUNK))
+				&& write_u32_at(file, layout.data_offset + 4, (uint32_t)data_size);
+		}
+		if (!success) fprintf(stderr, "%s: write failed\n", path);
+	}
+
+	fclose(file);
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	bool dry_run = false;
+	int failures = 0;
+	int files = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "-n")) {
+			dry_run = true;
+			continue;
+		}
+		files++;
+		if (!repair(argv[i], dry_run)) failures++;
+	}
+
+	if (files == 0) {
+		fprintf(stderr, "usage: %s [-n] file.wav...\n", argv[0]);
+		return 2;
+	}
+	return failures ? 1 : 0;
+}
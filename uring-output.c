@@ -0,0 +1,443 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // O_DIRECT, fallocate
+#endif
+#endif
+
+#include "audio-writer-filter.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+* Linux output that coalesces packets into large page aligned blocks and
+* submits them through io_uring, with at most URING_BLOCKS - 1 blocks in
+* flight while the next one is being filled. When io_uring is not available
+* (old kernel, seccomp) the blocks are written with pwrite instead.
+* The O_DIRECT variant bypasses the page cache, partial blocks are then
+* padded to URING_ALIGNMENT and the file is trimmed on close.
+*/
+
+#define URING_BLOCK_SIZE (1024 * 1024)
+#define URING_BLOCKS 4
+#define URING_ALIGNMENT 4096
+
+#define URING_LOG(level, format, ...) blog(level, "[audio writer filter (io_uring output)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+} uring_t;
+
+typedef struct {
+	int fd;
+	bool direct;
+	bool failed;
+	bool trim;
+
+	uring_t uring;
+	bool has_uring;
+
+	uint8_t *memory;
+	uint8_t *bounce;
+	struct iovec iov[URING_BLOCKS];
+	uint64_t offsets[URING_BLOCKS];
+	bool in_flight[URING_BLOCKS];
+	uint32_t in_flight_count;
+
+	uint32_t current;      // block being filled
+	size_t fill;           // bytes in the current block
+	uint64_t block_offset; // file offset of the current block
+	uint64_t size;         // logical file size
+} uring_output_t;
+
+static bool uring_setup(uring_t *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return false;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) goto fail_sq;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) goto fail_cq;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto fail_sqes;
+
+	uint8_t *sq = ring->sq_ptr;
+	uint8_t *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return true;
+
+fail_sqes:
+	if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+fail_cq:
+	munmap(ring->sq_ptr, ring->sq_size);
+fail_sq:
+	close(ring->fd);
+	return false;
+}
+
+static void uring_teardown(uring_t *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+/* synchronous fallback, also finishes short writes */
+static bool write_fully(int fd, const uint8_t *buffer, size_t size, uint64_t offset)
+{
+	while (size > 0) {
+		ssize_t written = pwrite(fd, buffer, size, (off_t)offset);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return false;
+		buffer += written;
+		size -= (size_t)written;
+		offset += (uint64_t)written;
+	}
+	return true;
+}
+
+static void uring_complete(uring_output_t *output, struct io_uring_cqe *cqe)
+{
+	const uint32_t block = (uint32_t)cqe->user_data;
+	const struct iovec *iov = &output->iov[block];
+
+	if (cqe->res < 0) {
+		URING_LOG(LOG_ERROR, "write failed: %s", strerror(-cqe->res));
+		output->failed = true;
+	}
+	else if ((size_t)cqe->res < iov->iov_len) {
+		// rare, finish the rest synchronously; O_DIRECT takes aligned writes only, the whole block is written again
+		const size_t done = output->direct ? 0 : (size_t)cqe->res;
+		if (!write_fully(output->fd, (const uint8_t *)iov->iov_base + done, iov->iov_len - done, output->offsets[block] + done))
+			output->failed = true;
+	}
+
+	output->in_flight[block] = false;
+	output->in_flight_count--;
+}
+
+static void uring_reap(uring_output_t *output, bool wait)
+{
+	uring_t *ring = &output->uring;
+
+	if (wait && output->in_flight_count > 0) {
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	}
+
+	unsigned head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		uring_complete(output, &ring->cqes[head & *ring->cq_mask]);
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void wait_block(uring_output_t *output, uint32_t block)
+{
+	while (output->in_flight[block]) uring_reap(output, true);
+}
+
+static void wait_all(uring_output_t *output)
+{
+	while (output->in_flight_count > 0) uring_reap(output, true);
+}
+
+/* writes length bytes of a block at offset, asynchronously when possible */
+static void submit_block(uring_output_t *output, uint32_t block, size_t length, uint64_t offset)
+{
+	uint8_t *buffer = output->memory + (size_t)block * URING_BLOCK_SIZE;
+
+	if (!output->has_uring) {
+		if (!write_fully(output->fd, buffer, length, offset)) output->failed = true;
+		return;
+	}
+
+	uring_t *ring = &output->uring;
+	const unsigned tail = *ring->sq_tail;
+	const unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	output->iov[block].iov_base = buffer;
+	output->iov[block].iov_len = length;
+	output->offsets[block] = offset;
+	output->in_flight[block] = true;
+	output->in_flight_count++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = output->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&output->iov[block];
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = block;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+		// the entry was not consumed, take it back and write synchronously
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		output->in_flight[block] = false;
+		output->in_flight_count--;
+		if (!write_fully(output->fd, buffer, length, offset)) output->failed = true;
+	}
+}
+
+static size_t aligned_length(uring_output_t *output, size_t length)
+{
+	if (!output->direct) return length;
+	return (length + URING_ALIGNMENT - 1) & ~(size_t)(URING_ALIGNMENT - 1);
+}
+
+/* the current block is written as is, it keeps filling afterwards */
+static void flush_partial_block(uring_output_t *output)
+{
+	if (output->fill == 0) return;
+
+	uint8_t *buffer = output->memory + (size_t)output->current * URING_BLOCK_SIZE;
+	const size_t length = aligned_length(output, output->fill);
+	memset(buffer + output->fill, 0, length - output->fill);
+
+	if (!write_fully(output->fd, buffer, length, output->block_offset)) output->failed = true;
+}
+
+static bool uring_available = false;
+
+/* probes io_uring once, so the fallback is logged once instead of for every file */
+void uring_output_init(void)
+{
+	uring_t ring;
+	uring_available = uring_setup(&ring, URING_BLOCKS);
+	if (uring_available) uring_teardown(&ring);
+	else URING_LOG(LOG_INFO, "io_uring is not available, the uring outputs use pwrite");
+}
+
+static void *uring_output_open_with(const char *path, bool direct)
+{
+	// readable for the read-modify-write of header patches under O_DIRECT
+	int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (direct) flags |= O_DIRECT;
+
+	int fd = open(path, flags, 0644);
+	if (fd < 0 && direct) {
+		URING_LOG(LOG_WARNING, "O_DIRECT is not supported for '%s', using the page cache", path);
+		direct = false;
+		fd = open(path, flags & ~O_DIRECT, 0644);
+	}
+	if (fd < 0) return NULL;
+
+	uring_output_t *output = bzalloc(sizeof(uring_output_t));
+	output->fd = fd;
+	output->direct = direct;
+
+	// O_DIRECT needs aligned memory, bmalloc alignment is not enough
+	if (posix_memalign((void **)&output->memory, URING_ALIGNMENT, (size_t)URING_BLOCKS * URING_BLOCK_SIZE) != 0
+		|| posix_memalign((void **)&output->bounce, URING_ALIGNMENT, URING_ALIGNMENT) != 0) {
+		free(output->memory);
+		close(fd);
+		bfree(output);
+		return NULL;
+	}
+
+	output->has_uring = uring_available && uring_setup(&output->uring, URING_BLOCKS);
+
+	return output;
+}
+
+static void *uring_output_open(const char *path)
+{
+	return uring_output_open_with(path, false);
+}
+
+static void *uring_output_open_direct(const char *path)
+{
+	return uring_output_open_with(path, true);
+}
+
+static size_t uring_output_write(void *sink, const void *buffer, size_t size)
+{
+	uring_output_t *output = sink;
+	const uint8_t *data = buffer;
+	size_t left = size;
+
+	while (left > 0) {
+		size_t chunk = URING_BLOCK_SIZE - output->fill;
+		if (chunk > left) chunk = left;
+
+		memcpy(output->memory + (size_t)output->current * URING_BLOCK_SIZE + output->fill, data, chunk);
+		output->fill += chunk;
+		data += chunk;
+		left -= chunk;
+
+		if (output->fill == URING_BLOCK_SIZE) {
+			submit_block(output, output->current, URING_BLOCK_SIZE, output->block_offset);
+
+			output->current = (output->current + 1) % URING_BLOCKS;
+			output->block_offset += URING_BLOCK_SIZE;
+			output->fill = 0;
+			if (output->has_uring) {
+				uring_reap(output, false);
+				wait_block(output, output->current);
+			}
+		}
+	}
+
+	output->size += size;
+	return output->failed ? 0 : size;
+}
+
+/* header patches; patches inside the unsubmitted block are done in memory */
+static bool uring_output_write_at(void *sink, uint64_t offset, const void *buffer, size_t size)
+{
+	uring_output_t *output = sink;
+
+	if (offset >= output->block_offset && offset + size <= output->block_offset + output->fill) {
+		memcpy(output->memory + (size_t)output->current * URING_BLOCK_SIZE + (offset - output->block_offset), buffer, size);
+		return true;
+	}
+
+	if (output->has_uring) wait_all(output);
+
+	if (!output->direct) return write_fully(output->fd, buffer, size, offset);
+
+	// read-modify-write of the aligned sectors the patch covers
+	const uint8_t *data = buffer;
+	while (size > 0) {
+		const uint64_t sector = offset & ~(uint64_t)(URING_ALIGNMENT - 1);
+		size_t chunk = (size_t)(sector + URING_ALIGNMENT - offset);
+		if (chunk > size) chunk = size;
+
+		if (chunk < URING_ALIGNMENT) {
+			memset(output->bounce, 0, URING_ALIGNMENT);
+			if (pread(output->fd, output->bounce, URING_ALIGNMENT, (off_t)sector) < 0) return false;
+		}
+		memcpy(output->bounce + (offset - sector), data, chunk);
+		if (!write_fully(output->fd, output->bounce, URING_ALIGNMENT, sector)) return false;
+
+		offset += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+static void uring_output_sync(void *sink)
+{
+	uring_output_t *output = sink;
+
+	if (output->has_uring) wait_all(output);
+	flush_partial_block(output);
+	// the padding of the partial block is not audio, the next write or the close writes past it again
+	if (output->direct && output->fill > 0 && ftruncate(output->fd, (off_t)output->size) != 0)
+		URING_LOG(LOG_WARNING, "failed to trim the file: %s", strerror(errno));
+	fdatasync(output->fd);
+}
+
+static bool uring_output_preallocate(void *sink, uint64_t offset, uint64_t length)
+{
+	uring_output_t *output = sink;
+	return fallocate(output->fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0;
+}
+
+/* truncating to the current size releases the blocks past the end */
+static void uring_output_trim(void *sink, uint64_t size, uint64_t allocated)
+{
+	uring_output_t *output = sink;
+	UNUSED_PARAMETER(size);
+	UNUSED_PARAMETER(allocated);
+
+	// done by ftruncate on close, after the last block is written
+	output->trim = true;
+}
+
+static void uring_output_close(void *sink)
+{
+	uring_output_t *output = sink;
+
+	if (output->has_uring) wait_all(output);
+	flush_partial_block(output);
+
+	// drops the padding of the last block and the unused preallocation
+	if ((output->direct || output->trim) && ftruncate(output->fd, (off_t)output->size) != 0)
+		URING_LOG(LOG_WARNING, "failed to trim the file: %s", strerror(errno));
+
+	if (output->has_uring) uring_teardown(&output->uring);
+	close(output->fd);
+	free(output->memory);
+	free(output->bounce);
+	bfree(output);
+}
+
+output_t uring_output = {
+	"uring",
+	uring_output_open,
+	uring_output_write,
+	uring_output_write_at,
+	uring_output_sync,
+	uring_output_close,
+	uring_output_preallocate,
+	uring_output_trim,
+	NULL,
+};
+
+output_t uring_direct_output = {
+	"uring-direct",
+	uring_output_open_direct,
+	uring_output_write,
+	uring_output_write_at,
+	uring_output_sync,
+	uring_output_close,
+	uring_output_preallocate,
+	uring_output_trim,
+	NULL,
+};
+
+#endif
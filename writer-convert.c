@@ -0,0 +1,203 @@
+#include "audio-writer-filter.h"
+#include "resample.h"
+
+/*
+* Optional conversion stage in front of the encoders: the channels are
+* downmixed to the selected layout first, so fewer of them go through the
+* resampler, and then resampled to the selected rate. It runs on the writer
+* thread between the ring and the fan-out, sample_info then describes the
+* converted audio and every encoder, header and index follows it, while
+* source_info keeps describing the pushed packets.
+* A new format is applied between two blocks, the open files are closed and
+* the next block starts new ones.
+*/
+
+#define CONVERT_LOG(level, format, ...) blog(level, "[audio writer filter (convert)] " format, ##__VA_ARGS__)
+
+struct writer_convert {
+	size_t in_channels;
+	size_t out_channels;
+	bool mix;               // false when the channels are passed as they are
+	float matrix[MAX_AV_PLANES * MAX_AV_PLANES];
+	resampler_t *resamplers[MAX_AV_PLANES]; // one per output channel, NULL without resampling
+
+	float *mixed[MAX_AV_PLANES];
+	float *resampled[MAX_AV_PLANES];
+	size_t mixed_capacity;
+	size_t resampled_capacity;
+	bool primed;            // the resamplers hold input that is not flushed yet
+};
+
+static void convert_free(writer_convert_t *convert)
+{
+	if (!convert) return;
+
+	for (size_t c = 0; c < MAX_AV_PLANES; c++) {
+		resampler_destroy(convert->resamplers[c]);
+		bfree(convert->mixed[c]);
+		bfree(convert->resampled[c]);
+	}
+	bfree(convert);
+}
+
+static void reserve_planes(float **planes, size_t channels, size_t *capacity, size_t frames)
+{
+	if (frames <= *capacity) return;
+
+	for (size_t c = 0; c < channels; c++) planes[c] = brealloc(planes[c], frames * sizeof(float));
+	*capacity = frames;
+}
+
+/* the format the settings ask for, the source format where they leave it */
+static void wanted_format(writer_data_t *data, uint32_t *rate, size_t *channels)
+{
+	*rate = data->convert_rate ? data->convert_rate : data->source_info.samples_per_sec;
+	*channels = data->convert_channels ? data->convert_channels : data->source_info.speakers;
+}
+
+/*
+* Builds the stage for the wanted format and switches sample_info to it.
+* Called before the writer thread starts, or on it while no file is open.
+*/
+void writer_convert_apply(writer_data_t *data)
+{
+	uint32_t rate;
+	size_t channels;
+	wanted_format(data, &rate, &channels);
+	data->converted_rate = rate;
+	data->converted_channels = (uint32_t)channels;
+
+	convert_free(data->convert);
+	data->convert = NULL;
+
+	const uint32_t in_rate = data->source_info.samples_per_sec;
+	const size_t in_channels = data->source_info.speakers;
+
+	writer_convert_t *convert = NULL;
+	if (rate != in_rate || channels != in_channels) {
+		convert = bzalloc(sizeof(writer_convert_t));
+		convert->in_channels = in_channels;
+		convert->out_channels = channels;
+		convert->mix = channels != in_channels;
+		resample_downmix_matrix(convert->matrix, in_channels, channels);
+
+		for (size_t c = 0; rate != in_rate && c < channels; c++) {
+			convert->resamplers[c] = resampler_create(in_rate, rate);
+			if (!convert->resamplers[c]) {
+				CONVERT_LOG(LOG_WARNING, "cannot resample %u Hz to %u Hz, the source rate is kept", in_rate, rate);
+				for (size_t r = 0; r < c; r++) resampler_destroy(convert->resamplers[r]);
+				memset(convert->resamplers, 0, sizeof(convert->resamplers));
+				rate = in_rate;
+				break;
+			}
+		}
+
+		if (!convert->mix && !convert->resamplers[0]) {
+			convert_free(convert);
+			convert = NULL;
+		}
+		else {
+			// sized for the largest block, the writer thread does not allocate while converting
+			if (convert->mix) reserve_planes(convert->mixed, channels, &convert->mixed_capacity, WRITER_BLOCK_FRAMES);
+			for (size_t c = 0; c < channels && convert->resamplers[c]; c++) resampler_reserve(convert->resamplers[c], WRITER_BLOCK_FRAMES);
+			if (convert->resamplers[0]) reserve_planes(convert->resampled, channels, &convert->resampled_capacity, resampler_max_output(convert->resamplers[0], WRITER_BLOCK_FRAMES));
+		}
+	}
+
+	data->convert = convert;
+	data->sample_info.samples_per_sec = rate;
+	data->sample_info.speakers = (enum speaker_layout)channels;
+	writer_fanout_format(data);
+
+	if (convert) CONVERT_LOG(LOG_INFO, "writing %zu channels at %u Hz, the source has %zu at %u Hz", channels, rate, in_channels, in_rate);
+}
+
+/* closes the file and frees the encoder state, both follow the format */
+static void reset_file(writer_data_t *writer)
+{
+	close_output(writer);
+
+	pthread_mutex_lock(&writer->output_lock);
+	for (size_t i = 0; i < encoders_count; i++) {
+		if (encoders[i].release) encoders[i].release(writer);
+	}
+	pthread_mutex_unlock(&writer->output_lock);
+}
+
+/* on the writer thread, applies changed settings between two blocks, a rate that failed is not retried */
+void writer_convert_update(writer_data_t *data)
+{
+	uint32_t rate;
+	size_t channels;
+	wanted_format(data, &rate, &channels);
+	if (rate == data->converted_rate && channels == data->converted_channels) return;
+
+	reset_file(data);
+	writer_fanout_each(data, reset_file);
+	writer_convert_apply(data);
+}
+
+/* converts a block taken from the ring in place, false when it gives no frames yet */
+bool writer_convert_block(writer_data_t *data, struct obs_audio_data *audio)
+{
+	writer_convert_t *convert = data->convert;
+	if (!convert) return true;
+
+	const uint64_t trace = writer_trace_begin();
+	uint8_t *planes[MAX_AV_PLANES] = { 0 };
+	for (size_t c = 0; c < convert->in_channels; c++) planes[c] = audio->data[c];
+
+	if (convert->mix) {
+		reserve_planes(convert->mixed, convert->out_channels, &convert->mixed_capacity, audio->frames);
+		resample_downmix(convert->mixed, convert->out_channels, planes, convert->in_channels, convert->matrix, audio->frames);
+		for (size_t c = 0; c < convert->out_channels; c++) planes[c] = (uint8_t *)convert->mixed[c];
+	}
+
+	uint32_t frames = audio->frames;
+	if (convert->resamplers[0]) {
+		reserve_planes(convert->resampled, convert->out_channels, &convert->resampled_capacity, resampler_max_output(convert->resamplers[0], audio->frames));
+		for (size_t c = 0; c < convert->out_channels; c++) {
+			frames = (uint32_t)resampler_process(convert->resamplers[c], (const float *)planes[c], audio->frames, convert->resampled[c]);
+			planes[c] = (uint8_t *)convert->resampled[c];
+		}
+	}
+
+	for (size_t c = 0; c < MAX_AV_PLANES; c++) audio->data[c] = c < convert->out_channels ? planes[c] : NULL;
+	audio->frames = frames;
+	convert->primed = convert->resamplers[0] != NULL;
+	writer_trace_end("convert", trace);
+
+	return frames > 0;
+}
+
+/*
+* On the writer thread before a recording is closed: the frames still in the
+* resamplers go to the open files, and the next recording starts from
+* silence instead of the end of this one.
+*/
+void writer_convert_flush(writer_data_t *data)
+{
+	writer_convert_t *convert = data->convert;
+	if (!convert || !convert->primed) return;
+	convert->primed = false;
+
+	if (data->sink != NULL) {
+		const size_t delay = resampler_delay(convert->resamplers[0]);
+		reserve_planes(convert->resampled, convert->out_channels, &convert->resampled_capacity, resampler_max_output(convert->resamplers[0], delay));
+
+		struct obs_audio_data audio = { 0 };
+		for (size_t c = 0; c < convert->out_channels; c++) {
+			audio.frames = (uint32_t)resampler_flush(convert->resamplers[c], convert->resampled[c]);
+			audio.data[c] = (uint8_t *)convert->resampled[c];
+		}
+		if (audio.frames > 0) writer_fanout_write(data, &audio);
+	}
+
+	for (size_t c = 0; c < convert->out_channels; c++) resampler_reset(convert->resamplers[c]);
+}
+
+void writer_convert_free(writer_data_t *data)
+{
+	convert_free(data->convert);
+	data->convert = NULL;
+}
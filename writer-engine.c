@@ -0,0 +1,366 @@
+#include "audio-writer-filter.h"
+
+/*
+* The writer engine: everything between an incoming obs_audio_data packet
+* and the output sink. It does not depend on a live libobs core, so it can
+* be driven by the filter as well as by the benchmark.
+*/
+
+extern void write_wav_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_wav_finish(writer_data_t *);
+extern void write_wav_checkpoint(writer_data_t *);
+extern void write_flac_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_flac_finish(writer_data_t *);
+extern void write_flac_checkpoint(writer_data_t *);
+extern bool flac_writer_prepare(writer_data_t *);
+extern void flac_writer_free(writer_data_t *);
+extern void write_coreaudio_aac_packet(writer_data_t *, struct obs_audio_data *);
+extern bool coreaudio_writer_prepare(writer_data_t *);
+extern void coreaudio_writer_free(writer_data_t *);
+//extern void write_ffaac_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_raw_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_chunked_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_chunked_finish(writer_data_t *);
+extern bool chunk_writer_prepare(writer_data_t *);
+extern void chunk_writer_free(writer_data_t *);
+extern void write_planar_packet(writer_data_t *, struct obs_audio_data *);
+extern void write_planar_finish(writer_data_t *);
+extern void write_planar_checkpoint(writer_data_t *);
+extern bool planar_writer_prepare(writer_data_t *);
+extern void planar_writer_free(writer_data_t *);
+
+/* Audio writer filter output formats */
+encoder_t encoders[] = {
+	{ "internal-wav",     "wav",     write_wav_packet,           write_wav_finish,     write_wav_checkpoint,    NULL,                     NULL },
+	{ "internal-flac",    "flac",    write_flac_packet,          write_flac_finish,    write_flac_checkpoint,   flac_writer_prepare,      flac_writer_free },
+	{ "coreaudio-aac",    "aac",     write_coreaudio_aac_packet, NULL,                 NULL,                    coreaudio_writer_prepare, coreaudio_writer_free },
+//	{ "ffmpeg-aac",       "aac",     write_ffaac_packet,         NULL,                 NULL,                    NULL,                     NULL },
+	{ "internal-raw",     "raw",     write_raw_packet,           NULL,                 NULL,                    NULL,                     NULL },
+	{ "internal-chunked", "awc",     write_chunked_packet,       write_chunked_finish, NULL,                    chunk_writer_prepare,     chunk_writer_free },
+	{ "internal-planar",  "ch1.raw", write_planar_packet,        write_planar_finish,  write_planar_checkpoint, planar_writer_prepare,    planar_writer_free },
+};
+
+const size_t encoders_count = sizeof(encoders) / sizeof(encoder_t);
+
+encoder_t *writer_get_encoder(const char *encoder_name)
+{
+	for (size_t i = 0; i < encoders_count; i++) {
+		if (0 == strcmp(encoder_name, encoders[i].name)) return &encoders[i];
+	}
+	return &encoders[0];
+}
+
+extern output_t shared_output;
+#ifdef __linux__
+extern output_t uring_output;
+extern output_t uring_direct_output;
+#endif
+#ifndef _WIN32
+extern output_t mmap_output;
+#endif
+
+/* Audio writer filter output backends */
+output_t *outputs[] = {
+	&file_output,
+	&shared_output,
+#ifdef __linux__
+	&uring_output,
+	&uring_direct_output,
+#endif
+#ifndef _WIN32
+	&mmap_output,
+#endif
+};
+
+const size_t outputs_count = sizeof(outputs) / sizeof(output_t *);
+
+output_t *writer_get_output(const char *output_name)
+{
+	for (size_t i = 0; i < outputs_count; i++) {
+		if (0 == strcmp(output_name, outputs[i]->name)) return outputs[i];
+	}
+	return outputs[0];
+}
+
+/*
+* has no sync, must be called inside locking mutex
+* A file of the same name is not overwritten, short segments may start within
+* the same second, a number is added to the name then.
+*/
+char *output_next_filename(writer_data_t *data)
+{
+	struct dstr temp = { 0 };
+	dstr_init_copy(&temp, data->output_folder);
+	dstr_cat_ch(&temp, '/');
+	dstr_cat(&temp, data->output_filename_format);
+	dstr_replace(&temp, "%SRC", data->source_name ? data->source_name : "unknown");
+	char *filename = os_generate_formatted_filename(data->encoder->ext, true, temp.array);
+	dstr_free(&temp);
+	if (!filename) return NULL;
+
+	char *p = filename + strlen(data->output_folder) + 1;
+	while (*p) {
+		if (strchr("\\/:*?!&\"'<>|", *p)) *p = '_';
+		p++;
+	}
+
+	const size_t stem = strlen(filename) - strlen(data->encoder->ext) - 1;
+	for (int number = 2; os_file_exists(filename); number++) {
+		struct dstr numbered = { 0 };
+		dstr_ncopy(&numbered, filename, stem);
+		dstr_catf(&numbered, "-%d.%s", number, data->encoder->ext);
+		bfree(filename);
+		filename = numbered.array;
+	}
+
+	return filename;
+}
+
+/* has no sync, must be called inside locking mutex, the sink is a new file or NULL */
+void output_reset(writer_data_t *data)
+{
+	data->data_length = 0;
+	data->file_has_header = false;
+	data->output_position = 0;
+	data->output_allocated = 0;
+	data->segment.frames = 0;
+	if (data->sink) silence_gate_open(data);
+}
+
+/* releases the preallocation past the written bytes and closes the file */
+void output_release(output_t *output, void *sink, uint64_t position, uint64_t allocated)
+{
+	if (output->trim && allocated != UINT64_MAX && allocated > position) output->trim(sink, position, allocated);
+	output->close(sink);
+}
+
+/* has no sync, must be called inside locking mutex */
+static bool open_sink(writer_data_t *data)
+{
+	if (data->sink == NULL) {
+		char *filename = output_next_filename(data);
+		if (data->output_filename != NULL) bfree(data->output_filename);
+		data->output_filename = filename;
+		data->sink = data->output_filename ? data->output->open(data->output_filename) : NULL;
+		output_reset(data);
+	}
+	return data->sink != NULL;
+}
+
+bool open_output(writer_data_t *data)
+{
+	pthread_mutex_lock(&data->output_lock);
+	const bool opened = open_sink(data);
+	pthread_mutex_unlock(&data->output_lock);
+
+	return opened;
+}
+
+/*
+* Takes output_lock for one packet of an encoder and opens the file if it is
+* not open, so a packet locks once and the file cannot be closed between the
+* check and the write. False without a file, the lock is released then.
+*/
+bool output_lock_open(writer_data_t *data)
+{
+	output_lock_wait(data);
+	if (open_sink(data)) return true;
+
+	pthread_mutex_unlock(&data->output_lock);
+	return false;
+}
+
+/*
+* has no sync, must be called inside locking mutex
+* A file that was prepared for a recording that did not start is removed.
+*/
+void output_close(writer_data_t *data)
+{
+	writer_segment_discard(data);
+	if (data->sink != NULL) {
+		const bool unused = data->segment.frames == 0;
+		if (data->encoder->write_finish) data->encoder->write_finish(data);
+		silence_gate_close(data);
+		output_release(data->output, data->sink, data->output_position, data->output_allocated);
+		data->sink = NULL;
+		if (unused) os_unlink(data->output_filename);
+	}
+}
+
+void close_output(writer_data_t *data)
+{
+	pthread_mutex_lock(&data->output_lock);
+	output_close(data);
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+/*
+* Reserves disk space in whole extents ahead of the write cursor, so a long
+* recording gets few large extents instead of one per append. The file size
+* is not changed, a crash leaves no zero tail behind the audio.
+*/
+void output_preallocate(writer_data_t *data, size_t size)
+{
+	const uint64_t extent = data->preallocate_size;
+	if (extent == 0 || data->output->preallocate == NULL || data->sink == NULL) {
+		data->output_allocated = UINT64_MAX;
+		return;
+	}
+
+	const uint64_t end = (data->output_position + size + extent - 1) / extent * extent;
+	if (!data->output->preallocate(data->sink, data->output_allocated, end - data->output_allocated)) {
+		WRITER_LOG(LOG_WARNING, "preallocation is not supported for '%s', files will grow by appending", data->output_filename);
+		data->output_allocated = UINT64_MAX;
+		return;
+	}
+	data->output_allocated = end;
+}
+
+/* the state of one output file, the engine has one and the fan-out writers one each */
+void writer_file_init(writer_data_t *data)
+{
+	if (!data->output) data->output = &file_output;
+
+	for (size_t c = 0; c < INTERLEAVE_MAX_CHANNELS; c++) {
+		data->dither_state[c] = 0x9E3779B9u * (uint32_t)(c + 1);
+	}
+
+	pthread_mutex_init(&data->output_lock, NULL);
+}
+
+void writer_file_free(writer_data_t *data)
+{
+	close_output(data);
+	writer_segment_free(data);
+	for (size_t i = 0; i < encoders_count; i++) {
+		if (encoders[i].release) encoders[i].release(data);
+	}
+
+	if (data->output_filename != NULL) bfree(data->output_filename);
+
+	circlebuf_free(&data->input_buffer);
+	circlebuf_free(&data->encode_buffer);
+	circlebuf_free(&data->output_buffer);
+	circlebuf_free(&data->interleaved_buffer);
+
+	pthread_mutex_destroy(&data->output_lock);
+}
+
+/* the writer thread does not touch the encoder until frames are pushed */
+bool writer_engine_init(writer_data_t *data, const struct resample_info *sample_info)
+{
+	data->source_info = *sample_info;
+	data->sample_info = *sample_info;
+	data->stats = bzalloc(sizeof(writer_stats_t));
+	pthread_mutex_init(&data->stats->lock, NULL);
+	writer_file_init(data);
+	data->fanout = writer_fanout_create();
+	writer_convert_apply(data);
+	writer_ring_init(&data->ring, data->source_info.speakers, writer_memory_ring_frames(data));
+	float *copy = bmalloc(data->source_info.speakers * WRITER_BLOCK_FRAMES * sizeof(float));
+	for (size_t c = 0; c < data->source_info.speakers; c++) data->ring_copy[c] = copy + c * WRITER_BLOCK_FRAMES;
+	data->ring.overwrite = data->overflow == WRITER_OVERFLOW_DROP_OLDEST;
+	data->preroll_frames = writer_ring_preroll(data);
+
+	return writer_thread_start(data);
+}
+
+void writer_engine_free(writer_data_t *data)
+{
+	writer_thread_stop(data);
+	writer_fanout_free(data);
+	writer_ring_free(&data->ring);
+	writer_session_input_free(data);
+	bfree(data->ring_copy[0]);
+	memset(data->ring_copy, 0, sizeof(data->ring_copy));
+	writer_memory_release(data);
+	writer_file_free(data);
+	writer_convert_free(data);
+	pthread_mutex_destroy(&data->stats->lock);
+	bfree(data->stats);
+	data->stats = NULL;
+}
+
+/*
+* Source side, called on the audio thread, the ring also holds the pre-roll
+* between recordings. The state is only loaded here, a packet that still saw
+* the recording after a stop lands behind the stop position and is not written.
+*/
+void writer_engine_push(writer_data_t *data, const struct obs_audio_data *audio)
+{
+	const uint64_t start = os_gettime_ns();
+	const uint64_t trace = writer_trace_begin();
+	if (trace) writer_trace_thread_name("obs audio");
+
+	const bool recording = writer_recording(data);
+	if (data->session) {
+		if (recording) writer_session_push(data, audio);
+	}
+	else if (recording || data->preroll_frames > 0) {
+		writer_ring_push(&data->ring, audio);
+	}
+
+	writer_histogram_add(&data->stats->push, os_gettime_ns() - start);
+	writer_trace_end("push", trace);
+}
+
+/*
+* Called when a recording or a stream is about to start and when the settings
+* change during one: the writer thread allocates the encoder state and opens
+* the file, so the first packet finds everything ready. Session files are
+* opened by the session when it starts.
+*/
+void writer_engine_prepare(writer_data_t *data)
+{
+	if (data->session) return;
+
+	// nothing queued so far belongs to a stop, the file stays empty until the start
+	const long state = os_atomic_load_long(&data->state);
+	if ((state == WRITER_IDLE || state == WRITER_CLOSED) && os_atomic_compare_swap_long(&data->state, state, WRITER_ARMING)) {
+		os_atomic_set_long(&data->stop_position, os_atomic_load_long(&data->ring.read_pos));
+	}
+	writer_thread_request_prepare(data);
+}
+
+static void open_fanout_output(writer_data_t *writer)
+{
+	open_output(writer);
+}
+
+/* the files are open before the audio thread sees the recording */
+void writer_engine_start(writer_data_t *data)
+{
+	if (data->session) {
+		writer_session_start(data->session, data);
+	}
+	else {
+		open_output(data);
+		writer_fanout_each(data, open_fanout_output);
+	}
+	os_atomic_set_long(&data->state, WRITER_RECORDING);
+}
+
+/*
+* The state is published before the stop position is taken: every packet
+* pushed before it is written, a packet still in flight ends up behind it.
+* A session member has no file of its own to drain.
+*/
+void writer_engine_stop(writer_data_t *data)
+{
+	if (data->session) {
+		os_atomic_set_long(&data->state, WRITER_CLOSED);
+		writer_session_stop(data->session, data);
+	}
+	else {
+		os_atomic_set_long(&data->state, WRITER_DRAINING);
+		os_atomic_set_long(&data->stop_position, os_atomic_load_long(&data->ring.write_pos));
+		writer_thread_request_close(data);
+	}
+}
+
+/* a start that failed leaves the prepared file behind, it is closed and removed */
+void writer_engine_disarm(writer_data_t *data)
+{
+	if (data->session) return;
+	if (os_atomic_compare_swap_long(&data->state, WRITER_ARMING, WRITER_DRAINING)) writer_thread_request_close(data);
+}
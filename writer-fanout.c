@@ -0,0 +1,260 @@
+#include "audio-writer-filter.h"
+
+/*
+* Fan-out: one filter writes the same audio with several encoders, each into
+* a file of its own. An extra encoder gets a writer_data_t for its file state
+* but no ring and no thread, the writer thread of the filter passes every
+* block it takes from the ring to all of them before the block is released.
+* The interleaved samples of a block are converted once per sample format
+* and read by every encoder that stores that format.
+*/
+
+typedef struct {
+	struct circlebuf buffer;
+	uint64_t serial;        // of the block converted into the buffer
+	bool dither;
+} fanout_samples_t;
+
+struct writer_fanout {
+	pthread_mutex_t lock;   // the writers, held by the writer thread while it uses them
+	writer_data_t *writers[WRITER_FANOUT_MAX];
+	size_t count;
+
+	struct obs_audio_data block; // the ring block being written
+	uint64_t serial;
+	bool sharing;
+	fanout_samples_t samples[SAMPLE_FORMAT_INT32 + 1];
+};
+
+writer_fanout_t *writer_fanout_create(void)
+{
+	writer_fanout_t *fanout = bzalloc(sizeof(writer_fanout_t));
+	pthread_mutex_init(&fanout->lock, NULL);
+	return fanout;
+}
+
+static writer_data_t *create_writer(writer_data_t *data, encoder_t *encoder)
+{
+	writer_data_t *writer = bzalloc(sizeof(writer_data_t));
+	writer->filter = data->filter;
+	writer->sample_info = data->sample_info;
+	writer->encoder = encoder;
+	writer->fanout = data->fanout;
+	writer->stats = data->stats;
+	writer->source_name = data->source_name ? bstrdup(data->source_name) : NULL;
+	writer_file_init(writer);
+	return writer;
+}
+
+static void free_writer(writer_data_t *writer)
+{
+	writer_file_free(writer);
+	if (writer->source_name) bfree(writer->source_name);
+	bfree(writer->output_folder);
+	bfree(writer->output_filename_format);
+	bfree(writer);
+}
+
+/* a file that no longer fits the settings is closed before they change, as the file of the filter */
+static void copy_settings(writer_data_t *writer, const writer_data_t *data)
+{
+	if (writer->output != data->output || writer->sample_format != data->sample_format || writer->gate.enabled != data->gate.enabled
+		|| !writer->output_folder || strcmp(writer->output_folder, data->output_folder) != 0)
+		close_output(writer);
+
+	bfree(writer->output_folder);
+	bfree(writer->output_filename_format);
+	writer->output_folder = bstrdup(data->output_folder);
+	writer->output_filename_format = bstrdup(data->output_filename_format);
+	writer->output = data->output;
+	writer->sample_format = data->sample_format;
+	writer->dither = data->dither;
+	writer->wav_rf64 = data->wav_rf64;
+	writer->flac_level = data->flac_level;
+	writer->chunk_shuffle = data->chunk_shuffle;
+	writer->checkpoint_interval = data->checkpoint_interval;
+	writer->preallocate_size = data->preallocate_size;
+	writer->gate.enabled = data->gate.enabled;
+	writer->gate.open_level = data->gate.open_level;
+	writer->gate.hold_frames = data->gate.hold_frames;
+	writer->segment.max_frames = data->segment.max_frames;
+	writer->segment.max_bytes = data->segment.max_bytes;
+}
+
+/*
+* Called on the settings update: writers of encoders no longer selected are
+* closed and freed, new ones are added, and all take the settings of the
+* filter.
+*/
+void writer_fanout_set(writer_data_t *data, encoder_t **encoders, size_t count)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) return;
+	if (count > WRITER_FANOUT_MAX) count = WRITER_FANOUT_MAX;
+
+	writer_data_t *removed[WRITER_FANOUT_MAX];
+	size_t removed_count = 0;
+
+	pthread_mutex_lock(&fanout->lock);
+	writer_data_t *kept[WRITER_FANOUT_MAX];
+	size_t kept_count = 0;
+	for (size_t i = 0; i < fanout->count; i++) {
+		writer_data_t *writer = fanout->writers[i];
+		bool selected = false;
+		for (size_t e = 0; e < count; e++) selected = selected || encoders[e] == writer->encoder;
+		if (selected) kept[kept_count++] = writer;
+		else removed[removed_count++] = writer;
+	}
+
+	fanout->count = 0;
+	for (size_t e = 0; e < count; e++) {
+		writer_data_t *writer = NULL;
+		for (size_t i = 0; i < kept_count; i++) {
+			if (kept[i]->encoder == encoders[e]) writer = kept[i];
+		}
+		if (!writer) writer = create_writer(data, encoders[e]);
+
+		copy_settings(writer, data);
+		fanout->writers[fanout->count++] = writer;
+	}
+	pthread_mutex_unlock(&fanout->lock);
+
+	for (size_t i = 0; i < removed_count; i++) free_writer(removed[i]);
+}
+
+/* the extra files follow the filter file when the settings close it */
+void writer_fanout_close(writer_data_t *data)
+{
+	writer_fanout_each(data, close_output);
+}
+
+/* the writer thread writes no block while the writers are locked */
+void writer_fanout_lock(writer_data_t *data)
+{
+	if (data->fanout) pthread_mutex_lock(&data->fanout->lock);
+}
+
+void writer_fanout_unlock(writer_data_t *data)
+{
+	if (data->fanout) pthread_mutex_unlock(&data->fanout->lock);
+}
+
+/* the writers keep a copy of the source name, the filename is made while it may change */
+void writer_fanout_rename(writer_data_t *data)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) return;
+
+	pthread_mutex_lock(&fanout->lock);
+	for (size_t i = 0; i < fanout->count; i++) {
+		writer_data_t *writer = fanout->writers[i];
+		pthread_mutex_lock(&writer->output_lock);
+		if (writer->source_name) bfree(writer->source_name);
+		writer->source_name = data->source_name ? bstrdup(data->source_name) : NULL;
+		pthread_mutex_unlock(&writer->output_lock);
+	}
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+/* the extra writers follow the format of the filter when the conversion changes it */
+void writer_fanout_format(writer_data_t *data)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) return;
+
+	pthread_mutex_lock(&fanout->lock);
+	for (size_t i = 0; i < fanout->count; i++) fanout->writers[i]->sample_info = data->sample_info;
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+void writer_fanout_each(writer_data_t *data, void (*callback)(writer_data_t *writer))
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) return;
+
+	pthread_mutex_lock(&fanout->lock);
+	for (size_t i = 0; i < fanout->count; i++) callback(fanout->writers[i]);
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+/* passes a block from the ring to the encoder of the filter and then to the extra ones */
+void writer_fanout_write(writer_data_t *data, struct obs_audio_data *audio)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) {
+		writer_segment_write(data, audio);
+		return;
+	}
+
+	pthread_mutex_lock(&fanout->lock);
+	fanout->block = *audio;
+	fanout->serial++;
+	fanout->sharing = fanout->count > 0;
+
+	uint64_t trace = writer_trace_begin();
+	writer_segment_write(data, audio);
+	writer_trace_end(data->encoder->name, trace);
+	for (size_t i = 0; i < fanout->count; i++) {
+		// the queue of the filter decides for its extra encoders
+		fanout->writers[i]->degraded = data->degraded;
+		trace = writer_trace_begin();
+		writer_segment_write(fanout->writers[i], audio);
+		writer_trace_end(fanout->writers[i]->encoder->name, trace);
+	}
+
+	fanout->sharing = false;
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+/*
+* The packet converted to format, read from the conversion of the whole block
+* made by the first encoder that asked for it. NULL when the packet is not a
+* part of the block being written, the encoder converts it itself then.
+*/
+void *writer_fanout_samples(writer_data_t *data, struct obs_audio_data *audio, enum sample_format format, bool dither)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout->sharing) return NULL;
+
+	const struct obs_audio_data *block = &fanout->block;
+	const size_t channels = data->sample_info.speakers;
+	size_t offset = SIZE_MAX;
+	for (size_t c = 0; c < channels; c++) {
+		if (!audio->data[c] != !block->data[c]) return NULL;
+		if (!audio->data[c]) continue;
+		if (audio->data[c] < block->data[c]) return NULL;
+
+		const size_t plane_offset = (size_t)(audio->data[c] - block->data[c]) / sizeof(float);
+		if (offset != SIZE_MAX && plane_offset != offset) return NULL;
+		offset = plane_offset;
+	}
+	if (offset == SIZE_MAX) offset = 0; // silence in every channel
+	if (offset + audio->frames > block->frames) return NULL;
+
+	fanout_samples_t *samples = &fanout->samples[format];
+	const size_t frame_size = channels * sample_format_size(format);
+	if (samples->serial != fanout->serial || samples->dither != dither) {
+		circlebuf_upsize(&samples->buffer, block->frames * frame_size);
+		const uint64_t trace = writer_trace_begin();
+		interleave_convert(circlebuf_data(&samples->buffer, 0), (uint8_t *const *)block->data, channels, block->frames, format, dither ? data->dither_state : NULL);
+		writer_trace_end("interleave", trace);
+		samples->serial = fanout->serial;
+		samples->dither = dither;
+	}
+
+	return (uint8_t *)circlebuf_data(&samples->buffer, 0) + offset * frame_size;
+}
+
+/* after the writer thread is stopped */
+void writer_fanout_free(writer_data_t *data)
+{
+	writer_fanout_t *fanout = data->fanout;
+	if (!fanout) return;
+
+	for (size_t i = 0; i < fanout->count; i++) free_writer(fanout->writers[i]);
+	for (size_t f = 0; f < sizeof(fanout->samples) / sizeof(fanout->samples[0]); f++) circlebuf_free(&fanout->samples[f].buffer);
+
+	pthread_mutex_destroy(&fanout->lock);
+	bfree(fanout);
+	data->fanout = NULL;
+}
@@ -0,0 +1,110 @@
+#include "audio-writer-filter.h"
+#include "writer-memory.h"
+
+/*
+* Memory budget of the writer queues. The ring of a filter is the only buffer
+* that grows with the settings (lag plus pre-roll at the source rate), every
+* other buffer is bounded by WRITER_BLOCK_FRAMES and sized once when the file
+* is prepared. So the ring is sized within the limit of its filter and takes
+* its bytes from a process-wide budget, a ring that does not get the bytes it
+* wants is made smaller, down to the smallest ring of 1024 frames, which is
+* always granted. The pre-roll is then cut to half of the ring.
+*/
+
+#define MEMORY_LOG(level, format, ...) blog(level, "[audio writer filter (memory)] " format, ##__VA_ARGS__)
+
+static struct {
+	bool initialized;
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t reserved;
+} memory;
+
+void writer_memory_init(size_t budget)
+{
+	if (memory.initialized) return;
+
+	pthread_mutex_init(&memory.lock, NULL);
+	memory.budget = budget;
+	memory.reserved = 0;
+	memory.initialized = true;
+}
+
+void writer_memory_set_budget(size_t budget)
+{
+	if (!memory.initialized) return;
+
+	pthread_mutex_lock(&memory.lock);
+	if (budget != memory.budget) MEMORY_LOG(LOG_INFO, "the writer queues share %zu MiB", budget / (1024 * 1024));
+	memory.budget = budget;
+	pthread_mutex_unlock(&memory.lock);
+}
+
+void writer_memory_free(void)
+{
+	if (!memory.initialized) return;
+
+	if (memory.reserved > 0) MEMORY_LOG(LOG_WARNING, "%zu bytes are still reserved", memory.reserved);
+	pthread_mutex_destroy(&memory.lock);
+	memory.initialized = false;
+}
+
+/* grants at most wanted bytes, never less than minimum */
+static size_t memory_reserve(size_t wanted, size_t minimum)
+{
+	if (!memory.initialized) return wanted;
+
+	pthread_mutex_lock(&memory.lock);
+	const size_t available = memory.reserved < memory.budget ? memory.budget - memory.reserved : 0;
+	size_t granted = wanted < available ? wanted : available;
+	if (granted < minimum) granted = minimum;
+	memory.reserved += granted;
+	pthread_mutex_unlock(&memory.lock);
+
+	return granted;
+}
+
+static void memory_release(size_t size)
+{
+	if (!memory.initialized) return;
+
+	pthread_mutex_lock(&memory.lock);
+	memory.reserved = size < memory.reserved ? memory.reserved - size : 0;
+	pthread_mutex_unlock(&memory.lock);
+}
+
+void writer_memory_release(writer_data_t *data)
+{
+	memory_release(data->ring_bytes);
+	data->ring_bytes = 0;
+}
+
+/*
+* Frames for the next ring of the filter, reserved from the budget in place
+* of the reservation of its current ring. Not called from the audio thread.
+*/
+uint32_t writer_memory_ring_frames(writer_data_t *data)
+{
+	writer_memory_release(data);
+
+	const size_t frame_size = (data->source_info.speakers ? data->source_info.speakers : 1) * sizeof(float);
+	const uint32_t wanted = writer_ring_round_capacity(writer_ring_frames(data));
+	data->ring_wanted_frames = writer_ring_frames(data);
+	data->ring_limit = data->memory_limit;
+
+	size_t limit = (size_t)wanted * frame_size;
+	if (data->memory_limit > 0 && data->memory_limit < limit) limit = (size_t)data->memory_limit;
+
+	const size_t minimum = writer_ring_round_capacity(0) * frame_size;
+	const size_t granted = memory_reserve(limit, minimum);
+
+	// the largest power of two that fits the granted bytes
+	uint32_t frames = wanted;
+	while (frames > writer_ring_round_capacity(0) && (size_t)frames * frame_size > granted) frames >>= 1;
+	data->ring_bytes = (size_t)frames * frame_size;
+	memory_release(granted - data->ring_bytes);
+
+	if (frames < wanted) MEMORY_LOG(LOG_WARNING, "the writer queue is limited to %u of %u frames, %zu KiB", frames, wanted, data->ring_bytes / 1024);
+
+	return frames;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+/* process-wide budget of the memory the writer queues hold */
+
+#define WRITER_MEMORY_DEFAULT_BUDGET (512 * 1024 * 1024)
+
+/* sets the bytes all writer queues together may hold */
+void writer_memory_init(size_t budget);
+
+/* a new budget applies to the rings sized after it, reserved bytes stay reserved */
+void writer_memory_set_budget(size_t budget);
+
+void writer_memory_free(void);
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "obs-internal.h"
+
+/*
+* Single-producer/single-consumer ring of audio frames.
+* The producer is the OBS audio thread (writer_filter_audio), the consumer is
+* the writer thread. Frames are kept planar, one plane per channel, so pushing
+* a packet is a straight memcpy of every plane followed by publishing the new
+* write position. Positions are free-running frame counters, the capacity is
+* a power of two so wrapping is done by masking.
+* The consumer may replace the memory with writer_ring_resize, the producer
+* skips its packets while that happens.
+* With overwrite set a full ring keeps the newest audio instead: the producer
+* writes over the oldest frames and the consumer skips what it was lapped by
+* when it peeks next. A run that is read in place could be overwritten while
+* it is encoded, so with overwrite the consumer takes its frames with
+* writer_ring_copy, which leaves out the ones overwritten during the copy.
+*/
+typedef struct {
+	float *memory;
+	float *planes[MAX_AV_PLANES];
+	size_t channels;
+	uint32_t capacity;
+	uint32_t mask;
+
+	volatile long write_pos; // written by producer only
+	volatile long reserve_pos; // end of the packet being written, with overwrite, written by producer only
+	volatile long read_pos;  // written by consumer only
+	volatile long dropped_frames; // written by producer only
+	volatile long overwritten_frames; // written by consumer only
+	volatile bool overwrite;  // written by the settings, read by producer
+	volatile bool pushing;  // written by producer only
+	volatile bool paused;   // written by consumer only
+} writer_ring_t;
+
+static inline uint32_t writer_ring_round_capacity(uint32_t frames)
+{
+	uint32_t capacity = 1024;
+	while (capacity < frames) capacity <<= 1;
+	return capacity;
+}
+
+/* allocates the whole ring at once, must not be called from the audio thread */
+static inline void writer_ring_init(writer_ring_t *ring, size_t channels, uint32_t frames)
+{
+	ring->channels = channels;
+	ring->capacity = writer_ring_round_capacity(frames);
+	ring->mask = ring->capacity - 1;
+	ring->memory = bzalloc(channels * ring->capacity * sizeof(float));
+	for (size_t c = 0; c < channels; c++) {
+		ring->planes[c] = ring->memory + c * ring->capacity;
+	}
+	ring->write_pos = 0;
+	ring->reserve_pos = 0;
+	ring->read_pos = 0;
+	ring->dropped_frames = 0;
+	ring->overwritten_frames = 0;
+}
+
+static inline void writer_ring_free(writer_ring_t *ring)
+{
+	bfree(ring->memory);
+	memset(ring, 0, sizeof(writer_ring_t));
+}
+
+/*
+* Producer side. Never blocks and never allocates.
+* Overflow policy: if the whole packet does not fit, it is dropped (newest
+* data is lost, data already queued for the disk stays intact) and
+* dropped_frames is increased. With overwrite it replaces the oldest frames,
+* unless it is larger than the whole ring.
+*/
+static inline bool writer_ring_push(writer_ring_t *ring, const struct obs_audio_data *audio)
+{
+	// pairs with writer_ring_resize: either the resize sees pushing or the push sees paused
+	os_atomic_set_bool(&ring->pushing, true);
+	if (os_atomic_load_bool(&ring->paused) || !ring->memory) {
+		os_atomic_set_bool(&ring->pushing, false);
+		return false;
+	}
+
+	const uint32_t write_pos = (uint32_t)ring->write_pos;
+	const uint32_t read_pos = (uint32_t)os_atomic_load_long(&ring->read_pos);
+	const uint32_t frames = audio->frames;
+
+	const bool overwrite = ring->overwrite;
+	const uint32_t queued = write_pos - read_pos;
+	if ((!overwrite || frames > ring->capacity) && (queued > ring->capacity || ring->capacity - queued < frames)) {
+		os_atomic_set_long(&ring->dropped_frames, ring->dropped_frames + (long)frames);
+		os_atomic_set_bool(&ring->pushing, false);
+		return false;
+	}
+
+	// published before the frames are written, a copy made meanwhile knows what it may have lost
+	if (overwrite) os_atomic_set_long(&ring->reserve_pos, (long)(write_pos + frames));
+
+	const uint32_t offset = write_pos & ring->mask;
+	const uint32_t first = frames < ring->capacity - offset ? frames : ring->capacity - offset;
+	const uint32_t second = frames - first;
+
+	for (size_t c = 0; c < ring->channels; c++) {
+		const float *src = (const float *)audio->data[c];
+		float *dst = ring->planes[c];
+		if (src) {
+			memcpy(dst + offset, src, first * sizeof(float));
+			if (second) memcpy(dst, src + first, second * sizeof(float));
+		}
+		else {
+			memset(dst + offset, 0, first * sizeof(float));
+			if (second) memset(dst, 0, second * sizeof(float));
+		}
+	}
+
+	os_atomic_set_long(&ring->write_pos, (long)(write_pos + frames));
+	os_atomic_set_bool(&ring->pushing, false);
+	return true;
+}
+
+/*
+* Consumer side. Fills audio with pointers to the largest contiguous run of
+* queued frames (it never crosses the end of the ring) and returns its length.
+* The frames stay valid until writer_ring_advance is called.
+*/
+static inline uint32_t writer_ring_peek(writer_ring_t *ring, struct obs_audio_data *audio)
+{
+	uint32_t read_pos = (uint32_t)ring->read_pos;
+	const uint32_t write_pos = (uint32_t)os_atomic_load_long(&ring->write_pos);
+
+	// lapped by an overwriting producer, the overwritten frames are skipped
+	if (write_pos - read_pos > ring->capacity) {
+		os_atomic_set_long(&ring->overwritten_frames, ring->overwritten_frames + (long)(write_pos - read_pos - ring->capacity));
+		read_pos = write_pos - ring->capacity;
+		os_atomic_set_long(&ring->read_pos, (long)read_pos);
+	}
+	const uint32_t offset = read_pos & ring->mask;
+
+	uint32_t frames = write_pos - read_pos;
+	if (frames > ring->capacity - offset) frames = ring->capacity - offset;
+
+	for (size_t c = 0; c < ring->channels; c++) {
+		audio->data[c] = (uint8_t *)(ring->planes[c] + offset);
+	}
+	audio->frames = frames;
+
+	return frames;
+}
+
+/*
+* Consumer side, for a ring with overwrite. Copies at most max_frames of the
+* run writer_ring_peek gives into the planes of copy and points audio at the
+* frames that were not overwritten while they were copied, the others are
+* counted as overwritten. Returns the ring frames taken, which is what
+* writer_ring_advance is called with, audio may hold fewer.
+*/
+static inline uint32_t writer_ring_copy(writer_ring_t *ring, struct obs_audio_data *audio, float *const *copy, uint32_t max_frames)
+{
+	uint32_t frames = writer_ring_peek(ring, audio);
+	if (frames > max_frames) frames = max_frames;
+	if (frames == 0) return 0;
+
+	const uint32_t read_pos = (uint32_t)ring->read_pos;
+	for (size_t c = 0; c < ring->channels; c++) memcpy(copy[c], audio->data[c], frames * sizeof(float));
+
+	// a frame survived when nothing a whole capacity newer was written or is being written
+	uint32_t newest = (uint32_t)os_atomic_load_long(&ring->reserve_pos);
+	const uint32_t write_pos = (uint32_t)os_atomic_load_long(&ring->write_pos);
+	if ((int32_t)(write_pos - newest) > 0) newest = write_pos;
+
+	const int32_t lost = (int32_t)(newest - ring->capacity - read_pos);
+	const uint32_t torn = lost <= 0 ? 0 : (uint32_t)lost < frames ? (uint32_t)lost : frames;
+	if (torn > 0) os_atomic_set_long(&ring->overwritten_frames, ring->overwritten_frames + (long)torn);
+
+	for (size_t c = 0; c < ring->channels; c++) audio->data[c] = (uint8_t *)(copy[c] + torn);
+	audio->frames = frames - torn;
+
+	return frames;
+}
+
+static inline void writer_ring_advance(writer_ring_t *ring, uint32_t frames)
+{
+	os_atomic_set_long(&ring->read_pos, (long)((uint32_t)ring->read_pos + frames));
+}
+
+static inline uint32_t writer_ring_queued(writer_ring_t *ring)
+{
+	const uint32_t queued = (uint32_t)os_atomic_load_long(&ring->write_pos) - (uint32_t)ring->read_pos;
+	return queued < ring->capacity ? queued : ring->capacity;
+}
+
+/* frames lost to overflows, by either policy */
+static inline long writer_ring_lost(writer_ring_t *ring)
+{
+	return os_atomic_load_long(&ring->dropped_frames) + os_atomic_load_long(&ring->overwritten_frames);
+}
+
+/*
+* Consumer side. Reallocates the ring for a new capacity, the queued frames
+* are discarded. Packets pushed meanwhile are skipped, not counted as drops.
+*/
+static inline void writer_ring_resize(writer_ring_t *ring, uint32_t frames)
+{
+	os_atomic_set_bool(&ring->paused, true);
+	while (os_atomic_load_bool(&ring->pushing)) os_sleep_ms(1);
+
+	const long dropped = ring->dropped_frames;
+	const long overwritten = ring->overwritten_frames;
+	const bool overwrite = ring->overwrite;
+	const size_t channels = ring->channels;
+	bfree(ring->memory);
+	writer_ring_init(ring, channels, frames);
+	ring->dropped_frames = dropped;
+	ring->overwritten_frames = overwritten;
+	ring->overwrite = overwrite;
+
+	os_atomic_set_bool(&ring->paused, false);
+}
@@ -0,0 +1,176 @@
+#include "audio-writer-filter.h"
+
+/*
+* Segmented recording: a new file is started after max_frames of audio or
+* once the file grows past max_bytes. The split falls between two frames of
+* a packet, so consecutive segments join without a gap or an overlap.
+* SEGMENT_PREOPEN_MS ahead of the split a helper thread creates the next
+* file, and another one trims and closes the finished file, so the writer
+* thread only patches the header and swaps the sinks at the split.
+*/
+
+#define SEGMENT_PREOPEN_MS 5000
+#define SEGMENT_PROBE_FRAMES 1024 // written at a time until the size of a frame is known
+
+#define SEGMENT_LOG(level, format, ...) blog(level, "[audio writer filter (segments)] " format, ##__VA_ARGS__)
+
+static void *segment_opener(void *param)
+{
+	writer_segment_t *segment = param;
+	segment->next_sink = segment->next_output->open(segment->next_filename);
+	return NULL;
+}
+
+static void *segment_closer(void *param)
+{
+	writer_segment_t *segment = param;
+	output_release(segment->closing_output, segment->closing_sink, segment->closing_position, segment->closing_allocated);
+	return NULL;
+}
+
+static void wait_opener(writer_segment_t *segment)
+{
+	if (!segment->opening) return;
+	pthread_join(segment->opener, NULL);
+	segment->opening = false;
+}
+
+static void wait_closer(writer_segment_t *segment)
+{
+	if (!segment->closing) return;
+	pthread_join(segment->closer, NULL);
+	segment->closing = false;
+}
+
+/* frames the current file takes before the split, the size is estimated from the average so far */
+static uint64_t frames_left(writer_data_t *data)
+{
+	const writer_segment_t *segment = &data->segment;
+	uint64_t left = UINT64_MAX;
+
+	if (segment->max_frames > 0) left = segment->frames < segment->max_frames ? segment->max_frames - segment->frames : 0;
+
+	if (segment->max_bytes > 0) {
+		if (data->output_position >= segment->max_bytes) return 0;
+		if (segment->frames > 0 && data->output_position > 0) {
+			const double bytes_per_frame = (double)data->output_position / (double)segment->frames;
+			const uint64_t estimate = (uint64_t)((double)(segment->max_bytes - data->output_position) / bytes_per_frame);
+			if (estimate < left) left = estimate;
+		}
+	}
+
+	return left;
+}
+
+/* names the next file and starts creating it, once per segment */
+static void prepare_next(writer_data_t *data)
+{
+	writer_segment_t *segment = &data->segment;
+
+	pthread_mutex_lock(&data->output_lock);
+	if (data->sink != NULL && segment->next_filename == NULL) {
+		segment->next_filename = output_next_filename(data);
+		segment->next_output = data->output;
+		segment->next_sink = NULL;
+		if (segment->next_filename) segment->opening = pthread_create(&segment->opener, NULL, segment_opener, segment) == 0;
+	}
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+/* passes a packet on, split where the current file is full, called on the writer thread */
+void writer_segment_write(writer_data_t *data, struct obs_audio_data *audio)
+{
+	writer_segment_t *segment = &data->segment;
+	if (segment->max_frames == 0 && segment->max_bytes == 0) {
+		silence_gate_write(data, audio);
+		segment->frames += audio->frames;
+		return;
+	}
+
+	const uint64_t preopen_frames = (uint64_t)data->sample_info.samples_per_sec * SEGMENT_PREOPEN_MS / 1000;
+	const size_t channels = data->sample_info.speakers;
+
+	for (uint32_t offset = 0; offset < audio->frames; ) {
+		const uint64_t left = frames_left(data);
+		if (left == 0 && data->sink != NULL) {
+			writer_segment_switch(data);
+			continue;
+		}
+		if (left <= preopen_frames) prepare_next(data);
+
+		struct obs_audio_data piece = *audio;
+		piece.frames = audio->frames - offset;
+		if (left > 0 && left < piece.frames) piece.frames = (uint32_t)left;
+		if (segment->max_bytes > 0 && (segment->frames == 0 || data->output_position == 0) && piece.frames > SEGMENT_PROBE_FRAMES) piece.frames = SEGMENT_PROBE_FRAMES;
+		for (size_t c = 0; c < channels; c++) {
+			piece.data[c] = audio->data[c] ? audio->data[c] + offset * sizeof(float) : NULL;
+		}
+
+		silence_gate_write(data, &piece);
+		segment->frames += piece.frames;
+		offset += piece.frames;
+	}
+}
+
+/*
+* Finishes the current file and continues in the prepared one, takes the
+* output lock. The encoder patches its header here, the trim and the close of
+* the finished file happen on the closer thread. Without a prepared file the
+* next one is opened right away.
+*/
+void writer_segment_switch(writer_data_t *data)
+{
+	writer_segment_t *segment = &data->segment;
+
+	pthread_mutex_lock(&data->output_lock);
+	if (data->sink != NULL) {
+		if (data->encoder->write_finish) data->encoder->write_finish(data);
+		silence_gate_close(data);
+
+		wait_closer(segment);
+		segment->closing_output = data->output;
+		segment->closing_sink = data->sink;
+		segment->closing_position = data->output_position;
+		segment->closing_allocated = data->output_allocated;
+		data->sink = NULL;
+		segment->closing = pthread_create(&segment->closer, NULL, segment_closer, segment) == 0;
+		if (!segment->closing) segment_closer(segment);
+
+		wait_opener(segment);
+		if (segment->next_sink != NULL && segment->next_output == data->output) {
+			bfree(data->output_filename);
+			data->output_filename = segment->next_filename;
+			data->sink = segment->next_sink;
+			segment->next_filename = NULL;
+			segment->next_sink = NULL;
+			output_reset(data);
+		}
+		else {
+			writer_segment_discard(data);
+		}
+	}
+	pthread_mutex_unlock(&data->output_lock);
+
+	if (data->sink == NULL && !open_output(data)) SEGMENT_LOG(LOG_ERROR, "failed to start the next segment");
+}
+
+/* has no sync, must be called inside locking mutex, removes a prepared file that was not used */
+void writer_segment_discard(writer_data_t *data)
+{
+	writer_segment_t *segment = &data->segment;
+
+	wait_opener(segment);
+	if (segment->next_sink != NULL) {
+		segment->next_output->close(segment->next_sink);
+		os_unlink(segment->next_filename);
+		segment->next_sink = NULL;
+	}
+	if (segment->next_filename != NULL) bfree(segment->next_filename);
+	segment->next_filename = NULL;
+}
+
+/* waits for the last finished file to be closed */
+void writer_segment_free(writer_data_t *data)
+{
+	wait_closer(&data->segment);
+}
@@ -0,0 +1,493 @@
+#include "audio-writer-filter.h"
+
+/*
+* Sessions: filters with the same session name record into one file that has
+* the channels of every member side by side, in the order they joined.
+* The audio thread of every member pushes its packets into a ring of that
+* member without a lock, the writer thread of the session engine places them
+* on a common timeline by obs_audio_data.timestamp. The frames every member
+* has delivered are passed to the engine as one planar block, so the whole
+* session costs one header and one write per block. A member that stops
+* delivering holds the others back for at most SESSION_MAX_SKEW_MS, its
+* channels are silent after that.
+* The member rings are read by whoever holds the session lock: the engine
+* while it records, the start and the stop around it.
+* The channel layout is fixed when the session starts recording, a member that
+* joins later is written from the next recording on.
+*/
+
+#define SESSION_MAX_SKEW_MS 1000
+#define SESSION_STAGING_MS 2000 // must be longer than the skew
+#define SESSION_JITTER_MS 1     // timestamp rounding that does not break continuity
+#define SESSION_PACKETS 512     // timestamps a member ring holds, a power of two
+
+#define SESSION_LOG(level, format, ...) blog(level, "[audio writer filter (session)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	uint64_t timestamp;
+	uint32_t frames;
+} session_packet_t;
+
+/* the packets of a member, the frames in the ring and their timestamps next to it */
+struct writer_session_input {
+	writer_ring_t ring;
+	session_packet_t packets[SESSION_PACKETS];
+	volatile long packets_write; // written by the audio thread only
+	volatile long packets_read;  // written under the session lock only
+	long lost_merged;            // drops of the ring already counted by the engine
+};
+
+typedef struct {
+	writer_data_t *data;
+	int channel_offset; // -1 while not a part of the file
+	int64_t end;        // timeline frame after its last packet
+	bool started;
+} session_member_t;
+
+struct writer_session {
+	struct writer_session *next;
+	char *name;
+	pthread_mutex_t lock;
+
+	session_member_t members[MAX_AV_PLANES];
+	size_t members_count;
+	size_t started_count;
+
+	writer_data_t *engine;
+	char *output_folder;
+	char *output_filename_format;
+	char *stats_file;
+
+	bool recording;
+	bool has_origin;
+	uint64_t origin;    // timestamp of timeline frame 0
+	uint32_t rate;
+	size_t channels;
+
+	float *staging;     // planar timeline window, frames from base on
+	float *planes[MAX_AV_PLANES];
+	uint32_t capacity;
+	uint32_t mask;
+	int64_t base;       // first timeline frame not passed to the engine yet
+};
+
+/* sessions are kept until the module unloads, the audio thread may still hold a pointer */
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static writer_session_t *sessions = NULL;
+
+static session_member_t *find_member(writer_session_t *session, writer_data_t *data)
+{
+	for (size_t i = 0; i < session->members_count; i++) {
+		if (session->members[i].data == data) return &session->members[i];
+	}
+	return NULL;
+}
+
+static int64_t timestamp_to_frame(writer_session_t *session, uint64_t timestamp)
+{
+	if (timestamp <= session->origin) return 0;
+
+	// whole seconds first, the product would overflow after a few days
+	const uint64_t elapsed = timestamp - session->origin;
+	const uint64_t seconds = elapsed / 1000000000ULL;
+	const uint64_t rest = elapsed % 1000000000ULL;
+	return (int64_t)(seconds * session->rate + (rest * session->rate + 500000000ULL) / 1000000000ULL);
+}
+
+/* passes the timeline up to ready to the engine, the window behind it is silence again */
+static void publish(writer_session_t *session, int64_t ready)
+{
+	while (session->base < ready) {
+		const uint32_t offset = (uint32_t)session->base & session->mask;
+		uint32_t frames = session->capacity - offset;
+		if ((int64_t)frames > ready - session->base) frames = (uint32_t)(ready - session->base);
+
+		struct obs_audio_data audio = { 0 };
+		audio.frames = frames;
+		for (size_t c = 0; c < session->channels; c++) {
+			audio.data[c] = (uint8_t *)(session->planes[c] + offset);
+		}
+		writer_ring_push(&session->engine->ring, &audio);
+
+		for (size_t c = 0; c < session->channels; c++) {
+			memset(session->planes[c] + offset, 0, frames * sizeof(float));
+		}
+		session->base += frames;
+	}
+}
+
+static void publish_ready(writer_session_t *session, bool flush)
+{
+	int64_t ready = INT64_MAX;
+	int64_t newest = session->base;
+	for (size_t i = 0; i < session->members_count; i++) {
+		const session_member_t *member = &session->members[i];
+		if (member->channel_offset < 0) continue;
+		if (member->end < ready) ready = member->end;
+		if (member->end > newest) newest = member->end;
+	}
+
+	const int64_t max_skew = (int64_t)session->rate * SESSION_MAX_SKEW_MS / 1000;
+	if (flush || ready == INT64_MAX || newest - ready > max_skew) ready = flush ? newest : newest - max_skew;
+
+	publish(session, ready);
+}
+
+static void write_member_frames(writer_session_t *session, session_member_t *member, const struct obs_audio_data *audio, int64_t position)
+{
+	int64_t start = position > session->base ? position : session->base;
+	int64_t stop = position + audio->frames;
+	if (stop > session->base + session->capacity) {
+		const int64_t limit = session->base + session->capacity;
+		os_atomic_set_long(&session->engine->ring.dropped_frames, session->engine->ring.dropped_frames + (long)(stop - (limit > start ? limit : start)));
+		stop = limit;
+	}
+
+	const size_t channels = member->data->source_info.speakers;
+	for (int64_t frame = start; frame < stop; ) {
+		const uint32_t offset = (uint32_t)frame & session->mask;
+		uint32_t frames = session->capacity - offset;
+		if ((int64_t)frames > stop - frame) frames = (uint32_t)(stop - frame);
+
+		for (size_t c = 0; c < channels; c++) {
+			const float *src = (const float *)audio->data[c];
+			float *dst = session->planes[member->channel_offset + c] + offset;
+			if (src) memcpy(dst, src + (frame - position), frames * sizeof(float));
+			else memset(dst, 0, frames * sizeof(float));
+		}
+		frame += frames;
+	}
+
+	if (stop > member->end) member->end = stop;
+}
+
+/* called on the audio thread, the packet is dropped when the ring of the member is full */
+void writer_session_push(writer_data_t *data, const struct obs_audio_data *audio)
+{
+	writer_session_input_t *input = data->session_input;
+	if (!input || audio->frames == 0) return;
+
+	const uint32_t packets_write = (uint32_t)input->packets_write;
+	if (packets_write - (uint32_t)os_atomic_load_long(&input->packets_read) >= SESSION_PACKETS) {
+		os_atomic_set_long(&input->ring.dropped_frames, input->ring.dropped_frames + (long)audio->frames);
+		return;
+	}
+	if (!writer_ring_push(&input->ring, audio)) return;
+
+	// the frames are published before the timestamp that points at them
+	session_packet_t *packet = &input->packets[packets_write & (SESSION_PACKETS - 1)];
+	packet->timestamp = audio->timestamp;
+	packet->frames = audio->frames;
+	os_atomic_set_long(&input->packets_write, (long)(packets_write + 1));
+}
+
+/* places a packet taken from the ring of a member on the timeline */
+static void place_packet(writer_session_t *session, session_member_t *member, const session_packet_t *packet)
+{
+	writer_ring_t *ring = &member->data->session_input->ring;
+
+	if (!session->has_origin) {
+		session->origin = packet->timestamp;
+		session->has_origin = true;
+	}
+
+	int64_t position = timestamp_to_frame(session, packet->timestamp);
+	const int64_t jitter = (int64_t)session->rate * SESSION_JITTER_MS / 1000;
+	if (position != member->end && position >= member->end - jitter && position <= member->end + jitter) position = member->end;
+
+	// a packet crosses the end of the ring at most once
+	for (uint32_t left = packet->frames; left > 0; ) {
+		struct obs_audio_data audio = { 0 };
+		uint32_t frames = writer_ring_peek(ring, &audio);
+		if (frames > left) audio.frames = frames = left;
+		if (frames == 0) break;
+
+		write_member_frames(session, member, &audio, position);
+		writer_ring_advance(ring, frames);
+		position += frames;
+		left -= frames;
+	}
+}
+
+/*
+* Takes everything a member has pushed so far, called with the session lock
+* held. Members left out of the file are only emptied, so are all of them
+* with discard.
+*/
+static void merge_member(writer_session_t *session, session_member_t *member, bool discard)
+{
+	writer_session_input_t *input = member->data->session_input;
+	if (!input) return;
+
+	const uint32_t packets_write = (uint32_t)os_atomic_load_long(&input->packets_write);
+	uint32_t packets_read = (uint32_t)input->packets_read;
+	while (packets_read != packets_write) {
+		const session_packet_t *packet = &input->packets[packets_read & (SESSION_PACKETS - 1)];
+		if (discard || member->channel_offset < 0) writer_ring_advance(&input->ring, packet->frames);
+		else place_packet(session, member, packet);
+		os_atomic_set_long(&input->packets_read, (long)++packets_read);
+	}
+
+	// what the member could not push is missing from the session file
+	const long lost = writer_ring_lost(&input->ring);
+	if (!discard && session->engine && lost != input->lost_merged) {
+		writer_ring_t *ring = &session->engine->ring;
+		os_atomic_set_long(&ring->dropped_frames, ring->dropped_frames + (lost - input->lost_merged));
+	}
+	input->lost_merged = lost;
+}
+
+static void merge_members(writer_session_t *session, bool discard)
+{
+	for (size_t i = 0; i < session->members_count; i++) merge_member(session, &session->members[i], discard);
+}
+
+/* called on the writer thread of a session engine before it drains its ring */
+void writer_session_merge(writer_session_t *session, writer_data_t *engine)
+{
+	pthread_mutex_lock(&session->lock);
+	if (session->recording && session->engine == engine) {
+		merge_members(session, false);
+		publish_ready(session, false);
+	}
+	pthread_mutex_unlock(&session->lock);
+}
+
+/* the ring a filter pushes into while it is a member, kept until the filter is destroyed */
+static void create_input(writer_data_t *data)
+{
+	if (data->session_input) return;
+
+	writer_session_input_t *input = bzalloc(sizeof(writer_session_input_t));
+	writer_ring_init(&input->ring, data->source_info.speakers, data->source_info.samples_per_sec * WRITER_RING_MS / 1000);
+	data->session_input = input;
+}
+
+void writer_session_input_free(writer_data_t *data)
+{
+	writer_session_input_t *input = data->session_input;
+	if (!input) return;
+
+	writer_ring_free(&input->ring);
+	bfree(input);
+	data->session_input = NULL;
+}
+
+static void free_engine(writer_data_t *engine)
+{
+	if (!engine) return;
+	writer_engine_free(engine);
+	bfree(engine);
+}
+
+/*
+* The first member to start lays out the channels and its settings become the
+* settings of the session file. The previous engine is flushed and freed here,
+* outside the session lock, as the audio thread takes that lock too.
+*/
+static void begin_recording(writer_session_t *session, writer_data_t *leader)
+{
+	pthread_mutex_lock(&session->lock);
+	writer_data_t *old_engine = session->engine;
+	float *old_staging = session->staging;
+	session->engine = NULL;
+	session->staging = NULL;
+
+	size_t channels = 0;
+	for (size_t i = 0; i < session->members_count; i++) {
+		session_member_t *member = &session->members[i];
+		const size_t member_channels = member->data->source_info.speakers;
+		if (channels + member_channels <= MAX_AV_PLANES) {
+			member->channel_offset = (int)channels;
+			channels += member_channels;
+		}
+		else {
+			SESSION_LOG(LOG_WARNING, "'%s' has more than %d channels, a source is left out", session->name, MAX_AV_PLANES);
+			member->channel_offset = -1;
+		}
+		member->end = 0;
+	}
+	// what was pushed after the last stop does not belong to this recording
+	merge_members(session, true);
+	pthread_mutex_unlock(&session->lock);
+
+	free_engine(old_engine);
+	bfree(old_staging);
+
+	writer_data_t *engine = bzalloc(sizeof(writer_data_t));
+
+	// the settings of the leader change under its output lock
+	pthread_mutex_lock(&leader->output_lock);
+	bfree(session->output_folder);
+	bfree(session->output_filename_format);
+	bfree(session->stats_file);
+	session->output_folder = bstrdup(leader->output_folder);
+	session->output_filename_format = bstrdup(leader->output_filename_format);
+	session->stats_file = leader->stats_file ? bstrdup(leader->stats_file) : NULL;
+	engine->encoder = leader->encoder;
+	engine->output = leader->output;
+	engine->sample_format = leader->sample_format;
+	engine->gate.enabled = leader->gate.enabled;
+	pthread_mutex_unlock(&leader->output_lock);
+
+	engine->source_name = session->name;
+	engine->merging = session;
+	engine->output_folder = session->output_folder;
+	engine->output_filename_format = session->output_filename_format;
+	engine->dither = leader->dither;
+	engine->wav_rf64 = leader->wav_rf64;
+	engine->flac_level = leader->flac_level;
+	engine->chunk_shuffle = leader->chunk_shuffle;
+	engine->checkpoint_interval = leader->checkpoint_interval;
+	engine->preallocate_size = leader->preallocate_size;
+	engine->gate.open_level = leader->gate.open_level;
+	engine->gate.hold_frames = leader->gate.hold_frames;
+	engine->segment.max_frames = leader->segment.max_frames;
+	engine->segment.max_bytes = leader->segment.max_bytes;
+	engine->stats_interval = leader->stats_interval;
+	engine->stats_file = session->stats_file;
+	engine->trace = leader->trace;
+	engine->convert_rate = leader->convert_rate;
+	engine->convert_channels = leader->convert_channels;
+	engine->memory_limit = leader->memory_limit;
+	engine->overflow = leader->overflow;
+
+	const uint32_t rate = leader->source_info.samples_per_sec;
+	struct resample_info sample_info = { rate, AUDIO_FORMAT_FLOAT_PLANAR, (enum speaker_layout)channels };
+	if (!writer_engine_init(engine, &sample_info)) SESSION_LOG(LOG_ERROR, "failed to start writer thread for '%s'", session->name);
+	writer_engine_start(engine);
+
+	const uint32_t capacity = writer_ring_round_capacity(rate * SESSION_STAGING_MS / 1000);
+	float *staging = bzalloc(channels * capacity * sizeof(float));
+
+	pthread_mutex_lock(&session->lock);
+	session->engine = engine;
+	session->staging = staging;
+	session->channels = channels;
+	session->rate = rate;
+	session->capacity = capacity;
+	session->mask = capacity - 1;
+	for (size_t c = 0; c < channels; c++) session->planes[c] = staging + c * capacity;
+	session->base = 0;
+	session->has_origin = false;
+	session->recording = channels > 0;
+	pthread_mutex_unlock(&session->lock);
+}
+
+/* writes out what the members have delivered and closes the file, called with the lock held */
+static void end_recording(writer_session_t *session)
+{
+	if (!session->recording) return;
+
+	merge_members(session, false);
+	publish_ready(session, true);
+	session->recording = false;
+	writer_engine_stop(session->engine);
+}
+
+void writer_session_start(writer_session_t *session, writer_data_t *data)
+{
+	pthread_mutex_lock(&session->lock);
+	session_member_t *member = find_member(session, data);
+	const bool first = member && !member->started && session->started_count++ == 0;
+	if (member) member->started = true;
+	pthread_mutex_unlock(&session->lock);
+
+	if (first) begin_recording(session, data);
+}
+
+void writer_session_stop(writer_session_t *session, writer_data_t *data)
+{
+	pthread_mutex_lock(&session->lock);
+	session_member_t *member = find_member(session, data);
+	if (member && member->started) {
+		member->started = false;
+		if (--session->started_count == 0) end_recording(session);
+	}
+	pthread_mutex_unlock(&session->lock);
+}
+
+/* NULL when the session is full, the filter then records its own file */
+writer_session_t *writer_session_join(const char *name, writer_data_t *data)
+{
+	pthread_mutex_lock(&sessions_lock);
+	writer_session_t *session = sessions;
+	while (session && 0 != strcmp(session->name, name)) session = session->next;
+
+	if (!session) {
+		session = bzalloc(sizeof(writer_session_t));
+		session->name = bstrdup(name);
+		pthread_mutex_init(&session->lock, NULL);
+		session->next = sessions;
+		sessions = session;
+	}
+	pthread_mutex_unlock(&sessions_lock);
+
+	create_input(data);
+
+	pthread_mutex_lock(&session->lock);
+	const bool full = session->members_count == MAX_AV_PLANES;
+	if (!full) {
+		session_member_t *member = &session->members[session->members_count++];
+		member->data = data;
+		member->channel_offset = -1;
+		member->end = 0;
+		member->started = false;
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	if (full) {
+		SESSION_LOG(LOG_WARNING, "'%s' is full, the source records its own file", name);
+		return NULL;
+	}
+	return session;
+}
+
+/* the file is closed when the last started member leaves, the engine goes with the last member */
+void writer_session_leave(writer_session_t *session, writer_data_t *data)
+{
+	writer_data_t *engine = NULL;
+
+	pthread_mutex_lock(&session->lock);
+	session_member_t *member = find_member(session, data);
+	if (member) {
+		if (member->started && --session->started_count == 0) end_recording(session);
+
+		const size_t index = (size_t)(member - session->members);
+		memmove(member, member + 1, (session->members_count - index - 1) * sizeof(session_member_t));
+		session->members_count--;
+
+		if (session->members_count == 0) {
+			engine = session->engine;
+			session->engine = NULL;
+			session->recording = false;
+		}
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	free_engine(engine);
+}
+
+const char *writer_session_name(writer_session_t *session)
+{
+	return session->name;
+}
+
+void writer_sessions_free(void)
+{
+	pthread_mutex_lock(&sessions_lock);
+	while (sessions) {
+		writer_session_t *session = sessions;
+		sessions = session->next;
+
+		free_engine(session->engine);
+		bfree(session->staging);
+		bfree(session->output_folder);
+		bfree(session->output_filename_format);
+		bfree(session->stats_file);
+		bfree(session->name);
+		pthread_mutex_destroy(&session->lock);
+		bfree(session);
+	}
+	pthread_mutex_unlock(&sessions_lock);
+}
@@ -0,0 +1,154 @@
+#include <time.h>
+
+#include "audio-writer-filter.h"
+
+/*
+* Statistics of a filter: the counters are updated on the audio and the
+* writer threads (writer-stats.h), read by the properties dialog, and every
+* stats_interval seconds the writer thread logs a summary and appends a row
+* to the stats file. A file ending in .csv gets comma separated rows under
+* a header line, any other file one JSON object per line.
+*/
+
+#define STATS_LOG(level, format, ...) blog(level, "[audio writer filter (stats)] " format, ##__VA_ARGS__)
+
+typedef struct {
+	writer_stats_t stats;
+	long dropped_frames;
+	char *source_name;
+	char *stats_file;       // NULL when the rows are not written to a file
+} stats_snapshot_t;
+
+static void take_snapshot(writer_data_t *data, stats_snapshot_t *snapshot)
+{
+	// the lock of the copy is never used
+	pthread_mutex_lock(&data->stats->lock);
+	snapshot->stats = *data->stats;
+	pthread_mutex_unlock(&data->stats->lock);
+	snapshot->dropped_frames = writer_ring_lost(&data->ring);
+
+	pthread_mutex_lock(&data->output_lock);
+	snapshot->source_name = bstrdup(data->source_name ? data->source_name : "unknown");
+	snapshot->stats_file = data->stats_file && *data->stats_file ? bstrdup(data->stats_file) : NULL;
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+static void format_snapshot(const stats_snapshot_t *snapshot, struct dstr *text)
+{
+	const writer_stats_t *stats = &snapshot->stats;
+
+	dstr_printf(text, "%.1f MiB written, %llu frames, %ld dropped, %llu skipped as silence, %llu encoder errors\n",
+		(double)stats->bytes_written / (1024.0 * 1024.0), (unsigned long long)stats->frames_written,
+		snapshot->dropped_frames, (unsigned long long)stats->gated_frames, (unsigned long long)stats->encode_errors);
+	dstr_catf(text, "audio callback: p50 %.0f us, p99 %.0f us, max %.0f us\n",
+		writer_histogram_percentile(&stats->push, 0.5), writer_histogram_percentile(&stats->push, 0.99), (double)stats->push.max_ns / 1000.0);
+	dstr_catf(text, "disk writes: p99 %.0f us, max %.0f us, %.0f ms in total\n",
+		writer_histogram_percentile(&stats->write, 0.99), (double)stats->write.max_ns / 1000.0, (double)stats->write.total_ns / 1000000.0);
+	dstr_catf(text, "queue: %u frames, at most %u", stats->queue_frames, stats->queue_max_frames);
+}
+
+/* a few lines for the properties dialog */
+void writer_stats_format(writer_data_t *data, struct dstr *text)
+{
+	stats_snapshot_t snapshot;
+	take_snapshot(data, &snapshot);
+	format_snapshot(&snapshot, text);
+	bfree(snapshot.source_name);
+	bfree(snapshot.stats_file);
+}
+
+static bool is_csv(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	return ext && 0 == strcmp(ext, ".csv");
+}
+
+static void write_csv_row(FILE *file, const stats_snapshot_t *snapshot, time_t timestamp)
+{
+	const writer_stats_t *stats = &snapshot->stats;
+
+	fprintf(file, "%lld,\"", (long long)timestamp);
+	for (const char *c = snapshot->source_name; *c; c++) {
+		if (*c == '"') fputc('"', file);
+		fputc(*c, file);
+	}
+	fprintf(file, "\",%llu,%llu,%ld,%llu,%llu,%u,%u,%llu,%.1f,%.1f,%.1f,%llu,%.1f,%.1f,%.3f\n",
+		(unsigned long long)stats->bytes_written, (unsigned long long)stats->frames_written, snapshot->dropped_frames,
+		(unsigned long long)stats->gated_frames, (unsigned long long)stats->encode_errors,
+		stats->queue_frames, stats->queue_max_frames,
+		(unsigned long long)stats->push.count, writer_histogram_percentile(&stats->push, 0.5),
+		writer_histogram_percentile(&stats->push, 0.99), (double)stats->push.max_ns / 1000.0,
+		(unsigned long long)stats->write.count, writer_histogram_percentile(&stats->write, 0.99),
+		(double)stats->write.max_ns / 1000.0, (double)stats->write.total_ns / 1000000.0);
+}
+
+static void write_json_row(FILE *file, const stats_snapshot_t *snapshot, time_t timestamp)
+{
+	const writer_stats_t *stats = &snapshot->stats;
+
+	fprintf(file, "{\"time\":%lld,\"source\":\"", (long long)timestamp);
+	for (const unsigned char *c = (const unsigned char *)snapshot->source_name; *c; c++) {
+		if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+		else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+		else fputc(*c, file);
+	}
+	fprintf(file, "\",\"bytes_written\":%llu,\"frames_written\":%llu,\"dropped_frames\":%ld,\"gated_frames\":%llu,\"encode_errors\":%llu,"
+		"\"queue_frames\":%u,\"queue_max_frames\":%u,"
+		"\"push\":{\"count\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f},"
+		"\"write\":{\"count\":%llu,\"p99_us\":%.1f,\"max_us\":%.1f,\"total_ms\":%.3f}}\n",
+		(unsigned long long)stats->bytes_written, (unsigned long long)stats->frames_written, snapshot->dropped_frames,
+		(unsigned long long)stats->gated_frames, (unsigned long long)stats->encode_errors,
+		stats->queue_frames, stats->queue_max_frames,
+		(unsigned long long)stats->push.count, writer_histogram_percentile(&stats->push, 0.5),
+		writer_histogram_percentile(&stats->push, 0.99), (double)stats->push.max_ns / 1000.0,
+		(unsigned long long)stats->write.count, writer_histogram_percentile(&stats->write, 0.99),
+		(double)stats->write.max_ns / 1000.0, (double)stats->write.total_ns / 1000000.0);
+}
+
+/* the file is opened for every row, so it can be rotated or removed while OBS runs */
+static void append_to_file(const stats_snapshot_t *snapshot, time_t timestamp)
+{
+	const char *path = snapshot->stats_file;
+	const bool csv = is_csv(path);
+	const bool header = csv && !os_file_exists(path);
+
+	FILE *file = os_fopen(path, "a");
+	if (!file) {
+		STATS_LOG(LOG_WARNING, "failed to open '%s'", path);
+		return;
+	}
+
+	if (header) {
+		fprintf(file, "time,source,bytes_written,frames_written,dropped_frames,gated_frames,encode_errors,"
+			"queue_frames,queue_max_frames,push_count,push_p50_us,push_p99_us,push_max_us,"
+			"write_count,write_p99_us,write_max_us,write_total_ms\n");
+	}
+	if (csv) write_csv_row(file, snapshot, timestamp);
+	else write_json_row(file, snapshot, timestamp);
+	fclose(file);
+}
+
+/* called on the writer thread, does nothing until the interval has passed */
+void writer_stats_report(writer_data_t *data)
+{
+	writer_stats_t *stats = data->stats;
+	if (data->stats_interval == 0) return;
+
+	const uint64_t now = os_gettime_ns();
+	if (stats->last_report_time == 0) stats->last_report_time = now;
+	if (now - stats->last_report_time < data->stats_interval * 1000000000ULL) return;
+	stats->last_report_time = now;
+
+	stats_snapshot_t snapshot;
+	take_snapshot(data, &snapshot);
+
+	struct dstr text = { 0 };
+	format_snapshot(&snapshot, &text);
+	dstr_replace(&text, "\n", "; ");
+	STATS_LOG(LOG_INFO, "'%s': %s", snapshot.source_name, text.array);
+	dstr_free(&text);
+
+	if (snapshot.stats_file) append_to_file(&snapshot, time(NULL));
+	bfree(snapshot.source_name);
+	bfree(snapshot.stats_file);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "util/threading.h"
+
+/*
+* Performance counters of a filter. The push histogram is only written by
+* the audio thread and the queue and frame counters only by the writer
+* thread, so they are plain stores; a reader on another thread may see a
+* value a moment old. The write and error counters also count the bytes of
+* a file closed by a settings change on the settings thread, they are added
+* under the lock.
+*/
+
+#define WRITER_HISTOGRAM_BUCKETS 16 // bucket 0 is below 1 us, every next one twice as wide
+
+typedef struct {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[WRITER_HISTOGRAM_BUCKETS];
+} writer_histogram_t;
+
+typedef struct {
+	writer_histogram_t push;    // writer_engine_push on the audio thread
+	writer_histogram_t write;   // output backend writes on the writer thread
+	uint64_t bytes_written;
+	uint64_t frames_written;    // passed from the queue to the encoders
+	uint64_t gated_frames;      // held back by the silence gate
+	uint64_t encode_errors;
+	uint32_t queue_frames;      // queued when the writer thread last looked
+	uint32_t queue_max_frames;
+	uint64_t last_report_time;
+	pthread_mutex_t lock;       // write, bytes_written and encode_errors
+} writer_stats_t;
+
+static inline void writer_histogram_add(writer_histogram_t *histogram, uint64_t ns)
+{
+	unsigned bucket = 0;
+	for (uint64_t limit = 1024; ns >= limit && bucket < WRITER_HISTOGRAM_BUCKETS - 1; limit <<= 1) bucket++;
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->total_ns += ns;
+	if (ns > histogram->max_ns) histogram->max_ns = ns;
+}
+
+static inline void writer_stats_add_write(writer_stats_t *stats, uint64_t ns, uint64_t bytes)
+{
+	pthread_mutex_lock(&stats->lock);
+	writer_histogram_add(&stats->write, ns);
+	stats->bytes_written += bytes;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+/* bytes converted straight into a mapped file, without a write call */
+static inline void writer_stats_add_bytes(writer_stats_t *stats, uint64_t bytes)
+{
+	pthread_mutex_lock(&stats->lock);
+	stats->bytes_written += bytes;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+static inline void writer_stats_add_error(writer_stats_t *stats)
+{
+	pthread_mutex_lock(&stats->lock);
+	stats->encode_errors++;
+	pthread_mutex_unlock(&stats->lock);
+}
+
+/* upper bound of the bucket that holds the given fraction of the samples, microseconds */
+static inline double writer_histogram_percentile(const writer_histogram_t *histogram, double fraction)
+{
+	const uint64_t rank = (uint64_t)(fraction * (double)histogram->count);
+	uint64_t seen = 0;
+	for (unsigned bucket = 0; bucket < WRITER_HISTOGRAM_BUCKETS - 1; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen > rank) return (double)(1024ULL << bucket) / 1000.0;
+	}
+	return (double)histogram->max_ns / 1000.0;
+}
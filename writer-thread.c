@@ -0,0 +1,249 @@
+#include "audio-writer-filter.h"
+
+#define WRITER_POLL_MS 20
+
+/*
+* The degrade policy switches the encoders to their fastest settings while
+* the queue is more than half full, and back once it is down to a quarter.
+*/
+static void writer_update_degraded(writer_data_t *data, uint32_t queued)
+{
+	if (data->overflow != WRITER_OVERFLOW_DEGRADE) {
+		data->degraded = false;
+		return;
+	}
+
+	if (!data->degraded && queued > data->ring.capacity / 2) {
+		data->degraded = true;
+		WRITER_LOG(LOG_WARNING, "writer queue is %u%% full, encoding faster at a larger size", (uint32_t)((uint64_t)queued * 100 / data->ring.capacity));
+	}
+	else if (data->degraded && queued < data->ring.capacity / 4) {
+		data->degraded = false;
+		WRITER_LOG(LOG_INFO, "writer queue has caught up, encoding as set again");
+	}
+}
+
+/*
+* Passes the recorded frames to the encoder, runs on the writer thread only.
+* While recording that is everything queued, the pre-roll included. After a
+* stop only the frames up to the stop position go to the still open file,
+* once it is closed the rest is trimmed to the pre-roll length and kept for
+* the next recording. Nothing is trimmed while a stop is draining, the close
+* request may not have been seen yet.
+* A file prepared ahead of a start gets nothing until the start.
+* Blocks are at most WRITER_BLOCK_FRAMES long, so the buffers behind the
+* encoders stop growing after the first one.
+*/
+static void writer_drain(writer_data_t *data, bool closing)
+{
+	const long state = os_atomic_load_long(&data->state);
+	const bool recording = state == WRITER_RECORDING && !data->session;
+	uint32_t left = writer_ring_queued(&data->ring);
+
+	data->stats->queue_frames = left;
+	if (left > data->stats->queue_max_frames) data->stats->queue_max_frames = left;
+	writer_update_degraded(data, left);
+
+	// a recording started again before the last one was closed goes to the next file
+	if (!recording || closing) {
+		const int32_t until_stop = (int32_t)((uint32_t)os_atomic_load_long(&data->stop_position) - (uint32_t)data->ring.read_pos);
+		if (data->sink == NULL || !closing || until_stop <= 0) left = 0;
+		else if ((uint32_t)until_stop < left) left = (uint32_t)until_stop;
+	}
+
+	struct obs_audio_data audio = { 0 };
+	uint32_t frames;
+	for (;;) {
+		const uint32_t limit = left < WRITER_BLOCK_FRAMES ? left : WRITER_BLOCK_FRAMES;
+		if (limit == 0) break;
+
+		// an overwriting producer could change a block that is read in place while it is encoded
+		if (os_atomic_load_bool(&data->ring.overwrite)) {
+			frames = writer_ring_copy(&data->ring, &audio, data->ring_copy, limit);
+		}
+		else {
+			frames = writer_ring_peek(&data->ring, &audio);
+			if (frames > limit) audio.frames = frames = limit;
+		}
+		if (frames == 0) break;
+
+		const uint32_t intact = audio.frames;
+		if (intact > 0 && writer_convert_block(data, &audio)) writer_fanout_write(data, &audio);
+		writer_ring_advance(&data->ring, frames);
+		data->stats->frames_written += intact;
+		left -= frames;
+	}
+
+	if (state != WRITER_RECORDING && state != WRITER_DRAINING) {
+		const uint32_t queued = writer_ring_queued(&data->ring);
+		if (queued > data->preroll_frames) writer_ring_advance(&data->ring, queued - data->preroll_frames);
+	}
+}
+
+/*
+* Warms up the encoder and opens the file, for the filter and each extra
+* encoder. The sample buffer is sized for the largest block here, so the
+* packets of the recording do not allocate it.
+*/
+static void prepare_file(writer_data_t *data)
+{
+	pthread_mutex_lock(&data->output_lock);
+	encoder_t *encoder = data->encoder;
+	circlebuf_upsize(&data->interleaved_buffer, data->sample_info.speakers * WRITER_BLOCK_FRAMES * BYTES_PER_SAMPLE);
+	if (encoder->prepare && !encoder->prepare(data)) WRITER_LOG(LOG_WARNING, "failed to prepare the %s encoder", encoder->name);
+	pthread_mutex_unlock(&data->output_lock);
+	open_output(data);
+}
+
+/* frees the state of an encoder that is no longer selected, prepares the current one on request */
+static void writer_prepare(writer_data_t *data)
+{
+	// the settings swap the encoder under the lock
+	pthread_mutex_lock(&data->output_lock);
+	if (data->encoder != data->prepared_encoder) {
+		if (data->prepared_encoder && data->prepared_encoder->release) data->prepared_encoder->release(data);
+		data->prepared_encoder = data->encoder;
+	}
+	pthread_mutex_unlock(&data->output_lock);
+
+	if (!os_atomic_load_bool(&data->prepare_requested)) return;
+	os_atomic_set_bool(&data->prepare_requested, false);
+
+	prepare_file(data);
+	writer_fanout_each(data, prepare_file);
+}
+
+/* a new pre-roll length or memory limit takes effect between recordings, the kept audio is lost */
+static void writer_update_ring(writer_data_t *data)
+{
+	if (writer_recording(data) || data->sink != NULL) return;
+	if (writer_ring_frames(data) == data->ring_wanted_frames && data->memory_limit == data->ring_limit) return;
+
+	data->preroll_frames = 0;
+	writer_ring_resize(&data->ring, writer_memory_ring_frames(data));
+	data->preroll_frames = writer_ring_preroll(data);
+}
+
+/*
+* Rewrites the header sizes and syncs the file every checkpoint_interval
+* seconds, so a crash leaves a playable file missing at most one interval.
+* One sync per interval keeps syscalls off the per-packet path.
+*/
+static void checkpoint_file(writer_data_t *data)
+{
+	pthread_mutex_lock(&data->output_lock);
+	if (data->sink != NULL) {
+		if (data->encoder->write_checkpoint) data->encoder->write_checkpoint(data);
+		silence_gate_flush(data);
+		if (data->output->sync) data->output->sync(data->sink);
+	}
+	pthread_mutex_unlock(&data->output_lock);
+}
+
+static void writer_checkpoint(writer_data_t *data)
+{
+	if (data->checkpoint_interval == 0) return;
+
+	const uint64_t now = os_gettime_ns();
+	if (now - data->last_checkpoint_time < data->checkpoint_interval * 1000000000ULL) return;
+	data->last_checkpoint_time = now;
+
+	checkpoint_file(data);
+	writer_fanout_each(data, checkpoint_file);
+}
+
+static void writer_report_drops(writer_data_t *data)
+{
+	long dropped = writer_ring_lost(&data->ring);
+	if (dropped != data->dropped_frames_reported) {
+		WRITER_LOG(LOG_WARNING, "writer queue overflow, %ld frames dropped so far", dropped);
+		data->dropped_frames_reported = dropped;
+	}
+}
+
+static void *writer_thread(void *param)
+{
+	writer_data_t *data = param;
+	bool stopping = false;
+
+	os_set_thread_name("audio-writer-filter: writer");
+	writer_trace_thread_name("audio-writer-filter: writer");
+
+	while (!stopping) {
+		os_event_timedwait(data->writer_event, WRITER_POLL_MS);
+		stopping = !os_atomic_load_bool(&data->writer_active);
+
+		writer_convert_update(data);
+		writer_prepare(data);
+
+		// the flag is read before the stop position it guards
+		const bool closing = os_atomic_load_bool(&data->close_requested);
+		if (closing) os_atomic_set_bool(&data->close_requested, false);
+
+		if (data->merging) writer_session_merge(data->merging, data);
+		writer_drain(data, closing);
+		if (closing) {
+			writer_convert_flush(data);
+			close_output(data);
+			writer_fanout_each(data, close_output);
+			// a start that came meanwhile has moved the state on already
+			os_atomic_compare_swap_long(&data->state, WRITER_DRAINING, WRITER_CLOSED);
+			if (data->trace) {
+				pthread_mutex_lock(&data->output_lock);
+				char *folder = bstrdup(data->output_folder);
+				pthread_mutex_unlock(&data->output_lock);
+				writer_trace_dump(folder);
+				bfree(folder);
+			}
+		}
+
+		writer_update_ring(data);
+		writer_checkpoint(data);
+		writer_report_drops(data);
+		writer_stats_report(data);
+	}
+
+	return NULL;
+}
+
+bool writer_thread_start(writer_data_t *data)
+{
+	if (os_event_init(&data->writer_event, OS_EVENT_TYPE_AUTO) != 0) return false;
+
+	os_atomic_set_bool(&data->writer_active, true);
+	if (pthread_create(&data->writer_thread, NULL, writer_thread, data) != 0) {
+		os_atomic_set_bool(&data->writer_active, false);
+		os_event_destroy(data->writer_event);
+		data->writer_event = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* flushes everything still queued and joins the thread */
+void writer_thread_stop(writer_data_t *data)
+{
+	if (!os_atomic_load_bool(&data->writer_active)) return;
+
+	os_atomic_set_bool(&data->writer_active, false);
+	os_event_signal(data->writer_event);
+	pthread_join(data->writer_thread, NULL);
+
+	os_event_destroy(data->writer_event);
+	data->writer_event = NULL;
+}
+
+/* asks the writer thread to warm up the encoder and open the file */
+void writer_thread_request_prepare(writer_data_t *data)
+{
+	os_atomic_set_bool(&data->prepare_requested, true);
+	if (data->writer_event) os_event_signal(data->writer_event);
+}
+
+/* asks the writer thread to close the output once the queued frames are written */
+void writer_thread_request_close(writer_data_t *data)
+{
+	os_atomic_set_bool(&data->close_requested, true);
+	if (data->writer_event) os_event_signal(data->writer_event);
+}
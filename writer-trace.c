@@ -0,0 +1,229 @@
+#include "audio-writer-filter.h"
+#include "writer-trace.h"
+
+/*
+* Hot-path tracing. Every thread that records an event takes a buffer of its
+* own on its first event, so recording is a few stores and one release of
+* the event count, without locks. The buffers are allocated when a filter
+* turns tracing on and after each dump, a thread that finds no spare one
+* records nothing until then. A buffer keeps the last TRACE_EVENTS events,
+* older ones are overwritten. The buffers live until the module is unloaded,
+* a dump only moves their watermarks.
+* A dump is a Chrome trace-event JSON file, it opens in chrome://tracing and
+* in the Perfetto UI. Events recorded while a dump runs may come out torn,
+* the dump skips the ones that do not make sense.
+*/
+
+#define TRACE_EVENTS 16384 // per thread, a power of two
+#define TRACE_SPARE_BUFFERS 4 // kept ready by each filter that turns tracing on: audio, writer, io and chunk threads
+#define TRACE_FILENAME_FORMAT "audio-writer-trace %CCYY-%MM-%DD %hh-%mm-%ss"
+
+#define TRACE_LOG(level, format, ...) blog(level, "[audio writer filter (trace)] " format, ##__VA_ARGS__)
+
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+typedef struct {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+} trace_event_t;
+
+typedef struct trace_buffer {
+	struct trace_buffer *next;
+	struct trace_buffer *next_spare;
+	uint32_t id;
+	const char *thread_name;
+	volatile long count;    // free-running, written by the owning thread only
+	uint32_t dumped;        // count at the last dump, under the registry lock
+	trace_event_t events[TRACE_EVENTS];
+} trace_buffer_t;
+
+volatile long writer_trace_users = 0;
+
+static TRACE_THREAD_LOCAL trace_buffer_t *thread_buffer;
+static TRACE_THREAD_LOCAL const char *thread_name;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *buffers;
+static uint32_t next_id = 1;
+
+// the spare lock is only held to unlink a buffer, never around file writes as the registry lock is
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *spare_buffers;
+static size_t spare_count;
+
+/* tops the spare buffers up, not called from the audio thread */
+static void create_spare_buffers(void)
+{
+	pthread_mutex_lock(&spare_lock);
+	const size_t missing = spare_count < TRACE_SPARE_BUFFERS ? TRACE_SPARE_BUFFERS - spare_count : 0;
+	pthread_mutex_unlock(&spare_lock);
+
+	for (size_t i = 0; i < missing; i++) {
+		trace_buffer_t *buffer = bzalloc(sizeof(trace_buffer_t));
+
+		// registered right away, the dump skips buffers without events
+		pthread_mutex_lock(&registry_lock);
+		buffer->id = next_id++;
+		buffer->next = buffers;
+		buffers = buffer;
+		pthread_mutex_unlock(&registry_lock);
+
+		pthread_mutex_lock(&spare_lock);
+		buffer->next_spare = spare_buffers;
+		spare_buffers = buffer;
+		spare_count++;
+		pthread_mutex_unlock(&spare_lock);
+	}
+}
+
+/* the first event of a thread takes a spare buffer, NULL when there is none left */
+static trace_buffer_t *take_buffer(void)
+{
+	pthread_mutex_lock(&spare_lock);
+	trace_buffer_t *buffer = spare_buffers;
+	if (buffer) {
+		spare_buffers = buffer->next_spare;
+		spare_count--;
+		buffer->thread_name = thread_name;
+	}
+	pthread_mutex_unlock(&spare_lock);
+
+	return buffer;
+}
+
+void writer_trace_record(const char *name, uint64_t start, uint64_t end)
+{
+	trace_buffer_t *buffer = thread_buffer;
+	if (!buffer) buffer = thread_buffer = take_buffer();
+	if (!buffer) return;
+
+	const uint32_t count = (uint32_t)buffer->count;
+	trace_event_t *event = &buffer->events[count & (TRACE_EVENTS - 1)];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+	os_atomic_set_long(&buffer->count, (long)(count + 1));
+}
+
+void writer_trace_thread_name(const char *name)
+{
+	thread_name = name;
+	if (thread_buffer) thread_buffer->thread_name = name;
+}
+
+void writer_trace_use(bool enable)
+{
+	if (enable) {
+		// before the first event can be recorded, so the hot path never allocates
+		create_spare_buffers();
+		os_atomic_inc_long(&writer_trace_users);
+	}
+	else {
+		os_atomic_dec_long(&writer_trace_users);
+	}
+}
+
+static void write_string(FILE *file, const char *text)
+{
+	fputc('"', file);
+	for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+		if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+		else if (*c < 0x20) fprintf(file, "\\u%04x", *c);
+		else fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+/* has no sync, must be called inside locking registry_lock */
+static size_t write_buffer(FILE *file, trace_buffer_t *buffer, size_t written)
+{
+	const uint32_t count = (uint32_t)os_atomic_load_long(&buffer->count);
+	uint32_t first = buffer->dumped;
+	if (count - first > TRACE_EVENTS) first = count - TRACE_EVENTS;
+	buffer->dumped = count;
+	if (first == count) return written;
+
+	fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", written ? ",\n" : "", buffer->id);
+	if (buffer->thread_name) {
+		write_string(file, buffer->thread_name);
+	}
+	else {
+		fprintf(file, "\"thread %u\"", buffer->id);
+	}
+	fprintf(file, "}}");
+	written++;
+
+	for (uint32_t i = first; i != count; i++) {
+		const trace_event_t event = buffer->events[i & (TRACE_EVENTS - 1)];
+		if (!event.name || event.end < event.start) continue;
+
+		fprintf(file, ",\n{\"name\":");
+		write_string(file, event.name);
+		fprintf(file, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			buffer->id, (double)event.start / 1000.0, (double)(event.end - event.start) / 1000.0);
+		written++;
+	}
+
+	return written;
+}
+
+/*
+* Called on the writer thread when a recording is closed. Every filter that
+* traces dumps on its stop, the first one gets the events of all threads
+* and the others find nothing new unless their threads kept recording.
+*/
+void writer_trace_dump(const char *folder)
+{
+	struct dstr format = { 0 };
+	dstr_printf(&format, "%s/%s", folder && *folder ? folder : ".", TRACE_FILENAME_FORMAT);
+	char *path = os_generate_formatted_filename("json", true, format.array);
+	dstr_free(&format);
+	if (!path) return;
+
+	pthread_mutex_lock(&registry_lock);
+	bool pending = false;
+	for (trace_buffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+		if ((uint32_t)os_atomic_load_long(&buffer->count) != buffer->dumped) pending = true;
+	}
+
+	FILE *file = pending ? os_fopen(path, "w") : NULL;
+	if (file) {
+		size_t written = 0;
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		for (trace_buffer_t *buffer = buffers; buffer; buffer = buffer->next) written = write_buffer(file, buffer, written);
+		fprintf(file, "\n]}\n");
+		fclose(file);
+		TRACE_LOG(LOG_INFO, "%zu events written to '%s'", written, path);
+	}
+	else if (pending) {
+		TRACE_LOG(LOG_WARNING, "failed to open '%s'", path);
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	bfree(path);
+
+	// threads started since, such as the ones of the next segments, find spare buffers again
+	if (os_atomic_load_long(&writer_trace_users) > 0) create_spare_buffers();
+}
+
+/* when the module is unloaded, no thread records any more */
+void writer_trace_free(void)
+{
+	pthread_mutex_lock(&spare_lock);
+	spare_buffers = NULL;
+	spare_count = 0;
+	pthread_mutex_unlock(&spare_lock);
+
+	pthread_mutex_lock(&registry_lock);
+	while (buffers) {
+		trace_buffer_t *buffer = buffers;
+		buffers = buffer->next;
+		bfree(buffer);
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
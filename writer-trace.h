@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/platform.h"
+#include "util/threading.h"
+
+/*
+* Opt-in trace points of the writer pipeline, see writer-trace.c. A stage is
+* timed by writer_trace_begin and writer_trace_end. While no filter traces,
+* begin costs one load and returns 0, and end returns at once.
+*/
+
+extern volatile long writer_trace_users;
+
+static inline uint64_t writer_trace_begin(void)
+{
+	return os_atomic_load_long(&writer_trace_users) > 0 ? os_gettime_ns() : 0;
+}
+
+void writer_trace_record(const char *name, uint64_t start, uint64_t end);
+
+/* the name is kept until the trace is written, it must be a literal or live as long */
+static inline void writer_trace_end(const char *name, uint64_t start)
+{
+	if (start) writer_trace_record(name, start, os_gettime_ns());
+}
+
+/* names the events of the calling thread in the trace, does not allocate */
+void writer_trace_thread_name(const char *name);
+
+/* a filter turns tracing on or off, it runs while at least one has it on */
+void writer_trace_use(bool enable);
+
+/* writes the events recorded since the last dump into the folder */
+void writer_trace_dump(const char *folder);
+
+void writer_trace_free(void);